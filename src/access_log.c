@@ -0,0 +1,446 @@
+/*
+ * access_log.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "access_log.h"
+#include "http_connect.h"
+#include "log_async.h"
+
+enum ACCESS_VAR {
+	VAR_LITERAL = 0,
+	VAR_REMOTE_ADDR,
+	VAR_REMOTE_PORT,
+	VAR_REMOTE_USER,
+	VAR_TIME_LOCAL,
+	VAR_TIME_ISO8601,
+	VAR_MSEC,
+	VAR_REQUEST,
+	VAR_REQUEST_METHOD,
+	VAR_REQUEST_URI,
+	VAR_SERVER_PROTOCOL,
+	VAR_HOST,
+	VAR_STATUS,
+	VAR_BYTES_SENT,
+	VAR_BODY_BYTES_SENT,
+	VAR_REQUEST_TIME,
+	VAR_UPSTREAM_RESPONSE_TIME,
+	VAR_HTTP_REFERER,
+	VAR_HTTP_USER_AGENT,
+	VAR_HTTP_X_FORWARDED_FOR,
+	VAR_CONNECTION_REQUESTS,
+	VAR_PID
+};
+
+static const struct {
+	const char* name;
+	unsigned short var;
+} variables[] = {
+	{ "remote_addr",			VAR_REMOTE_ADDR },
+	{ "remote_port",			VAR_REMOTE_PORT },
+	{ "remote_user",			VAR_REMOTE_USER },
+	{ "time_local",				VAR_TIME_LOCAL },
+	{ "time_iso8601",			VAR_TIME_ISO8601 },
+	{ "msec",					VAR_MSEC },
+	{ "request",				VAR_REQUEST },
+	{ "request_method",			VAR_REQUEST_METHOD },
+	{ "request_uri",			VAR_REQUEST_URI },
+	{ "uri",					VAR_REQUEST_URI },
+	{ "server_protocol",		VAR_SERVER_PROTOCOL },
+	{ "host",					VAR_HOST },
+	{ "status",					VAR_STATUS },
+	{ "bytes_sent",				VAR_BYTES_SENT },
+	{ "body_bytes_sent",		VAR_BODY_BYTES_SENT },
+	{ "request_time",			VAR_REQUEST_TIME },
+	{ "upstream_response_time",	VAR_UPSTREAM_RESPONSE_TIME },
+	{ "http_referer",			VAR_HTTP_REFERER },
+	{ "http_user_agent",		VAR_HTTP_USER_AGENT },
+	{ "http_x_forwarded_for",	VAR_HTTP_X_FORWARDED_FOR },
+	{ "connection_requests",	VAR_CONNECTION_REQUESTS },
+	{ "pid",					VAR_PID },
+};
+
+static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE",
+		"OPTIONS", "CONNECT", "PATCH" };
+
+static const char* combined_format =
+		"$remote_addr - $remote_user [$time_local] \"$request\" $status $body_bytes_sent "
+		"\"$http_referer\" \"$http_user_agent\"";
+
+/* one JSON object per line for the log pipeline */
+static const char* jsonl_format =
+		"{\"time\":\"$time_iso8601\",\"remote_addr\":\"$remote_addr\","
+		"\"request_method\":\"$request_method\",\"request_uri\":\"$request_uri\","
+		"\"server_protocol\":\"$server_protocol\",\"host\":\"$host\",\"status\":$status,"
+		"\"bytes_sent\":$bytes_sent,\"body_bytes_sent\":$body_bytes_sent,"
+		"\"request_time\":$request_time,\"upstream_response_time\":\"$upstream_response_time\","
+		"\"http_referer\":\"$http_referer\",\"http_user_agent\":\"$http_user_agent\"}";
+
+static log_handle_t access_log;
+static bool access_log_opened = FALSE;
+
+/* 时间字符串每秒只格式化一次 */
+static __thread time_t cached_second = 0;
+static __thread char cached_local[32];
+static __thread char cached_iso8601[32];
+
+static int add_literal(access_format_t* format, const char* text, size_t length)
+{
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	if (format->literal_length + length > ACCESS_FORMAT_TEXT
+			|| format->ops_number == ACCESS_FORMAT_OPS)
+	{
+		return -1;
+	}
+
+	access_op_t* op = &format->ops[format->ops_number++];
+	op->var = VAR_LITERAL;
+	op->offset = format->literal_length;
+	op->length = length;
+	memcpy(format->literal + op->offset, text, length);
+	format->literal_length += length;
+	return 0;
+}
+
+int access_format_compile(access_format_t* format, const char* text, const char* escape,
+		char* errbuf, size_t errlen)
+{
+	memset(format, 0, sizeof(access_format_t));
+	if (strcmp(escape, "json") == 0)
+	{
+		format->json = TRUE;
+	}
+	else if (strcmp(escape, "default") != 0)
+	{
+		snprintf(errbuf, errlen, "unknown escape \"%s\"", escape);
+		return -1;
+	}
+
+	const char* p = text;
+	while (*p)
+	{
+		const char* dollar = strchr(p, '$');
+		size_t length = dollar ? (size_t)(dollar - p) : strlen(p);
+		if (add_literal(format, p, length) < 0)
+		{
+			snprintf(errbuf, errlen, "log_format is too long");
+			return -1;
+		}
+		if (dollar == NULL)
+		{
+			break;
+		}
+
+		/* $name or ${name} */
+		const char* name = dollar + 1;
+		bool braces = *name == '{';
+		name += braces;
+		length = strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_");
+		if (length == 0 || (braces && name[length] != '}'))
+		{
+			snprintf(errbuf, errlen, "invalid variable name in log_format");
+			return -1;
+		}
+
+		size_t i = 0;
+		for (; i<sizeof(variables) / sizeof(variables[0]); i++)
+		{
+			if (strlen(variables[i].name) == length && strncmp(variables[i].name, name, length) == 0)
+			{
+				break;
+			}
+		}
+		if (i == sizeof(variables) / sizeof(variables[0]))
+		{
+			snprintf(errbuf, errlen, "unknown variable \"$%.*s\" in log_format", (int)length, name);
+			return -1;
+		}
+		if (format->ops_number == ACCESS_FORMAT_OPS)
+		{
+			snprintf(errbuf, errlen, "log_format is too long");
+			return -1;
+		}
+		format->ops[format->ops_number++].var = variables[i].var;
+		p = name + length + braces;
+	}
+	return 0;
+}
+
+int access_format_builtin(access_format_t* format, const char* name)
+{
+	char err[128];
+	if (strcmp(name, "combined") == 0)
+	{
+		return access_format_compile(format, combined_format, "default", err, sizeof(err));
+	}
+	if (strcmp(name, "jsonl") == 0)
+	{
+		return access_format_compile(format, jsonl_format, "json", err, sizeof(err));
+	}
+	return -1;
+}
+
+/* copy s escaping what could break the line: \xXX like nginx, or JSON
+ * escapes; a missing value is "-", or empty inside a JSON string */
+static char* put_string(char* q, char* end, const char* s, bool json)
+{
+	static const char hex[] = "0123456789abcdef";
+	if (s == NULL || *s == '\0')
+	{
+		if (!json && q < end)
+		{
+			*q++ = '-';
+		}
+		return q;
+	}
+
+	for (; *s && q < end; s++)
+	{
+		unsigned char c = *s;
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+		{
+			*q++ = c;
+		}
+		else if (json && (c == '"' || c == '\\') && end - q >= 2)
+		{
+			*q++ = '\\';
+			*q++ = c;
+		}
+		else if (json && c >= 0x7f)
+		{
+			*q++ = c;
+		}
+		else if (json && end - q >= 6)
+		{
+			memcpy(q, "\\u00", 4);
+			q[4] = hex[c >> 4];
+			q[5] = hex[c & 0xf];
+			q += 6;
+		}
+		else if (!json && end - q >= 4)
+		{
+			q[0] = '\\';
+			q[1] = 'x';
+			q[2] = hex[c >> 4];
+			q[3] = hex[c & 0xf];
+			q += 4;
+		}
+		else
+		{
+			break;
+		}
+	}
+	return q;
+}
+
+static char* put_text(char* q, char* end, const char* s, size_t length)
+{
+	length = length < (size_t)(end - q) ? length : (size_t)(end - q);
+	memcpy(q, s, length);
+	return q + length;
+}
+
+static char* put_uint(char* q, char* end, unsigned long v)
+{
+	char digits[24];
+	int n = 0;
+	do
+	{
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (n > 0 && q < end)
+	{
+		*q++ = digits[--n];
+	}
+	return q;
+}
+
+/* microseconds as seconds with millisecond resolution, "12.345" */
+static char* put_msec(char* q, char* end, unsigned long usec)
+{
+	unsigned long ms = usec / 1000;
+	q = put_uint(q, end, ms / 1000);
+	if (end - q >= 4)
+	{
+		q[0] = '.';
+		q[1] = '0' + ms / 100 % 10;
+		q[2] = '0' + ms / 10 % 10;
+		q[3] = '0' + ms % 10;
+		q += 4;
+	}
+	return q;
+}
+
+static void update_time_cache(time_t now)
+{
+	struct tm tm;
+	localtime_r(&now, &tm);
+	strftime(cached_local, sizeof(cached_local), "%d/%b/%Y:%H:%M:%S %z", &tm);
+	strftime(cached_iso8601, sizeof(cached_iso8601), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	cached_second = now;
+}
+
+void access_log_request(http_conn* conn)
+{
+	const access_format_t* format = &conn->conf->access_format;
+	if (!access_log_opened || conn->conf->access_log[0] == '\0')
+	{
+		return;
+	}
+
+	char* line = log_async_reserve(&access_log);
+	if (line == NULL)
+	{
+		return;
+	}
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned long now = (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+	unsigned long elapsed = conn->cold->start_usec && now > conn->cold->start_usec ? now - conn->cold->start_usec : 0;
+	const char* method = conn->cold->version ? method_names[conn->method] : NULL;
+	char addr[INET_ADDRSTRLEN];
+
+	char* q = line;
+	char* end = line + LOG_LINE_MAX - 1;
+	int i = 0;
+	for (; i<format->ops_number; i++)
+	{
+		const access_op_t* op = &format->ops[i];
+		switch (op->var)
+		{
+		case VAR_LITERAL:
+			q = put_text(q, end, format->literal + op->offset, op->length);
+			break;
+		case VAR_REMOTE_ADDR:
+			inet_ntop(AF_INET, &conn->cold->address.sin_addr, addr, sizeof(addr));
+			q = put_text(q, end, addr, strlen(addr));
+			break;
+		case VAR_REMOTE_PORT:
+			q = put_uint(q, end, ntohs(conn->cold->address.sin_port));
+			break;
+		case VAR_REMOTE_USER:
+		case VAR_UPSTREAM_RESPONSE_TIME:
+			/* 没有认证也没有上游服务器 */
+			q = put_string(q, end, NULL, format->json);
+			break;
+		case VAR_TIME_LOCAL:
+		case VAR_TIME_ISO8601:
+			if (tv.tv_sec != cached_second)
+			{
+				update_time_cache(tv.tv_sec);
+			}
+			q = put_string(q, end, op->var == VAR_TIME_LOCAL ? cached_local : cached_iso8601,
+					format->json);
+			break;
+		case VAR_MSEC:
+			q = put_msec(q, end, now);
+			break;
+		case VAR_REQUEST:
+			if (conn->cold->version == NULL)
+			{
+				q = put_string(q, end, NULL, format->json);
+				break;
+			}
+			q = put_string(q, end, method, format->json);
+			q = put_text(q, end, " ", 1);
+			q = put_string(q, end, conn->cold->url, format->json);
+			q = put_text(q, end, " ", 1);
+			q = put_string(q, end, conn->cold->version, format->json);
+			break;
+		case VAR_REQUEST_METHOD:
+			q = put_string(q, end, method, format->json);
+			break;
+		case VAR_REQUEST_URI:
+			q = put_string(q, end, conn->cold->url, format->json);
+			break;
+		case VAR_SERVER_PROTOCOL:
+			q = put_string(q, end, conn->cold->version, format->json);
+			break;
+		case VAR_HOST:
+			q = put_string(q, end, conn->cold->host, format->json);
+			break;
+		case VAR_STATUS:
+			q = put_uint(q, end, conn->status);
+			break;
+		case VAR_BYTES_SENT:
+			q = put_uint(q, end, conn->bytes_sent);
+			break;
+		case VAR_BODY_BYTES_SENT:
+			q = put_uint(q, end, conn->bytes_sent > conn->header_length
+					? conn->bytes_sent - conn->header_length : 0);
+			break;
+		case VAR_REQUEST_TIME:
+			q = put_msec(q, end, elapsed);
+			break;
+		case VAR_HTTP_REFERER:
+			q = put_string(q, end, conn->cold->referer, format->json);
+			break;
+		case VAR_HTTP_USER_AGENT:
+			q = put_string(q, end, conn->cold->user_agent, format->json);
+			break;
+		case VAR_HTTP_X_FORWARDED_FOR:
+			q = put_string(q, end, conn->cold->forwarded_for, format->json);
+			break;
+		case VAR_CONNECTION_REQUESTS:
+			q = put_uint(q, end, conn->requests + 1);
+			break;
+		case VAR_PID:
+			q = put_uint(q, end, getpid());
+			break;
+		}
+	}
+	*q++ = '\n';
+	log_async_commit(&access_log, line, q - line);
+}
+
+int access_log_open(const char* path)
+{
+	log_globals_init(&access_log);
+	if (log_init(&access_log, path, NULL) < 0)
+	{
+		return -1;
+	}
+	if (log_async_start(&access_log, LOG_OVERFLOW_DROP, NULL) < 0)
+	{
+		return -1;
+	}
+	access_log_opened = TRUE;
+	return 0;
+}
+
+void access_log_reopen(void)
+{
+	if (access_log_opened)
+	{
+		log_logrotate(&access_log, 0);
+	}
+}
+
+void access_log_close(void)
+{
+	if (access_log_opened)
+	{
+		log_async_stop(&access_log);
+		access_log_opened = FALSE;
+	}
+}
+
+unsigned long access_log_dropped(void)
+{
+	return access_log_opened ? log_async_dropped(&access_log) : 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * access_log.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+typedef enum BOOL bool;
+
+#define ACCESS_FORMAT_OPS 64
+#define ACCESS_FORMAT_TEXT 1024
+
+/* a log_format compiled into literal text and variables */
+typedef struct access_op_s access_op_t;
+struct access_op_s {
+	unsigned short var;				//0表示literal中的文字
+	unsigned short offset;
+	unsigned short length;
+};
+
+typedef struct access_format_s access_format_t;
+struct access_format_s {
+	int ops_number;
+	int literal_length;				//literal中已经使用的字节数
+	bool json;						//escape=json, 变量按JSON字符串转义
+	access_op_t ops[ACCESS_FORMAT_OPS];
+	char literal[ACCESS_FORMAT_TEXT];
+};
+
+/* compile the concatenated log_format strings; escape is "default" or
+ * "json". Returns -1 with errbuf set on an unknown variable. */
+int access_format_compile(access_format_t* format, const char* text, const char* escape,
+		char* errbuf, size_t errlen);
+
+/* the built-in formats "combined" and "jsonl", -1 for other names */
+int access_format_builtin(access_format_t* format, const char* name);
+
+/* open path and let a log thread write it; workers only, after fork and
+ * with signals blocked like log_async_start() */
+int access_log_open(const char* path);
+
+/* format the finished request of conn into the calling thread's buffer */
+struct http_conn;
+void access_log_request(struct http_conn* conn);
+
+/* reopen the file after it was rotated */
+void access_log_reopen(void);
+
+/* flush and stop the log thread */
+void access_log_close(void);
+
+/* lines lost because the writer fell behind */
+unsigned long access_log_dropped(void);
+
+#endif /* ACCESS_LOG_H_ */
@@ -0,0 +1,77 @@
+/*
+ * arena.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "mem.h"
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(arena_t* arena)
+{
+	arena->blocks = NULL;
+	arena_reset(arena);
+}
+
+/* the block after the current one that holds size bytes; the blocks kept
+ * from earlier requests are tried first, a too small one is skipped */
+static arena_block_t* next_block(arena_t* arena, size_t size)
+{
+	arena_block_t** link = arena->current ? &arena->current->next : &arena->blocks;
+	for (; *link; link=&(*link)->next)
+	{
+		if ((*link)->size >= size)
+		{
+			return *link;
+		}
+	}
+
+	size_t bytes = size > ARENA_BLOCK_SIZE ? ALIGN_UP(size) : ARENA_BLOCK_SIZE;
+	arena_block_t* block = (arena_block_t*)malloc(sizeof(arena_block_t) + bytes);
+	if (block == NULL)
+	{
+		return NULL;
+	}
+	mem_add(MEM_BUFFERS, sizeof(arena_block_t) + bytes);
+	block->size = bytes;
+	block->next = NULL;
+	*link = block;
+	return block;
+}
+
+void* arena_alloc(arena_t* arena, size_t size)
+{
+	size = ALIGN_UP(size);
+	if (__builtin_expect((size_t)(arena->end - arena->pos) < size, 0))
+	{
+		arena_block_t* block = next_block(arena, size);
+		if (block == NULL)
+		{
+			return NULL;
+		}
+		arena->current = block;
+		arena->pos = block->data;
+		arena->end = block->data + block->size;
+	}
+	void* p = arena->pos;
+	arena->pos += size;
+	return p;
+}
+
+void arena_free(arena_t* arena)
+{
+	arena_block_t* block = arena->blocks;
+	while (block)
+	{
+		arena_block_t* next = block->next;
+		mem_sub(MEM_BUFFERS, sizeof(arena_block_t) + block->size);
+		free(block);
+		block = next;
+	}
+	arena_init(arena);
+}
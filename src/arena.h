@@ -0,0 +1,54 @@
+/*
+ * arena.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/* smallest block chained when the current one is full */
+#define ARENA_BLOCK_SIZE 8192
+/* every allocation is aligned to this */
+#define ARENA_ALIGN 16
+
+typedef struct arena_block_s arena_block_t;
+struct arena_block_s {
+	arena_block_t* next;
+	size_t size;				/* bytes of data */
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/* bump allocator for the data of one request: nothing is freed on its
+ * own, arena_reset() drops everything at once; a connection that never
+ * allocates has no block, chained blocks are kept for the next request of
+ * the connection and freed by arena_free() */
+typedef struct arena_s arena_t;
+struct arena_s {
+	char* pos;					//当前块中下一次分配的位置
+	char* end;					//当前块的结尾
+	arena_block_t* current;		//正在分配的块， NULL时这个请求还没有分配
+	arena_block_t* blocks;		//链接块， 按使用的顺序
+};
+
+void arena_init(arena_t* arena);
+
+/* size bytes aligned to ARENA_ALIGN, NULL if no block can be chained */
+void* arena_alloc(arena_t* arena, size_t size);
+
+/* forget every allocation, the blocks stay and the next allocation starts
+ * in the first of them */
+static inline void arena_reset(arena_t* arena)
+{
+	arena->pos = NULL;
+	arena->end = NULL;
+	arena->current = NULL;
+}
+
+/* free the chained blocks, the arena can be used again after arena_init() */
+void arena_free(arena_t* arena);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,643 @@
+/*
+ * bench.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ *
+ * Microbenchmarks of the request path without a network: parsing, building
+ * the response, the thread pool handoff and logging, each reported as ns,
+ * allocations and (where perf counters can be opened) cycles per operation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "thread_pool.h"
+#include "http_connect.h"
+#include "config.h"
+#include "log.h"
+#include "log_async.h"
+
+/* requests of the built-in corpus, as browsers and tools send them */
+typedef struct corpus_s corpus_t;
+struct corpus_s {
+	const char* name;
+	const char* request;
+	int length;
+};
+
+#define CORPUS_MAX 32
+
+static corpus_t corpus[CORPUS_MAX] = {
+	{ "browser", "GET /index.html HTTP/1.1\r\n"
+			"Host: localhost:8080\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+			"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+			"Accept-Language: en-US,en;q=0.5\r\n"
+			"Accept-Encoding: gzip, deflate, br\r\n"
+			"Referer: http://localhost:8080/\r\n"
+			"Connection: keep-alive\r\n"
+			"Upgrade-Insecure-Requests: 1\r\n\r\n", 0 },
+	{ "curl", "GET / HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n", 0 },
+	{ "not_found", "GET /missing.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", 0 },
+	{ "bad_version", "GET /index.html HTTP/1.0\r\n\r\n", 0 },
+};
+static int corpus_number = 4;
+
+/* allocations of the whole process, every thread included */
+static volatile unsigned long allocations = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t number, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t number, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_calloc(number, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_realloc(ptr, size);
+}
+
+/* cycles, L1 data cache read misses and last level cache misses */
+#define COUNTERS 3
+
+static const char* counter_names[COUNTERS] = { "cycles/op", "L1d-miss/op", "LLC-miss/op" };
+static int counter_fds[COUNTERS] = { -1, -1, -1 };
+
+/* counters of the calling thread in user space, -1 where perf is not allowed */
+static void open_counters(void)
+{
+	static const unsigned long configs[COUNTERS][2] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	};
+	int i = 0;
+	for (; i<COUNTERS; i++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = configs[i][0];
+		attr.size = sizeof(attr);
+		attr.config = configs[i][1];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static unsigned long now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(void* arg, long iterations);
+
+static long iterations = 200000;
+static const char* only = NULL;
+
+static void run(const char* name, bench_fn fn, void* arg)
+{
+	if (only && strstr(name, only) == NULL)
+	{
+		return;
+	}
+
+	/* 预热， 让各线程的环形缓冲区和直方图先分配好 */
+	fn(arg, iterations / 10 + 1);
+
+	int c = 0;
+	for (; c<COUNTERS; c++)
+	{
+		if (counter_fds[c] >= 0)
+		{
+			ioctl(counter_fds[c], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	unsigned long allocated = allocations;
+	unsigned long start = now_nsec();
+	fn(arg, iterations);
+	unsigned long elapsed = now_nsec() - start;
+	allocated = allocations - allocated;
+	unsigned long counts[COUNTERS];
+	for (c=0; c<COUNTERS; c++)
+	{
+		counts[c] = 0;
+		if (counter_fds[c] >= 0)
+		{
+			ioctl(counter_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter_fds[c], &counts[c], sizeof(counts[c])) != sizeof(counts[c]))
+			{
+				counts[c] = 0;
+			}
+		}
+	}
+
+	printf("%-32s %10.1f %10.2f", name, (double)elapsed / iterations,
+			(double)allocated / iterations);
+	for (c=0; c<COUNTERS; c++)
+	{
+		if (counter_fds[c] >= 0)
+		{
+			printf(" %11.2f", (double)counts[c] / iterations);
+		}
+		else
+		{
+			printf(" %11s", "-");
+		}
+	}
+	printf("\n");
+}
+
+static http_conn* new_conn(void)
+{
+	http_conn* conn = NULL;
+	if (posix_memalign((void**)&conn, CACHE_LINE_SIZE, sizeof(http_conn)) != 0)
+	{
+		exit(1);
+	}
+	memset(conn, 0, sizeof(http_conn));
+	conn->cold = (http_conn_cold*)calloc(1, sizeof(http_conn_cold));
+	if (conn->cold == NULL)
+	{
+		exit(1);
+	}
+	conn->sockfd = -1;
+	conn->epollfd = -1;
+	conn->cpu = -1;
+	arena_init(&conn->cold->arena);
+	return conn;
+}
+
+/* what process() does for a request that arrived in one read */
+static void bench_parse(void* arg, long n)
+{
+	const corpus_t* c = (const corpus_t*)arg;
+	static http_conn* conn = NULL;
+	conn = conn ? conn : new_conn();
+	long i = 0;
+	for (; i<n; i++)
+	{
+		init(conn);
+		memcpy(conn->cold->read_buf, c->request, c->length);
+		conn->read_index = c->length;
+		conn->process_start = latency_now();
+		parse_request(conn);
+		unmap(conn);
+	}
+}
+
+static void bench_fill(void* arg, long n)
+{
+	http_code code = (http_code)(long)arg;
+	static http_conn* conn = NULL;
+	static char body[1024];
+	if (conn == NULL)
+	{
+		conn = new_conn();
+		init(conn);
+		conn->linger = TRUE;
+	}
+	conn->file_address = body;
+	conn->cold->file_stat.st_size = sizeof(body);
+	long i = 0;
+	for (; i<n; i++)
+	{
+		conn->write_index = 0;
+		fill_respond(conn, code);
+	}
+	conn->file_address = NULL;
+}
+
+static void bench_add_reponse(void* arg, long n)
+{
+	static http_conn* conn = NULL;
+	conn = conn ? conn : new_conn();
+	long i = 0;
+	for (; i<n; i++)
+	{
+		conn->write_index = 0;
+		add_reponse(conn, "Content-Length: %d\r\n", 1024);
+	}
+}
+
+/* what a request does with its arena: a few small pieces, then reset */
+static void bench_arena(void* arg, long n)
+{
+	static http_conn* conn = NULL;
+	conn = conn ? conn : new_conn();
+	long i = 0;
+	for (; i<n; i++)
+	{
+		arena_reset(&conn->cold->arena);
+		arena_alloc(&conn->cold->arena, 64);
+		arena_alloc(&conn->cold->arena, 200);
+		arena_alloc(&conn->cold->arena, STATUS_PAGE_SIZE);
+	}
+}
+
+/* a pool thread calls process(), which stamps process_start first; the
+ * connections have nothing to read so the worker only re-arms them */
+#define HANDOFF_BATCH 64
+
+static thread_pool* pool = NULL;
+static http_conn* handoff_conns[HANDOFF_BATCH];
+
+static void handoff(long n, int batch)
+{
+	long i = 0;
+	for (; i<n; i+=batch)
+	{
+		int j = 0;
+		for (; j<batch; j++)
+		{
+			handoff_conns[j]->process_start = 0;
+			while (!add_conn(pool, handoff_conns[j]))
+			{
+				sched_yield();
+			}
+		}
+		for (j=0; j<batch; j++)
+		{
+			while (*(volatile unsigned long*)&handoff_conns[j]->process_start == 0)
+			{
+				__asm__ __volatile__("pause");
+			}
+		}
+	}
+}
+
+static void bench_handoff(void* arg, long n)
+{
+	handoff(n, 1);
+}
+
+static void bench_handoff_batch(void* arg, long n)
+{
+	handoff(n, HANDOFF_BATCH);
+}
+
+static void bench_log(void* arg, long n)
+{
+	log_handle_t* log = (log_handle_t*)arg;
+	long i = 0;
+	for (; i<n; i++)
+	{
+		_log(log, "bench", __FILE__, __FUNCTION__, __LINE__, LOG_INFO,
+				"request %s from %s status %d", "/index.html", "127.0.0.1", 200);
+	}
+}
+
+/* http_conn as it was before the hot and cold parts were split: the same
+ * fields in one struct, in the old order, to compare the cache misses */
+typedef struct flat_conn_s flat_conn_t;
+struct flat_conn_s {
+	queue_t head;
+	int sockfd;
+	int epollfd;
+	int cpu;
+	const config_t* conf;
+	struct sockaddr_in address;
+	char read_buf[READ_BUFFER_SIZE];
+	int read_index;
+	int check_index;
+	int start_line;
+	char write_buf[WRITE_BUFFER_SIZE];
+	int write_index;
+	check_state curr_state;
+	http_method method;
+	char real_file[FILENAME_LEN];
+	char* url;
+	char* version;
+	char* host;
+	char* user_agent;
+	char* referer;
+	char* forwarded_for;
+	int content_length;
+	bool linger;
+	int requests;
+	unsigned long start_usec;
+	int status;
+	int header_length;
+	long bytes_sent;
+	unsigned long request_start;
+	unsigned long enqueued;
+	unsigned long process_start;
+	unsigned long response_ready;
+	conn_event_t events[CONN_EVENTS];
+	unsigned int events_number;
+	unsigned int capture_id;
+	unsigned long capture_start;
+	char* file_address;
+	char* body;
+	struct stat file_stat;
+	struct iovec iv[2];
+	int iv_count;
+	arena_t arena;
+};
+
+static int table_connections = 100000;
+static http_conn* split_table = NULL;
+static flat_conn_t* flat_table = NULL;
+
+/* the state a keep-alive request reads and writes: the read event, the
+ * request line and headers parsed in place at the start of read_buf, the
+ * file lookup, the write event, then init(); cold is where the split
+ * http_conn keeps the rest, the flat one keeps it in c */
+#define TOUCH_REQUEST(c, cold) do {												\
+		if ((c)->sockfd != -1 && (c)->read_index < READ_BUFFER_SIZE)			\
+		{																		\
+			(c)->request_start = i;												\
+			(c)->read_index += 64;												\
+		}																		\
+		(cold)->start_usec = i;													\
+		(c)->enqueued = i;														\
+		(c)->process_start = i;													\
+		(cold)->read_buf[3] = '\0';												\
+		(cold)->url = (cold)->read_buf + 4 + ((cold)->read_buf[0] & 1);			\
+		(cold)->version = (cold)->url + 16;										\
+		(cold)->host = (cold)->url + 32;										\
+		(c)->check_index = (c)->read_index;										\
+		(c)->start_line = (c)->check_index;										\
+		(c)->curr_state = CHECK_STATE_CONTENT;									\
+		(c)->linger = (c)->conf == NULL;										\
+		(cold)->real_file[0] = '/';												\
+		(cold)->real_file[1] = (cold)->url[0];									\
+		(cold)->file_stat.st_size = 1024 + ((cold)->file_stat.st_mode & 1);		\
+		(c)->status = 200 + (c)->method;										\
+		(c)->write_index = 128;													\
+		(c)->header_length = (c)->write_index;									\
+		(c)->iv[0].iov_len = (c)->write_index;									\
+		(c)->iv[1].iov_base = (c)->file_address;								\
+		(c)->iv[1].iov_len = (cold)->file_stat.st_size;							\
+		(c)->iv_count = 2;														\
+		(c)->response_ready = i + (c)->epollfd;									\
+		(c)->bytes_sent += (c)->iv[0].iov_len + (c)->iv[1].iov_len;				\
+		(c)->requests++;														\
+		(c)->read_index = 0;													\
+		(c)->write_index = 0;													\
+	} while (0)
+
+static unsigned long next_random(unsigned long* x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+/* both tables the way setup_connection_table() leaves them, set up by the
+ * first table benchmark that runs; every page of every table is written
+ * here so the timed loops see cache misses, not first-touch page faults */
+static void setup_tables(void)
+{
+	if (split_table)
+	{
+		return;
+	}
+	http_conn_cold* cold = (http_conn_cold*)calloc(table_connections, sizeof(http_conn_cold));
+	flat_table = (flat_conn_t*)calloc(table_connections, sizeof(flat_conn_t));
+	if (cold == NULL || flat_table == NULL || posix_memalign((void**)&split_table,
+			CACHE_LINE_SIZE, sizeof(http_conn) * table_connections) != 0)
+	{
+		perror("connection tables");
+		exit(1);
+	}
+	memset(split_table, 0, sizeof(http_conn) * table_connections);
+	memset(cold, 0, sizeof(http_conn_cold) * table_connections);
+	memset(flat_table, 0, sizeof(flat_conn_t) * table_connections);
+	int i = 0;
+	for (; i<table_connections; i++)
+	{
+		split_table[i].cold = &cold[i];
+	}
+}
+
+/* one request on a random connection of the table */
+static void bench_table_split(void* arg, long n)
+{
+	setup_tables();
+	static unsigned long x = 88172645463325252UL;
+	long i = 0;
+	for (; i<n; i++)
+	{
+		http_conn* c = &split_table[next_random(&x) % table_connections];
+		TOUCH_REQUEST(c, c->cold);
+	}
+}
+
+static void bench_table_flat(void* arg, long n)
+{
+	setup_tables();
+	static unsigned long x = 88172645463325252UL;
+	long i = 0;
+	for (; i<n; i++)
+	{
+		flat_conn_t* c = &flat_table[next_random(&x) % table_connections];
+		TOUCH_REQUEST(c, c);
+	}
+}
+
+/* close_idle_connections() visiting every connection */
+static void bench_scan_split(void* arg, long n)
+{
+	setup_tables();
+	long i = 0;
+	long idle = 0;
+	for (; i<n; i++)
+	{
+		http_conn* c = &split_table[i % table_connections];
+		idle += c->sockfd != -1 && c->epollfd == 0 && c->requests > 0
+				&& c->read_index == 0 && c->write_index == 0;
+	}
+	*(volatile long*)arg = idle;
+}
+
+static void bench_scan_flat(void* arg, long n)
+{
+	setup_tables();
+	long i = 0;
+	long idle = 0;
+	for (; i<n; i++)
+	{
+		flat_conn_t* c = &flat_table[i % table_connections];
+		idle += c->sockfd != -1 && c->epollfd == 0 && c->requests > 0
+				&& c->read_index == 0 && c->write_index == 0;
+	}
+	*(volatile long*)arg = idle;
+}
+
+static int load_corpus(const char* filename)
+{
+	if (corpus_number == CORPUS_MAX)
+	{
+		fprintf(stderr, "too many requests, at most %d\n", CORPUS_MAX);
+		return -1;
+	}
+	FILE* fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		perror(filename);
+		return -1;
+	}
+	char* request = (char*)malloc(READ_BUFFER_SIZE);
+	int len = fread(request, 1, READ_BUFFER_SIZE, fp);
+	fclose(fp);
+	if (len <= 0 || len >= READ_BUFFER_SIZE)
+	{
+		fprintf(stderr, "%s: a request of 1 to %d bytes expected\n", filename, READ_BUFFER_SIZE - 1);
+		free(request);
+		return -1;
+	}
+
+	const char* name = strrchr(filename, '/');
+	corpus[corpus_number].name = name ? name + 1 : filename;
+	corpus[corpus_number].request = request;
+	corpus[corpus_number].length = len;
+	corpus_number++;
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-n iterations] [-b name] [-c connections] [request file ...]\n"
+			"  -n iterations  operations per benchmark (200000)\n"
+			"  -b name        only benchmarks whose name contains this\n"
+			"  -c connections connection table size of the table benchmarks (100000)\n"
+			"Each request file holds one raw request that is parsed as well.\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "n:b:c:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': iterations = atol(optarg); break;
+		case 'b': only = optarg; break;
+		case 'c': table_connections = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0 || table_connections <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	int i = 0;
+	for (; i<corpus_number; i++)
+	{
+		corpus[i].length = strlen(corpus[i].request);
+	}
+	for (i=optind; i<argc; i++)
+	{
+		if (load_corpus(argv[i]) < 0)
+		{
+			return 1;
+		}
+	}
+
+	/* 临时的网站根目录， 请求的文件都在内存中， 不会真的读磁盘 */
+	char root[] = "/tmp/jbench.XXXXXX";
+	if (mkdtemp(root) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/index.html", root);
+	FILE* fp = fopen(path, "w");
+	for (i=0; fp && i<16; i++)
+	{
+		fputs("<html><body>0123456789abcdef0123456789abcdef0123456789</body></html>\n", fp);
+	}
+	if (fp == NULL || fclose(fp) != 0)
+	{
+		perror(path);
+		return 1;
+	}
+
+	config_t* conf = config_default();
+	snprintf(conf->doc_root, sizeof(conf->doc_root), "%s", root);
+	config_publish(conf);
+
+	pool = create_thread_pool(1, HANDOFF_BATCH * 2, -1);
+	for (i=0; i<HANDOFF_BATCH; i++)
+	{
+		handoff_conns[i] = new_conn();
+		init(handoff_conns[i]);
+	}
+
+	open_counters();
+	printf("%-32s %10s %10s", "benchmark", "ns/op", "allocs/op");
+	for (i=0; i<COUNTERS; i++)
+	{
+		printf(" %11s", counter_names[i]);
+	}
+	printf("\n");
+
+	char name[64];
+	for (i=0; i<corpus_number; i++)
+	{
+		snprintf(name, sizeof(name), "parse_request %s", corpus[i].name);
+		run(name, bench_parse, &corpus[i]);
+	}
+	run("fill_respond file", bench_fill, (void*)(long)FILE_REQUEST);
+	run("fill_respond 404", bench_fill, (void*)(long)NO_RESOURCE);
+	run("add_reponse", bench_add_reponse, NULL);
+	run("arena_alloc", bench_arena, NULL);
+	run("add_conn/worker handoff", bench_handoff, NULL);
+	run("add_conn/worker handoff batch", bench_handoff_batch, NULL);
+
+	long idle = 0;
+	run("conn table request split", bench_table_split, NULL);
+	run("conn table request flat", bench_table_flat, NULL);
+	run("conn table scan split", bench_scan_split, &idle);
+	run("conn table scan flat", bench_scan_flat, &idle);
+
+	log_handle_t log;
+	char log_file[PATH_MAX];
+	snprintf(log_file, sizeof(log_file), "%s/bench.log", root);
+	log_globals_init(&log);
+	if (log_init(&log, log_file, NULL) == 0)
+	{
+		run("_log sync", bench_log, &log);
+		if (log_async_start(&log, LOG_OVERFLOW_BLOCK, NULL) == 0)
+		{
+			run("_log async", bench_log, &log);
+			log_async_stop(&log);
+		}
+	}
+
+	unlink(log_file);
+	unlink(path);
+	rmdir(root);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * capture.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "capture.h"
+#include "latency.h"
+#include "mem.h"
+
+/* filled only by its thread; a whole buffer is one write() to the file
+ * opened with O_APPEND, so buffers of threads and workers never interleave */
+typedef struct capture_buffer_s capture_buffer_t;
+struct capture_buffer_s {
+	int length;
+	unsigned long first;		//缓冲区中第一个记录的时间， 微秒
+	capture_buffer_t* next;
+	char data[CAPTURE_BUFFER_SIZE];
+};
+
+volatile int capture_enabled = 0;
+
+static int capture_fd = -1;
+static unsigned int next_conn = 0;
+static capture_buffer_t* buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread capture_buffer_t* my_buffer = NULL;
+
+int capture_open(const char* path)
+{
+	capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (capture_fd < 0)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(capture_fd, &st) < 0
+			|| (st.st_size == 0 && write(capture_fd, CAPTURE_MAGIC, 8) != 8))
+	{
+		close(capture_fd);
+		capture_fd = -1;
+		return -1;
+	}
+	capture_enabled = 1;
+	return 0;
+}
+
+void capture_attach(int slot)
+{
+	next_conn = (unsigned int)slot << 24;
+}
+
+static void flush_buffer(capture_buffer_t* buffer)
+{
+	if (buffer->length > 0 && write(capture_fd, buffer->data, buffer->length) < 0)
+	{
+		/* 磁盘满等错误时丢弃， 不影响请求的处理 */
+	}
+	buffer->length = 0;
+}
+
+static capture_buffer_t* thread_buffer(void)
+{
+	capture_buffer_t* buffer = my_buffer;
+	if (buffer == NULL)
+	{
+		buffer = (capture_buffer_t*)calloc(1, sizeof(capture_buffer_t));
+		if (buffer == NULL)
+		{
+			return NULL;
+		}
+		mem_add(MEM_INSTRUMENTATION, sizeof(capture_buffer_t));
+		pthread_mutex_lock(&buffers_lock);
+		buffer->next = buffers;
+		buffers = buffer;
+		pthread_mutex_unlock(&buffers_lock);
+		my_buffer = buffer;
+	}
+	return buffer;
+}
+
+static void add_record(unsigned int conn, unsigned long at, int type, const void* data, int length)
+{
+	capture_buffer_t* buffer = thread_buffer();
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	unsigned long now = latency_now() / 1000;
+	if (buffer->length + (int)sizeof(capture_record_t) + length > CAPTURE_BUFFER_SIZE
+			|| (buffer->length > 0 && now - buffer->first > CAPTURE_FLUSH_USEC))
+	{
+		flush_buffer(buffer);
+	}
+	if (buffer->length == 0)
+	{
+		buffer->first = now;
+	}
+
+	capture_record_t record;
+	record.conn = conn;
+	record.at = at < 0xffffffffUL ? at : 0xffffffffUL;
+	record.length = length;
+	record.type = type;
+	record.reserved = 0;
+	memcpy(buffer->data + buffer->length, &record, sizeof(record));
+	memcpy(buffer->data + buffer->length + sizeof(record), data, length);
+	buffer->length += sizeof(record) + length;
+}
+
+unsigned int capture_begin(unsigned long* start)
+{
+	unsigned int conn = __sync_fetch_and_add(&next_conn, 1);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned long wall = (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+	*start = latency_now() / 1000;
+	add_record(conn, 0, CAPTURE_OPEN, &wall, sizeof(wall));
+	return conn;
+}
+
+void capture_data(unsigned int conn, unsigned long start, const char* data, int length)
+{
+	/* 一次recv最多READ_BUFFER_SIZE字节， 总能放进一个记录 */
+	add_record(conn, latency_now() / 1000 - start, CAPTURE_DATA, data, length);
+}
+
+void capture_end(unsigned int conn, unsigned long start)
+{
+	add_record(conn, latency_now() / 1000 - start, CAPTURE_CLOSE, NULL, 0);
+}
+
+/* the other threads may still be capturing, a record they add meanwhile
+ * can be lost */
+void capture_close(void)
+{
+	if (!capture_enabled)
+	{
+		return;
+	}
+	capture_enabled = 0;
+
+	pthread_mutex_lock(&buffers_lock);
+	capture_buffer_t* buffer = buffers;
+	for (; buffer; buffer=buffer->next)
+	{
+		flush_buffer(buffer);
+	}
+	pthread_mutex_unlock(&buffers_lock);
+	close(capture_fd);
+	capture_fd = -1;
+}
@@ -0,0 +1,56 @@
+/*
+ * capture.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "common.h"
+
+/* the capture file starts with these 8 bytes, then records follow */
+#define CAPTURE_MAGIC "JHCAPT01"
+/* bytes a thread buffers before it appends them to the file */
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+/* a buffer is appended at the latest after this, if its thread captures */
+#define CAPTURE_FLUSH_USEC 1000000
+
+typedef enum {
+	CAPTURE_DATA = 0,		/* bytes read from the connection */
+	CAPTURE_OPEN,			/* accepted; 8 bytes of wall clock microseconds */
+	CAPTURE_CLOSE
+} capture_type_t;
+
+/* connection ids are unique in the file, the worker slot is in the top
+ * 8 bits; at is relative to the open of the connection */
+typedef struct capture_record_s capture_record_t;
+struct capture_record_s {
+	unsigned int conn;
+	unsigned int at;			/* microseconds */
+	unsigned short length;		/* bytes following the record */
+	unsigned char type;			/* capture_type_t */
+	unsigned char reserved;
+} __attribute__((packed));
+
+/* set while a capture file is open, checked before every capture call */
+extern volatile int capture_enabled;
+
+/* open path for appending, before fork so that the workers share it */
+int capture_open(const char* path);
+
+/* ids of the connections of this process start at slot << 24 */
+void capture_attach(int slot);
+
+/* a new connection, its id and its open time for the calls below */
+unsigned int capture_begin(unsigned long* start);
+
+void capture_data(unsigned int conn, unsigned long start, const char* data, int length);
+
+void capture_end(unsigned int conn, unsigned long start);
+
+/* append what every thread has buffered and stop capturing */
+void capture_close(void);
+
+#endif /* CAPTURE_H_ */
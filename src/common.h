@@ -8,6 +8,8 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#define CACHE_LINE_SIZE 64
+
 /* http request method */
 enum HTTP_METHOD {
 	GET = 0,
@@ -35,6 +37,7 @@ enum HTTP_CODE {
 	NO_RESOURCE,
 	FORBIDDEN_REQUEST,
 	FILE_REQUEST,
+	STATUS_REQUEST,
 	INTERNAL_ERROR,
 	CLOSED_CONNECTION
 };
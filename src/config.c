@@ -0,0 +1,1311 @@
+/*
+ * config.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "cpu_affinity.h"
+
+#define CONF_MAX_ARGS 16
+#define CONF_MAX_DEPTH 8
+/* threads that may call config_acquire */
+#define CONF_MAX_READERS 4096
+/* log_format names one file may define */
+#define CONF_MAX_FORMATS 8
+
+/* the file accepts both the "key=value" lines and <section> tags of the
+ * original format and nginx style "key value;" directives and {} blocks */
+enum TOKEN_TYPE {
+	TOKEN_EOF = 0,
+	TOKEN_WORD,
+	TOKEN_NEWLINE,
+	TOKEN_SEMICOLON,
+	TOKEN_BLOCK_START,
+	TOKEN_BLOCK_END,
+	TOKEN_SECTION_START,
+	TOKEN_SECTION_END
+};
+
+typedef struct parser_s parser_t;
+struct parser_s {
+	const char* filename;
+	char* pos;
+	int line;
+	char pending;
+	int directive_line;			//line the directive being parsed starts on
+	char* errbuf;
+	size_t errlen;
+
+	/* block nesting, "main" is depth 0 */
+	const char* context[CONF_MAX_DEPTH];
+	bool root_location[CONF_MAX_DEPTH];
+	bool section[CONF_MAX_DEPTH];	//opened by <name>, closed by </name>
+	int depth;
+	int servers;
+
+	char http_root[PATH_MAX];
+	char server_root[PATH_MAX];
+	char location_root[PATH_MAX];
+	char location_uri[CONF_NAME_LEN];	//uri of the location block being parsed
+
+	/* log_format definitions, looked up by access_log */
+	struct {
+		char name[32];
+		access_format_t format;
+	} formats[CONF_MAX_FORMATS];
+	int formats_number;
+	bool server_access_log;		//access_log in server overrides the http one
+};
+
+typedef int (*directive_handler)(parser_t* p, config_t* conf, int argc, char** argv);
+
+typedef struct {
+	const char* name;
+	const char* context;
+	int min_args;
+	int max_args;
+	directive_handler handler;	//NULL: accepted but not used by the server yet
+} directive_t;
+
+static config_t* volatile current = NULL;
+
+/* Epoch based reclamation of snapshots. A reader announces the epoch it
+ * started in while it loads current and takes its reference, the publisher
+ * swaps current, opens a new epoch and waits for every reader still inside
+ * an older epoch before dropping the published reference. */
+struct reader_slot {
+	volatile unsigned long epoch;	//0: not inside config_acquire
+	char pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+};
+
+static struct reader_slot readers[CONF_MAX_READERS] __attribute__((aligned(CACHE_LINE_SIZE)));
+static volatile unsigned long global_epoch = 1;
+static int reader_count = 0;
+static __thread int reader_id = -1;
+
+static int conf_error(parser_t* p, const char* fmt, ...)
+{
+	int len = snprintf(p->errbuf, p->errlen, "%s:%d: ", p->filename, p->line);
+	if (len >= 0 && (size_t)len < p->errlen)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		vsnprintf(p->errbuf + len, p->errlen - len, fmt, ap);
+		va_end(ap);
+	}
+	return -1;
+}
+
+static int parse_int(parser_t* p, const char* name, const char* value, int min, int* out)
+{
+	char* end = NULL;
+	errno = 0;
+	long v = strtol(value, &end, 10);
+	if (errno != 0 || end == value || (*end != '\0' && strcmp(end, "s") != 0)
+			|| v < min || v > INT_MAX)
+	{
+		return conf_error(p, "invalid value \"%s\" in \"%s\"", value, name);
+	}
+	*out = (int)v;
+	return 0;
+}
+
+static int parse_flag(parser_t* p, const char* name, const char* value, bool* out)
+{
+	if (strcasecmp(value, "on") == 0)
+	{
+		*out = TRUE;
+	}
+	else if (strcasecmp(value, "off") == 0)
+	{
+		*out = FALSE;
+	}
+	else
+	{
+		return conf_error(p, "\"%s\" must be \"on\" or \"off\"", name);
+	}
+	return 0;
+}
+
+static int copy_value(parser_t* p, const char* name, const char* value, char* dst, size_t len)
+{
+	if (strlen(value) >= len)
+	{
+		return conf_error(p, "value of \"%s\" is too long", name);
+	}
+	strcpy(dst, value);
+	return 0;
+}
+
+static int set_master_process(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_flag(p, argv[0], argv[1], &conf->master_process);
+}
+
+static int set_worker_processes(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "auto") == 0)
+	{
+		conf->worker_processes = cpu_count();
+		return 0;
+	}
+	return parse_int(p, argv[0], argv[1], 1, &conf->worker_processes);
+}
+
+static int set_worker_threads(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 1, &conf->worker_threads);
+}
+
+static int set_worker_max_requests(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 1, &conf->worker_max_requests);
+}
+
+static int set_worker_cpu_affinity(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_flag(p, argv[0], argv[1], &conf->worker_cpu_affinity);
+}
+
+static int set_worker_shutdown_timeout(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 0, &conf->worker_shutdown_timeout);
+}
+
+static int set_error_log(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	static const char* levels[] = { "", "emerg", "alert", "crit", "error",
+			"warn", "notice", "info", "debug", "trace" };
+
+	if (copy_value(p, argv[0], argv[1], conf->error_log, sizeof(conf->error_log)) < 0)
+	{
+		return -1;
+	}
+	if (argc > 2)
+	{
+		int i = LOG_EMERG;
+		for (; i<=LOG_TRACE; i++)
+		{
+			if (strcasecmp(argv[2], levels[i]) == 0)
+			{
+				conf->error_log_level = (loglevel_t)i;
+				return 0;
+			}
+		}
+		return conf_error(p, "unknown log level \"%s\"", argv[2]);
+	}
+	return 0;
+}
+
+static int set_error_log_async(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_flag(p, argv[0], argv[1], &conf->error_log_async);
+}
+
+static int set_error_log_overflow(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcasecmp(argv[1], "drop") == 0)
+	{
+		conf->error_log_overflow = LOG_OVERFLOW_DROP;
+	}
+	else if (strcasecmp(argv[1], "block") == 0)
+	{
+		conf->error_log_overflow = LOG_OVERFLOW_BLOCK;
+	}
+	else
+	{
+		return conf_error(p, "\"%s\" must be \"drop\" or \"block\"", argv[0]);
+	}
+	return 0;
+}
+
+static int set_error_log_binary(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->error_log_binary[0] = '\0';
+		return 0;
+	}
+	return copy_value(p, argv[0], argv[1], conf->error_log_binary, sizeof(conf->error_log_binary));
+}
+
+/* log_format name [escape=default|json] string ... */
+static int set_log_format(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	const char* escape = "default";
+	int first = 2;
+	if (strncmp(argv[2], "escape=", 7) == 0)
+	{
+		escape = argv[2] + 7;
+		first = 3;
+	}
+	if (first >= argc)
+	{
+		return conf_error(p, "invalid number of arguments in \"%s\"", argv[0]);
+	}
+	if (strlen(argv[1]) >= sizeof(p->formats[0].name))
+	{
+		return conf_error(p, "log_format name \"%s\" is too long", argv[1]);
+	}
+
+	int i = 0;
+	for (; i<p->formats_number; i++)
+	{
+		if (strcmp(p->formats[i].name, argv[1]) == 0)
+		{
+			return conf_error(p, "duplicate log_format name \"%s\"", argv[1]);
+		}
+	}
+	if (p->formats_number == CONF_MAX_FORMATS)
+	{
+		return conf_error(p, "too many log_format definitions");
+	}
+
+	/* the strings are concatenated like nginx does */
+	char text[ACCESS_FORMAT_TEXT];
+	size_t len = 0;
+	for (i=first; i<argc; i++)
+	{
+		size_t n = strlen(argv[i]);
+		if (len + n >= sizeof(text))
+		{
+			return conf_error(p, "log_format \"%s\" is too long", argv[1]);
+		}
+		memcpy(text + len, argv[i], n);
+		len += n;
+	}
+	text[len] = '\0';
+
+	char err[128];
+	access_format_t* format = &p->formats[p->formats_number].format;
+	if (access_format_compile(format, text, escape, err, sizeof(err)) < 0)
+	{
+		return conf_error(p, "%s", err);
+	}
+	strcpy(p->formats[p->formats_number++].name, argv[1]);
+	return 0;
+}
+
+/* access_log path [format] | off, the format defaults to "combined" */
+static int set_access_log(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	bool server = strcmp(p->context[p->depth], "server") == 0;
+	if (!server && p->server_access_log)
+	{
+		return 0;
+	}
+	p->server_access_log = server;
+
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->access_log[0] = '\0';
+		return 0;
+	}
+
+	const char* name = argc > 2 ? argv[2] : "combined";
+	int i = 0;
+	for (; i<p->formats_number; i++)
+	{
+		if (strcmp(p->formats[i].name, name) == 0)
+		{
+			conf->access_format = p->formats[i].format;
+			break;
+		}
+	}
+	if (i == p->formats_number && access_format_builtin(&conf->access_format, name) < 0)
+	{
+		return conf_error(p, "unknown log format \"%s\"", name);
+	}
+	return copy_value(p, argv[0], argv[1], conf->access_log, sizeof(conf->access_log));
+}
+
+static int set_trace(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_flag(p, argv[0], argv[1], &conf->trace);
+}
+
+static int set_trace_file(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return copy_value(p, argv[0], argv[1], conf->trace_file, sizeof(conf->trace_file));
+}
+
+/* slow_log path | off */
+static int set_slow_log(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->slow_log[0] = '\0';
+		return 0;
+	}
+	return copy_value(p, argv[0], argv[1], conf->slow_log, sizeof(conf->slow_log));
+}
+
+/* capture path | off */
+static int set_capture(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->capture_file[0] = '\0';
+		return 0;
+	}
+	return copy_value(p, argv[0], argv[1], conf->capture_file, sizeof(conf->capture_file));
+}
+
+/* slow_request_time 200ms | 1s | 200 */
+/* milliseconds, "200", "200ms" or "2s" */
+static int parse_msec(parser_t* p, const char* name, const char* value, int* out)
+{
+	char* end = NULL;
+	errno = 0;
+	long v = strtol(value, &end, 10);
+	if (errno == 0 && end != value && v >= 0 && v <= INT_MAX / 1000)
+	{
+		if (strcmp(end, "s") == 0)
+		{
+			*out = v * 1000;
+			return 0;
+		}
+		if (*end == '\0' || strcmp(end, "ms") == 0)
+		{
+			*out = v;
+			return 0;
+		}
+	}
+	return conf_error(p, "invalid value \"%s\" in \"%s\"", value, name);
+}
+
+static int set_slow_request_time(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_msec(p, argv[0], argv[1], &conf->slow_request_time);
+}
+
+/* bytes, "512", "64k" or "1m" */
+static int parse_size(parser_t* p, const char* name, const char* value, long* out)
+{
+	char* end = NULL;
+	errno = 0;
+	long v = strtol(value, &end, 10);
+	long unit = 1;
+	if (strcasecmp(end, "k") == 0)
+	{
+		unit = 1024;
+	}
+	else if (strcasecmp(end, "m") == 0)
+	{
+		unit = 1024 * 1024;
+	}
+	else if (*end != '\0')
+	{
+		unit = 0;
+	}
+	if (errno != 0 || end == value || unit == 0 || v < 0 || v > LONG_MAX / unit)
+	{
+		return conf_error(p, "invalid size \"%s\" in \"%s\"", value, name);
+	}
+	*out = v * unit;
+	return 0;
+}
+
+/* worker_queue_lanes small_size|off [fast:small:large] */
+static int set_worker_queue_lanes(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->worker_queue_lanes = FALSE;
+		return 0;
+	}
+	if (parse_size(p, argv[0], argv[1], &conf->worker_queue_small) < 0)
+	{
+		return -1;
+	}
+	conf->worker_queue_lanes = TRUE;
+	if (argc > 2)
+	{
+		int* w = conf->worker_queue_weights;
+		char rest = '\0';
+		if (sscanf(argv[2], "%d:%d:%d%c", &w[0], &w[1], &w[2], &rest) != 3
+				|| w[0] < 1 || w[1] < 1 || w[2] < 1)
+		{
+			return conf_error(p, "invalid weights \"%s\" in \"%s\", fast:small:large expected",
+					argv[2], argv[0]);
+		}
+	}
+	return 0;
+}
+
+/* worker_queue_delay target|off [interval] */
+static int set_worker_queue_delay(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->worker_queue_target = 0;
+	}
+	else if (parse_msec(p, argv[0], argv[1], &conf->worker_queue_target) < 0)
+	{
+		return -1;
+	}
+	if (argc > 2 && parse_msec(p, argv[0], argv[2], &conf->worker_queue_interval) < 0)
+	{
+		return -1;
+	}
+	if (conf->worker_queue_interval <= 0)
+	{
+		return conf_error(p, "interval of \"%s\" must be above 0", argv[0]);
+	}
+	return 0;
+}
+
+static int set_worker_connections(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 1, &conf->worker_connections);
+}
+
+/* a percentage, "90" or "90%" */
+static int parse_percent(parser_t* p, const char* name, const char* value, int* out)
+{
+	char* end = NULL;
+	errno = 0;
+	long v = strtol(value, &end, 10);
+	if (errno != 0 || end == value || (*end != '\0' && strcmp(end, "%") != 0) || v < 1 || v > 100)
+	{
+		return conf_error(p, "invalid percentage \"%s\" in \"%s\"", value, name);
+	}
+	*out = (int)v;
+	return 0;
+}
+
+/* keepalive_watermarks high [low] */
+static int set_keepalive_watermarks(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (parse_percent(p, argv[0], argv[1], &conf->keepalive_high) < 0)
+	{
+		return -1;
+	}
+	conf->keepalive_low = conf->keepalive_high;
+	if (argc > 2 && parse_percent(p, argv[0], argv[2], &conf->keepalive_low) < 0)
+	{
+		return -1;
+	}
+	if (conf->keepalive_low > conf->keepalive_high)
+	{
+		return conf_error(p, "low watermark %d%% is above high watermark %d%% in \"%s\"",
+				conf->keepalive_low, conf->keepalive_high, argv[0]);
+	}
+	return 0;
+}
+
+static int set_sendfile(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_flag(p, argv[0], argv[1], &conf->sendfile);
+}
+
+static int set_keepalive_timeout(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 0, &conf->keepalive_timeout);
+}
+
+static int set_client_header_timeout(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_int(p, argv[0], argv[1], 1, &conf->client_header_timeout);
+}
+
+/* high and low bytes, "off" for 0; low defaults to high */
+static int parse_watermarks(parser_t* p, int argc, char** argv, long* high, long* low)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		*high = 0;
+		*low = 0;
+		return 0;
+	}
+	if (parse_size(p, argv[0], argv[1], high) < 0)
+	{
+		return -1;
+	}
+	*low = *high;
+	if (argc > 2 && parse_size(p, argv[0], argv[2], low) < 0)
+	{
+		return -1;
+	}
+	if (*high > 0 && *low > *high)
+	{
+		return conf_error(p, "low watermark %ld is above high watermark %ld in \"%s\"",
+				*low, *high, argv[0]);
+	}
+	return 0;
+}
+
+/* send_watermarks sndbuf|off [notsent_lowat] */
+static int set_send_watermarks(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (parse_watermarks(p, argc, argv, &conf->send_high, &conf->send_low) < 0)
+	{
+		return -1;
+	}
+	if (conf->send_high > INT_MAX)
+	{
+		return conf_error(p, "\"%s\" is too large in \"%s\"", argv[1], argv[0]);
+	}
+	return 0;
+}
+
+/* output_watermarks high|off [low] */
+static int set_output_watermarks(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return parse_watermarks(p, argc, argv, &conf->output_high, &conf->output_low);
+}
+
+/* send_min_rate rate|off [after] */
+static int set_send_min_rate(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (strcmp(argv[1], "off") == 0)
+	{
+		conf->send_min_rate = 0;
+	}
+	else if (parse_size(p, argv[0], argv[1], &conf->send_min_rate) < 0)
+	{
+		return -1;
+	}
+	if (argc > 2 && parse_msec(p, argv[0], argv[2], &conf->send_min_time) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* in a location only the root location counts, like index */
+static bool skip_location(parser_t* p)
+{
+	return strcmp(p->context[p->depth], "location") == 0 && !p->root_location[p->depth];
+}
+
+/* files are only served by the root location, so a cap in any other
+ * location would cap nothing; refuse it instead of ignoring it */
+static int check_limit_rate_location(parser_t* p, const char* name)
+{
+	if (skip_location(p))
+	{
+		return conf_error(p, "\"%s\" is only supported in location /, not in location %s",
+				name, p->location_uri);
+	}
+	return 0;
+}
+
+static int set_limit_rate(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (check_limit_rate_location(p, argv[0]) < 0)
+	{
+		return -1;
+	}
+	return parse_size(p, argv[0], argv[1], &conf->limit_rate);
+}
+
+static int set_limit_rate_after(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (check_limit_rate_location(p, argv[0]) < 0)
+	{
+		return -1;
+	}
+	return parse_size(p, argv[0], argv[1], &conf->limit_rate_after);
+}
+
+static int set_limit_rate_pacing(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (check_limit_rate_location(p, argv[0]) < 0)
+	{
+		return -1;
+	}
+	return parse_flag(p, argv[0], argv[1], &conf->limit_rate_pacing);
+}
+
+/* listen [address:]port [backlog=number] */
+static int set_listen(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	char address[64];
+	if (copy_value(p, argv[0], argv[1], address, sizeof(address)) < 0)
+	{
+		return -1;
+	}
+
+	char* port = strrchr(address, ':');
+	if (port)
+	{
+		*port++ = '\0';
+		struct in_addr in;
+		if (strcmp(address, "*") == 0)
+		{
+			strcpy(conf->listen_ip, "0.0.0.0");
+		}
+		else if (strcmp(address, "localhost") == 0)
+		{
+			strcpy(conf->listen_ip, "127.0.0.1");
+		}
+		else if (inet_pton(AF_INET, address, &in) == 1)
+		{
+			strcpy(conf->listen_ip, address);
+		}
+		else
+		{
+			return conf_error(p, "invalid listen address \"%s\"", address);
+		}
+	}
+	else
+	{
+		port = address;
+	}
+
+	if (parse_int(p, argv[0], port, 1, &conf->listen_port) < 0 || conf->listen_port > 65535)
+	{
+		return conf_error(p, "invalid port \"%s\"", port);
+	}
+
+	int i = 2;
+	for (; i<argc; i++)
+	{
+		if (strncmp(argv[i], "backlog=", 8) != 0)
+		{
+			return conf_error(p, "invalid listen parameter \"%s\"", argv[i]);
+		}
+		if (parse_int(p, argv[0], argv[i] + 8, 1, &conf->listen_backlog) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int set_server_name(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	return copy_value(p, argv[0], argv[1], conf->server_name, sizeof(conf->server_name));
+}
+
+/* root is inherited http -> server -> location, the "location /" one wins */
+static int set_root(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	const char* context = p->context[p->depth];
+	char* dst = p->http_root;
+	if (strcmp(context, "server") == 0)
+	{
+		dst = p->server_root;
+	}
+	else if (strcmp(context, "location") == 0)
+	{
+		if (!p->root_location[p->depth])
+		{
+			return 0;
+		}
+		dst = p->location_root;
+	}
+	return copy_value(p, argv[0], argv[1], dst, PATH_MAX);
+}
+
+static int set_index(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (skip_location(p))
+	{
+		return 0;
+	}
+	return copy_value(p, argv[0], argv[1], conf->index, sizeof(conf->index));
+}
+
+/* serve the counters at the uri of the enclosing location */
+static int set_stub_status(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	if (p->root_location[p->depth])
+	{
+		return conf_error(p, "\"%s\" is not allowed in location /", argv[0]);
+	}
+	return copy_value(p, argv[0], p->location_uri, conf->status_uri, sizeof(conf->status_uri));
+}
+
+static const directive_t directives[] = {
+	{ "user",					"main",		1, 2,	NULL },
+	{ "pid",					"main",		1, 1,	NULL },
+	{ "master_process",			"main",		1, 1,	set_master_process },
+	{ "worker_processes",		"main",		1, 1,	set_worker_processes },
+	{ "worker_threads",			"main",		1, 1,	set_worker_threads },
+	{ "worker_max_requests",	"main",		1, 1,	set_worker_max_requests },
+	{ "worker_queue_delay",		"main",		1, 2,	set_worker_queue_delay },
+	{ "worker_queue_lanes",		"main",		1, 2,	set_worker_queue_lanes },
+	{ "worker_cpu_affinity",	"main",		1, 1,	set_worker_cpu_affinity },
+	{ "worker_shutdown_timeout",	"main",	1, 1,	set_worker_shutdown_timeout },
+	{ "error_log",				"main",		1, 2,	set_error_log },
+	{ "error_log_async",		"main",		1, 1,	set_error_log_async },
+	{ "error_log_overflow",		"main",		1, 1,	set_error_log_overflow },
+	{ "error_log_binary",		"main",		1, 1,	set_error_log_binary },
+	{ "trace",					"main",		1, 1,	set_trace },
+	{ "trace_file",				"main",		1, 1,	set_trace_file },
+
+	{ "worker_connections",		"events",	1, 1,	set_worker_connections },
+	{ "keepalive_watermarks",	"events",	1, 2,	set_keepalive_watermarks },
+
+	{ "include",				"http",		1, 1,	NULL },
+	{ "default_type",			"http",		1, 1,	NULL },
+	{ "log_format",				"http",		2, CONF_MAX_ARGS - 1, set_log_format },
+	{ "access_log",				"http",		1, 2,	set_access_log },
+	{ "slow_log",				"http",		1, 1,	set_slow_log },
+	{ "slow_request_time",		"http",		1, 1,	set_slow_request_time },
+	{ "capture",				"http",		1, 1,	set_capture },
+	{ "sendfile",				"http",		1, 1,	set_sendfile },
+	{ "tcp_nopush",				"http",		1, 1,	NULL },
+	{ "gzip",					"http",		1, 1,	NULL },
+	{ "keepalive_timeout",		"http",		1, 1,	set_keepalive_timeout },
+	{ "client_header_timeout",	"http",		1, 1,	set_client_header_timeout },
+	{ "send_watermarks",		"http",		1, 2,	set_send_watermarks },
+	{ "output_watermarks",		"http",		1, 2,	set_output_watermarks },
+	{ "send_min_rate",			"http",		1, 2,	set_send_min_rate },
+	{ "limit_rate",				"http",		1, 1,	set_limit_rate },
+	{ "limit_rate_after",		"http",		1, 1,	set_limit_rate_after },
+	{ "limit_rate_pacing",		"http",		1, 1,	set_limit_rate_pacing },
+	{ "root",					"http",		1, 1,	set_root },
+	{ "index",					"http",		1, CONF_MAX_ARGS - 1, set_index },
+
+	{ "listen",					"server",	1, 2,	set_listen },
+	{ "server_name",			"server",	1, CONF_MAX_ARGS - 1, set_server_name },
+	{ "charset",				"server",	1, 1,	NULL },
+	{ "access_log",				"server",	1, 2,	set_access_log },
+	{ "error_page",				"server",	2, CONF_MAX_ARGS - 1, NULL },
+	{ "root",					"server",	1, 1,	set_root },
+	{ "index",					"server",	1, CONF_MAX_ARGS - 1, set_index },
+	{ "limit_rate",				"server",	1, 1,	set_limit_rate },
+	{ "limit_rate_after",		"server",	1, 1,	set_limit_rate_after },
+	{ "limit_rate_pacing",		"server",	1, 1,	set_limit_rate_pacing },
+
+	{ "root",					"location",	1, 1,	set_root },
+	{ "index",					"location",	1, CONF_MAX_ARGS - 1, set_index },
+	{ "limit_rate",				"location",	1, 1,	set_limit_rate },
+	{ "limit_rate_after",		"location",	1, 1,	set_limit_rate_after },
+	{ "limit_rate_pacing",		"location",	1, 1,	set_limit_rate_pacing },
+	{ "stub_status",			"location",	0, 1,	set_stub_status },
+	{ NULL, NULL, 0, 0, NULL }
+};
+
+/* blocks that may be opened in a context */
+static const char* blocks[][2] = {
+	{ "main",	"events" },
+	{ "main",	"http" },
+	{ "http",	"server" },
+	{ "server",	"location" },
+	{ NULL, NULL }
+};
+
+/* a word ending right at ';', '{', '}' or a newline is NUL terminated in
+ * place, the overwritten character is kept in pending for the next call */
+static int next_token(parser_t* p, char** word)
+{
+	char* s = p->pos;
+	char c = p->pending;
+	*word = NULL;
+
+	if (c == '\0')
+	{
+		while (*s == ' ' || *s == '\t' || *s == '\r')
+		{
+			s++;
+		}
+		if (*s == '#')
+		{
+			while (*s && *s != '\n')
+			{
+				s++;
+			}
+		}
+		c = *s++;
+	}
+	p->pending = '\0';
+
+	switch (c)
+	{
+	case '\0':
+		p->pos = s - 1;
+		return TOKEN_EOF;
+	case '\n':
+		p->pos = s;
+		p->line++;
+		return TOKEN_NEWLINE;
+	case ';':
+		p->pos = s;
+		return TOKEN_SEMICOLON;
+	case '{':
+		p->pos = s;
+		return TOKEN_BLOCK_START;
+	case '}':
+		p->pos = s;
+		return TOKEN_BLOCK_END;
+	case '<':
+	{
+		int type = TOKEN_SECTION_START;
+		if (*s == '/')
+		{
+			type = TOKEN_SECTION_END;
+			s++;
+		}
+		*word = s;
+		while (*s && *s != '>' && *s != '\n')
+		{
+			s++;
+		}
+		if (*s != '>')
+		{
+			return conf_error(p, "unterminated section tag");
+		}
+		*s = '\0';
+		p->pos = s + 1;
+		return type;
+	}
+	case '\'':
+	case '"':
+		*word = s;
+		while (*s && *s != c)
+		{
+			if (*s == '\n')
+			{
+				p->line++;
+			}
+			s++;
+		}
+		if (*s != c)
+		{
+			return conf_error(p, "unterminated string");
+		}
+		*s = '\0';
+		p->pos = s + 1;
+		return TOKEN_WORD;
+	default:
+		*word = s - 1;
+		while (*s && !strchr(" \t\r\n;{}#", *s))
+		{
+			s++;
+		}
+		if (*s == ' ' || *s == '\t' || *s == '\r')
+		{
+			*s++ = '\0';
+		}
+		else if (*s != '\0')
+		{
+			p->pending = *s;
+			*s++ = '\0';
+		}
+		p->pos = s;
+		return TOKEN_WORD;
+	}
+}
+
+static const directive_t* find_directive(const char* name, const char* context)
+{
+	const directive_t* d = directives;
+	for (; d->name; d++)
+	{
+		if (strcmp(d->name, name) == 0 && strcmp(d->context, context) == 0)
+		{
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static int run_directive(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	const char* context = p->context[p->depth];
+	const directive_t* d = find_directive(argv[0], context);
+	if (d == NULL)
+	{
+		return conf_error(p, "unknown directive \"%s\" in %s", argv[0], context);
+	}
+	if (argc - 1 < d->min_args || argc - 1 > d->max_args)
+	{
+		return conf_error(p, "invalid number of arguments in \"%s\"", argv[0]);
+	}
+	if (d->handler == NULL)
+	{
+		return 0;
+	}
+	return d->handler(p, conf, argc, argv);
+}
+
+/* report errors of a directive on the line it started, not where it ended */
+static int end_directive(parser_t* p, config_t* conf, int argc, char** argv)
+{
+	int line = p->line;
+	p->line = p->directive_line;
+	int ret = run_directive(p, conf, argc, argv);
+	p->line = line;
+	return ret;
+}
+
+static int open_block(parser_t* p, bool section, int argc, char** argv)
+{
+	const char* context = p->context[p->depth];
+	int i = 0;
+	for (; blocks[i][0]; i++)
+	{
+		if (strcmp(blocks[i][0], context) == 0 && strcmp(blocks[i][1], argv[0]) == 0)
+		{
+			break;
+		}
+	}
+	if (blocks[i][0] == NULL)
+	{
+		return conf_error(p, "\"%s\" block is not allowed in %s", argv[0], context);
+	}
+	if (p->depth + 1 >= CONF_MAX_DEPTH)
+	{
+		return conf_error(p, "blocks nested too deep");
+	}
+
+	if (strcmp(argv[0], "server") == 0 && ++p->servers > 1)
+	{
+		return conf_error(p, "only one server block is supported");
+	}
+	if (strcmp(argv[0], "location") == 0 && argc < 2)
+	{
+		return conf_error(p, "location without uri");
+	}
+
+	p->depth++;
+	p->context[p->depth] = blocks[i][1];
+	p->section[p->depth] = section;
+	p->root_location[p->depth] = (strcmp(argv[0], "location") == 0)
+			&& argc == 2 && strcmp(argv[1], "/") == 0;
+	if (strcmp(argv[0], "location") == 0)
+	{
+		snprintf(p->location_uri, sizeof(p->location_uri), "%s", argv[argc - 1]);
+	}
+	return 0;
+}
+
+static int close_block(parser_t* p, const char* name)
+{
+	if (p->depth == 0 || p->section[p->depth] != (name != NULL)
+			|| (name && strcmp(p->context[p->depth], name) != 0))
+	{
+		return conf_error(p, "unexpected end of %s", name ? name : "block");
+	}
+	p->depth--;
+	return 0;
+}
+
+static int parse(parser_t* p, config_t* conf)
+{
+	char* argv[CONF_MAX_ARGS];
+	int argc = 0;
+	bool assignment = FALSE;	//"key=value" directives end at the line end
+	int ret = 0;
+
+	while (ret == 0)
+	{
+		char* word = NULL;
+		int token = next_token(p, &word);
+		if (token < 0)
+		{
+			ret = -1;
+			break;
+		}
+		switch (token)
+		{
+		case TOKEN_WORD:
+			if (argc == CONF_MAX_ARGS)
+			{
+				ret = conf_error(p, "too many arguments");
+				break;
+			}
+			if (argc == 0)
+			{
+				p->directive_line = p->line;
+			}
+			if (argc == 0 && strchr(word, '=') && word[0] != '=')
+			{
+				char* value = strchr(word, '=');
+				*value++ = '\0';
+				argv[argc++] = word;
+				assignment = TRUE;
+				if (*value != '\0')
+				{
+					argv[argc++] = value;
+				}
+				break;
+			}
+			argv[argc++] = word;
+			break;
+		case TOKEN_NEWLINE:
+			if (assignment && argc > 0)
+			{
+				ret = end_directive(p, conf, argc, argv);
+				argc = 0;
+				assignment = FALSE;
+			}
+			break;
+		case TOKEN_EOF:
+		case TOKEN_SEMICOLON:
+			if (argc > 0)
+			{
+				ret = end_directive(p, conf, argc, argv);
+				argc = 0;
+				assignment = FALSE;
+			}
+			else if (token == TOKEN_SEMICOLON)
+			{
+				ret = conf_error(p, "unexpected \";\"");
+			}
+			if (ret == 0 && token == TOKEN_EOF)
+			{
+				if (p->depth != 0)
+				{
+					ret = conf_error(p, "unexpected end of file, %s is not closed",
+							p->context[p->depth]);
+				}
+				return ret;
+			}
+			break;
+		case TOKEN_BLOCK_START:
+			if (argc == 0)
+			{
+				ret = conf_error(p, "block without name");
+				break;
+			}
+			ret = open_block(p, FALSE, argc, argv);
+			argc = 0;
+			assignment = FALSE;
+			break;
+		case TOKEN_BLOCK_END:
+			if (argc > 0)
+			{
+				ret = conf_error(p, "directive \"%s\" is not terminated by \";\"", argv[0]);
+				break;
+			}
+			ret = close_block(p, NULL);
+			break;
+		case TOKEN_SECTION_START:
+			if (argc > 0)
+			{
+				ret = conf_error(p, "directive \"%s\" is not terminated", argv[0]);
+				break;
+			}
+			argv[0] = word;
+			ret = open_block(p, TRUE, 1, argv);
+			break;
+		case TOKEN_SECTION_END:
+			if (argc > 0)
+			{
+				ret = conf_error(p, "directive \"%s\" is not terminated", argv[0]);
+				break;
+			}
+			ret = close_block(p, word);
+			break;
+		}
+	}
+	return ret;
+}
+
+config_t* config_default(void)
+{
+	config_t* conf = (config_t*)calloc(1, sizeof(config_t));
+	if (conf == NULL)
+	{
+		return NULL;
+	}
+
+	conf->master_process = FALSE;
+	conf->worker_processes = 1;
+	conf->worker_threads = 8;
+	conf->worker_max_requests = 10000;
+	conf->worker_queue_target = 5;
+	conf->worker_queue_interval = 100;
+	conf->worker_queue_lanes = TRUE;
+	conf->worker_queue_small = 64 * 1024;
+	conf->worker_queue_weights[0] = 8;
+	conf->worker_queue_weights[1] = 4;
+	conf->worker_queue_weights[2] = 1;
+	conf->worker_cpu_affinity = FALSE;
+	conf->worker_shutdown_timeout = 60;
+	strcpy(conf->error_log, "jhttpserver.log");
+	conf->error_log_level = LOG_DEBUG;
+	conf->error_log_async = TRUE;
+	conf->error_log_overflow = LOG_OVERFLOW_DROP;
+	conf->trace = FALSE;
+	strcpy(conf->trace_file, "jhttpserver.trace");
+
+	conf->worker_connections = 65536;
+	conf->listen_backlog = 5;
+	conf->keepalive_high = 90;
+	conf->keepalive_low = 80;
+
+	conf->sendfile = FALSE;
+	conf->keepalive_timeout = 65;
+	conf->client_header_timeout = 0;
+	conf->send_high = 0;
+	conf->send_low = 0;
+	conf->output_high = 256L * 1024 * 1024;
+	conf->output_low = 192L * 1024 * 1024;
+	conf->send_min_rate = 1024;
+	conf->send_min_time = 30000;
+	conf->limit_rate = 0;
+	conf->limit_rate_after = 0;
+	conf->limit_rate_pacing = FALSE;
+	conf->slow_request_time = 200;
+
+	strcpy(conf->listen_ip, "0.0.0.0");
+	conf->listen_port = 80;
+
+	strcpy(conf->doc_root, "/var/www/html");
+	strcpy(conf->index, "index.html");
+	return conf;
+}
+
+config_t* config_load(const char* filename, char* errbuf, size_t errlen)
+{
+	FILE* fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		snprintf(errbuf, errlen, "%s: %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char* text = (char*)malloc(size + 1);
+	config_t* conf = config_default();
+	if (text == NULL || conf == NULL)
+	{
+		snprintf(errbuf, errlen, "%s: out of memory", filename);
+		fclose(fp);
+		free(text);
+		free(conf);
+		return NULL;
+	}
+
+	size_t n = fread(text, 1, size, fp);
+	text[n] = '\0';
+	fclose(fp);
+
+	parser_t p;
+	memset(&p, 0, sizeof(p));
+	p.filename = filename;
+	p.pos = text;
+	p.line = 1;
+	p.errbuf = errbuf;
+	p.errlen = errlen;
+	p.context[0] = "main";
+
+	int ret = parse(&p, conf);
+	free(text);
+	if (ret < 0)
+	{
+		free(conf);
+		return NULL;
+	}
+
+	if (p.location_root[0])
+	{
+		strcpy(conf->doc_root, p.location_root);
+	}
+	else if (p.server_root[0])
+	{
+		strcpy(conf->doc_root, p.server_root);
+	}
+	else if (p.http_root[0])
+	{
+		strcpy(conf->doc_root, p.http_root);
+	}
+	return conf;
+}
+
+int config_validate(const config_t* conf, char* errbuf, size_t errlen)
+{
+	struct stat st;
+	if (conf->worker_connections < 16)
+	{
+		snprintf(errbuf, errlen, "worker_connections %d is too small", conf->worker_connections);
+		return -1;
+	}
+	if (stat(conf->doc_root, &st) < 0 || !S_ISDIR(st.st_mode))
+	{
+		snprintf(errbuf, errlen, "root \"%s\" is not a directory", conf->doc_root);
+		return -1;
+	}
+	return 0;
+}
+
+void config_free(config_t* conf)
+{
+	free(conf);
+}
+
+const config_t* config_current(void)
+{
+	return current;
+}
+
+const config_t* config_acquire(void)
+{
+	if (reader_id < 0)
+	{
+		reader_id = __sync_fetch_and_add(&reader_count, 1);
+		assert(reader_id < CONF_MAX_READERS);
+	}
+
+	struct reader_slot* slot = &readers[reader_id];
+	slot->epoch = global_epoch;
+	__sync_synchronize();
+
+	config_t* conf = current;
+	__sync_fetch_and_add(&conf->refs, 1);
+
+	__sync_synchronize();
+	slot->epoch = 0;
+	return conf;
+}
+
+void config_release(const config_t* conf)
+{
+	if (conf && __sync_sub_and_fetch(&((config_t*)conf)->refs, 1) == 0)
+	{
+		config_free((config_t*)conf);
+	}
+}
+
+void config_publish(config_t* conf)
+{
+	conf->refs = 1;
+	config_t* old = current;
+	current = conf;
+	__sync_synchronize();
+
+	if (old == NULL)
+	{
+		return;
+	}
+
+	unsigned long epoch = __sync_add_and_fetch(&global_epoch, 1);
+	int count = reader_count;
+	int i = 0;
+	for (; i<count; i++)
+	{
+		while (true)
+		{
+			unsigned long e = readers[i].epoch;
+			if (e == 0 || e >= epoch)
+			{
+				break;
+			}
+			sched_yield();
+		}
+	}
+	config_release(old);
+}
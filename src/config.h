@@ -0,0 +1,111 @@
+/*
+ * config.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "log.h"
+#include "log_async.h"
+#include "access_log.h"
+
+typedef enum BOOL bool;
+
+#define CONF_NAME_LEN 256
+
+/* the parsed configuration file, never modified after it is published */
+struct config_t {
+	int refs;							//发布的引用加上正在使用它的请求数
+
+	/* main */
+	bool master_process;				//worker_processes大于1时总是打开
+	int worker_processes;
+	int worker_threads;					//每个进程(或每个cpu)的工作线程数
+	int worker_max_requests;			//线程池请求队列的长度
+	int worker_queue_target;			//毫秒， 排队时间的最小值在一个interval内都超过它时拒绝新请求， 0不限制
+	int worker_queue_interval;			//毫秒
+	bool worker_queue_lanes;			//按响应大小分fast, small, large三个队列
+	long worker_queue_small;			//字节， 不超过它的文件走small队列
+	int worker_queue_weights[3];		//三个队列轮流出队的权重
+	bool worker_cpu_affinity;
+	int worker_shutdown_timeout;		//优雅退出时最多等待连接关闭的秒数
+	char error_log[PATH_MAX];
+	loglevel_t error_log_level;
+	bool error_log_async;				//由后台线程批量写日志
+	log_overflow_t error_log_overflow;	//日志缓冲区满时丢弃还是等待
+	char error_log_binary[PATH_MAX];	//不为空时只记录参数， 用JLogDecode格式化
+	bool trace;							//打开请求路径上的tracepoint， 可以在运行中切换
+	char trace_file[PATH_MAX];			//SIGUSR1时追加各线程记录的事件
+
+	/* events */
+	int worker_connections;				//连接表的大小
+	int listen_backlog;
+	int keepalive_high;					//worker_connections的百分比， 连接数达到它时关闭最老的空闲连接
+	int keepalive_low;					//关闭到连接数降到这个百分比
+
+	/* http */
+	bool sendfile;
+	int keepalive_timeout;				//秒
+	int client_header_timeout;			//秒， 连接上的请求多久没有读完整就关闭， 0跟keepalive_timeout一样
+	long send_high;						//字节， 每个连接的SO_SNDBUF, 0用内核的默认值
+	long send_low;						//字节， 每个连接的TCP_NOTSENT_LOWAT, 0不设置
+	long output_high;					//字节， 进程待发送的响应超过它时暂停keep-alive连接的读， 0不限制
+	long output_low;					//降到它以下时恢复
+	long send_min_rate;					//字节/秒， 写得比它慢的连接被关闭， 0不限制
+	int send_min_time;					//毫秒， 响应开始写多久以后才检查send_min_rate
+	long limit_rate;					//字节/秒， 每个响应的发送速度上限， 0不限制
+	long limit_rate_after;				//字节， 每个响应开头不限速的部分
+	bool limit_rate_pacing;				//用SO_MAX_PACING_RATE让内核限速
+	char access_log[PATH_MAX];			//为空时不记录访问日志
+	access_format_t access_format;
+	char slow_log[PATH_MAX];			//为空时不记录慢请求
+	int slow_request_time;				//毫秒， 超过它的请求写入slow_log
+	char capture_file[PATH_MAX];		//不为空时记录每个连接读到的原始字节， 用于回放
+
+	/* http.server */
+	char listen_ip[64];
+	int listen_port;
+	char server_name[CONF_NAME_LEN];
+
+	/* http.server.location / */
+	char doc_root[PATH_MAX];
+	char index[CONF_NAME_LEN];
+
+	/* http.server.location with stub_status */
+	char status_uri[CONF_NAME_LEN];		//为空时没有状态页
+};
+
+typedef struct config_t config_t;
+
+/* a snapshot holding only the built-in defaults */
+config_t* config_default(void);
+
+/* parse filename into a new snapshot, on failure NULL is returned and
+ * errbuf holds "file:line: reason" */
+config_t* config_load(const char* filename, char* errbuf, size_t errlen);
+
+/* check values that would make the server unusable */
+int config_validate(const config_t* conf, char* errbuf, size_t errlen);
+
+void config_free(config_t* conf);
+
+/* the published snapshot, only for the thread that publishes */
+const config_t* config_current(void);
+
+/* make conf the snapshot handed out by config_acquire, the previous one is
+ * freed once every request holding it has released it */
+void config_publish(config_t* conf);
+
+/* take a reference on the published snapshot, safe from any thread */
+const config_t* config_acquire(void);
+
+void config_release(const config_t* conf);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,130 @@
+/*
+ * cpu_affinity.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "cpu_affinity.h"
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+int cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+int pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	if (cpu < 0)
+	{
+		return 0;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int set_attr_cpu(pthread_attr_t* attr, int cpu)
+{
+	cpu_set_t set;
+	if (cpu < 0)
+	{
+		return 0;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int create_listener(const char* ip, int port, int backlog, bool reuseport)
+{
+	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+	{
+		return -1;
+	}
+
+	struct linger tmp = {1, 0};
+	setsockopt(listen_fd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+
+	int on = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	{
+		close(listen_fd);
+		return -1;
+	}
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &address.sin_addr);
+
+	if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0
+			|| listen(listen_fd, backlog) < 0)
+	{
+		close(listen_fd);
+		return -1;
+	}
+
+	return listen_fd;
+}
+
+/* A = cpu the packet was received on; A %= group_size; return A.
+ * The kernel uses the result as index into the reuseport group, which is
+ * the order the sockets were bound in. */
+int attach_reuseport_cpu_filter(int listen_fd, int group_size)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, group_size },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	if (group_size <= 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			&prog, sizeof(prog));
+}
+
+int incoming_cpu(int fd)
+{
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+	{
+		return -1;
+	}
+	return cpu;
+}
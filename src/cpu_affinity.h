@@ -0,0 +1,36 @@
+/*
+ * cpu_affinity.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef CPU_AFFINITY_H_
+#define CPU_AFFINITY_H_
+
+#include <pthread.h>
+
+#include "common.h"
+
+typedef enum BOOL bool;
+
+/* number of online cpus, at least 1 */
+int cpu_count(void);
+
+/* pin the calling thread to cpu, return 0 on success */
+int pin_current_thread(int cpu);
+
+/* set cpu affinity of a not yet created thread, cpu < 0 leaves it unpinned */
+int set_attr_cpu(pthread_attr_t* attr, int cpu);
+
+/* create a listening socket, SO_REUSEPORT is set if reuseport is TRUE */
+int create_listener(const char* ip, int port, int backlog, bool reuseport);
+
+/* steer every new connection of the reuseport group listen_fd belongs to
+ * to the socket with index (receiving cpu % group_size) */
+int attach_reuseport_cpu_filter(int listen_fd, int group_size);
+
+/* cpu on which the kernel handled packets of fd, -1 if unknown */
+int incoming_cpu(int fd);
+
+#endif /* CPU_AFFINITY_H_ */
@@ -5,7 +5,20 @@
  *      Author: brucewoo
  */
 
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+
 #include "http_connect.h"
+#include "access_log.h"
+#include "trace.h"
+#include "stats.h"
+#include "latency.h"
+#include "slow_log.h"
+#include "capture.h"
+#include "mem.h"
+#include "lane.h"
 
 /* http respond status information */
 const char* ok_200_title = "OK";
@@ -17,10 +30,9 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-const char* doc_root = "/var/www/html";
 
-int epollfd = -1;	//所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符设置为全局的
-int user_count = 0;	//统计用户数量
+volatile bool server_draining = FALSE;	//正在退出， 响应发送完成后不再保持连接
+volatile long output_pending = 0;		//本进程所有连接还没有写出的响应字节数
 
 int set_nonblocking(int fd)
 {
@@ -59,67 +71,216 @@ void mod_fd(int epollfd, int fd, int ev)
 }
 
 /* initialize new accept connection */
-void init_new_connect(http_conn* conn, int sockfd, const struct sockaddr_in* addr)
+void init_new_connect(http_conn* conn, int epollfd, int cpu, int sockfd,
+		const struct sockaddr_in* addr)
 {
 	conn->sockfd = sockfd;
-	conn->address = *addr;
+	conn->epollfd = epollfd;
+	conn->cpu = cpu;
+	conn->cold->address = *addr;
+	conn->file_address = NULL;
+	conn->cold->body = NULL;
+	conn->conf = NULL;
+	conn->requests = 0;
+	conn->timer_since = 0;
+	conn->iv_count = 0;
 
 	int reuse = 1;
 	setsockopt(conn->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-	add_fd(epollfd, conn->sockfd, TRUE);
-	user_count++;
+	add_fd(conn->epollfd, conn->sockfd, TRUE);
+	STAT_INC(STAT_ACCEPTED);
 
-	printf("current user count : [%d]\n", user_count);
+	TRACEPOINT(TRACE_ACCEPT, sockfd, ntohs(addr->sin_port), NULL);
+	if (__builtin_expect(capture_enabled, 0))
+	{
+		conn->cold->capture_id = capture_begin(&conn->cold->capture_start);
+	}
+	arena_init(&conn->cold->arena);
 	init(conn);
+
+	/* 限制内核为这个连接缓存的字节数， 慢的客户端不能占住大量socket内存 */
+	if (conn->conf->send_high > 0)
+	{
+		int size = (int)conn->conf->send_high;
+		setsockopt(conn->sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	if (conn->conf->send_low > 0)
+	{
+		int lowat = (int)conn->conf->send_low;
+		setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+	}
 }
 
 void init(http_conn* conn)
 {
+	/* 每个请求开始时换用最新发布的配置， 正在处理的请求一直使用它开始时的配置 */
+	config_release(conn->conf);
+	conn->conf = config_acquire();
 	conn->curr_state = CHECK_STATE_REQUESTLINE;
 	conn->linger = FALSE;
 
 	conn->method = GET;
-	conn->url = NULL;
-	conn->version = NULL;
-	conn->content_length = 0;
-	conn->host = NULL;
+	conn->cold->url = NULL;
+	conn->cold->version = NULL;
+	conn->cold->content_length = 0;
+	conn->cold->host = NULL;
+	conn->cold->user_agent = NULL;
+	conn->cold->referer = NULL;
+	conn->cold->forwarded_for = NULL;
+	conn->cold->start_usec = 0;
+	conn->status = 0;
+	conn->header_length = 0;
+	conn->bytes_sent = 0;
+	conn->iv_count = 0;
+	conn->cold->events_number = 0;
+	conn->cold->pacing = 0;
 	conn->check_index = 0;
+	conn->start_line = 0;
 	conn->read_index = 0;
 	conn->write_index = 0;
+	arena_reset(&conn->cold->arena);
+
+	memset(conn->cold->read_buf, '\0', READ_BUFFER_SIZE);
+	memset(conn->cold->write_buf, '\0', WRITE_BUFFER_SIZE);
+	memset(conn->cold->real_file, '\0', FILENAME_LEN);
+}
+
+void record_event(http_conn* conn, int type, int arg)
+{
+	const config_t* conf = conn->conf;
+	if (conf == NULL || conf->slow_request_time <= 0 || conf->slow_log[0] == '\0')
+	{
+		return;
+	}
 
-	memset(conn->read_buf, '\0', READ_BUFFER_SIZE);
-	memset(conn->write_buf, '\0', WRITE_BUFFER_SIZE);
-	memset(conn->real_file, '\0', FILENAME_LEN);
+	conn_event_t* e = &conn->cold->events[conn->cold->events_number++ % CONN_EVENTS];
+	e->at = (latency_now() - conn->request_start) / 1000;
+	e->type = type;
+	e->arg = arg < 0xffffff ? arg : 0xffffff;
 }
 
 void close_connect(http_conn* conn)
 {
 	if (conn->sockfd != -1)
 	{
-		remove_fd(epollfd, conn->sockfd);
+		TRACEPOINT(TRACE_CLOSE, conn->sockfd, conn->requests, NULL);
+		if (__builtin_expect(capture_enabled, 0))
+		{
+			capture_end(conn->cold->capture_id, conn->cold->capture_start);
+		}
+		if (conn->timer_since)
+		{
+			queue_remove(&conn->timer);
+			conn->timer_since = 0;
+		}
+		long left = output_left(conn);
+		if (left > 0)
+		{
+			__sync_fetch_and_sub(&output_pending, left);
+			STAT_ADD(STAT_OUTPUT_DONE, left);
+		}
+		conn->iv_count = 0;
+		unmap(conn);
+		arena_free(&conn->cold->arena);
+		config_release(conn->conf);
+		conn->conf = NULL;
+		STAT_INC(STAT_CLOSED);
+
+		/* fd最后关闭: 池线程关闭连接时， reactor可能马上accept到同一个fd并重新初始化
+		 * users[fd], 在此之前这个连接的状态必须已经全部清理完 */
+		int sockfd = conn->sockfd;
 		conn->sockfd = -1;
-		user_count--;
-		printf("current user count : [%d]\n", user_count);
+		remove_fd(conn->epollfd, sockfd);
 	}
 }
 
+void close_gracefully(http_conn* conn)
+{
+	struct linger off = {0, 0};
+	setsockopt(conn->sockfd, SOL_SOCKET, SO_LINGER, &off, sizeof(off));
+	close_connect(conn);
+}
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+static const char shed_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+		"Retry-After: " STR(SHED_RETRY_AFTER) "\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+
+/* 过载时只花一次send， 读到的请求不再解析 */
+void shed_request(http_conn* conn)
+{
+	int n = send(conn->sockfd, shed_response, sizeof(shed_response) - 1,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n > 0)
+	{
+		STAT_ADD(STAT_BYTES_OUT, n);
+	}
+	STAT_INC(STAT_SHED);
+	stats_response(503);
+	TRACEPOINT(TRACE_RESPONSE, conn->sockfd, 503, NULL);
+	close_gracefully(conn);
+}
+
 /* 由线程池中的工作线程调用， 这是处理HTTP请求的入口函数 */
 void process(http_conn* conn)
 {
+	conn->process_start = latency_now();
 	http_code read_ret = parse_request(conn);
 	if (read_ret == NO_REQUEST)
 	{
-		mod_fd(epollfd, conn->sockfd, EPOLLIN);
+		mod_fd(conn->epollfd, conn->sockfd, EPOLLIN);
 		return ;
 	}
+	record_event(conn, EVENT_PARSED, read_ret);
 
 	bool write_ret = fill_respond(conn, read_ret);
 	if (!write_ret)
 	{
+		/* 关闭以后fd可能已经属于一个新连接， 不能再碰conn */
 		close_connect(conn);
+		return;
+	}
+
+	long left = output_left(conn);
+	__sync_fetch_and_add(&output_pending, left);
+	STAT_ADD(STAT_OUTPUT_QUEUED, left);
+	if (conn->conf->worker_queue_lanes && conn->cold->url)
+	{
+		lane_learn(conn->cold->url, conn->status, conn->cold->file_stat.st_size,
+				conn->conf->worker_queue_small);
 	}
+	conn->response_ready = latency_now();
+
+	mod_fd(conn->epollfd, conn->sockfd, EPOLLOUT);
+}
 
-	mod_fd(epollfd, conn->sockfd, EPOLLOUT);
+static void mark_request_start(http_conn* conn)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	conn->cold->start_usec = (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+	conn->request_start = latency_now();
+}
+
+/* 开始连接上的下一个请求， 读缓冲区中consumed之后已经读到的字节是流水线中的
+ * 后续请求， 移到缓冲区开头 */
+static void init_next(http_conn* conn, long consumed)
+{
+	int rest = consumed < conn->read_index ? conn->read_index - (int)consumed : 0;
+	if (rest == 0)
+	{
+		init(conn);
+		return;
+	}
+	char next[READ_BUFFER_SIZE];
+	memcpy(next, conn->cold->read_buf + consumed, rest);
+	init(conn);
+	memcpy(conn->cold->read_buf, next, rest);
+	conn->read_index = rest;
+	mark_request_start(conn);
 }
 
 bool http_conn_read(http_conn* conn)
@@ -129,10 +290,16 @@ bool http_conn_read(http_conn* conn)
 		return FALSE;
 	}
 
+	if (conn->read_index == 0)
+	{
+		mark_request_start(conn);
+	}
+
 	int bytes_read = 0;
+	int total = 0;
 	while (TRUE)
 	{
-		bytes_read = recv(conn->sockfd, conn->read_buf+conn->read_index,
+		bytes_read = recv(conn->sockfd, conn->cold->read_buf+conn->read_index,
 				READ_BUFFER_SIZE-conn->read_index, 0);
 		if (bytes_read == -1)
 		{
@@ -147,54 +314,202 @@ bool http_conn_read(http_conn* conn)
 			return FALSE;
 		}
 
+		if (__builtin_expect(capture_enabled, 0))
+		{
+			capture_data(conn->cold->capture_id, conn->cold->capture_start,
+					conn->cold->read_buf + conn->read_index, bytes_read);
+		}
 		conn->read_index += bytes_read;
+		total += bytes_read;
+		STAT_ADD(STAT_BYTES_IN, bytes_read);
+		/* 缓冲区满时剩下的留在socket中， 重新注册EPOLLIN时还会报告 */
+		if (conn->read_index == READ_BUFFER_SIZE)
+		{
+			break;
+		}
 	}
+	record_event(conn, EVENT_READ, total);
 	return TRUE;
 }
 
+/* 只找头部结束的空行和Content-Length, 不完整的请求由reactor接着读， 不交给线程池 */
+bool request_complete(const http_conn* conn)
+{
+	const char* line = conn->cold->read_buf;
+	const char* last = line + conn->read_index;
+	long body = 0;
+	const char* eol = NULL;
+	while ((eol = (const char*)memchr(line, '\n', last - line)) != NULL)
+	{
+		if (eol - line == 1 && line[0] == '\r')
+		{
+			return last - (eol + 1) >= body;
+		}
+		if (eol - line > 15 && strncasecmp(line, "Content-Length:", 15) == 0)
+		{
+			body = atol(line + 15);
+		}
+		line = eol + 1;
+	}
+	return FALSE;
+}
+
+/* 写出n字节后把iv推进到还没有写的位置 */
+static void advance_iv(http_conn* conn, size_t n)
+{
+	int i = 0;
+	for (; i<conn->iv_count && n > 0; i++)
+	{
+		size_t step = n < conn->iv[i].iov_len ? n : conn->iv[i].iov_len;
+		conn->iv[i].iov_base = (char*)conn->iv[i].iov_base + step;
+		conn->iv[i].iov_len -= step;
+		n -= step;
+	}
+}
+
+/* 每次至少写这么多， 避免限速时一次只写几个字节 */
+static long pace_quantum(const http_conn* conn)
+{
+	long quantum = conn->conf->limit_rate / PACE_HZ;
+	long left = output_left(conn);
+	return quantum < 1 ? 1 : (quantum < left ? quantum : left);
+}
+
+/* 令牌桶: 开头的limit_rate_after字节不限速， 之后按limit_rate从响应就绪时开始累积;
+ * 用内核限速时过了limit_rate_after就设置SO_MAX_PACING_RATE, 不再限制 */
+static long send_allowance(http_conn* conn)
+{
+	const config_t* conf = conn->conf;
+	if (conf->limit_rate <= 0 || conn->cold->pacing > 0)
+	{
+		return LONG_MAX;
+	}
+	if (conf->limit_rate_pacing && conn->cold->pacing == 0)
+	{
+		if (conn->bytes_sent < conf->limit_rate_after)
+		{
+			return conf->limit_rate_after - conn->bytes_sent;
+		}
+		unsigned int rate = conf->limit_rate < UINT_MAX ? (unsigned int)conf->limit_rate : UINT_MAX - 1;
+		if (setsockopt(conn->sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0)
+		{
+			conn->cold->pacing = 1;
+			return LONG_MAX;
+		}
+		conn->cold->pacing = -1;
+	}
+	double elapsed = (latency_now() - conn->response_ready) / 1e9;
+	long allowed = conf->limit_rate_after + (long)(conf->limit_rate * elapsed) - conn->bytes_sent;
+	return allowed < pace_quantum(conn) ? 0 : allowed;
+}
+
+unsigned long paced_until(const http_conn* conn)
+{
+	const config_t* conf = conn->conf;
+	if (conf->limit_rate <= 0 || conn->cold->pacing > 0 || output_left(conn) == 0)
+	{
+		return 0;
+	}
+	long need = conn->bytes_sent + pace_quantum(conn) - conf->limit_rate_after;
+	unsigned long due = conn->response_ready + (unsigned long)((double)need * 1e9 / conf->limit_rate);
+	return due > latency_now() ? due : 0;
+}
+
+/* writev of at most limit bytes of the iv */
+static int write_limited(http_conn* conn, long limit)
+{
+	if (limit >= output_left(conn))
+	{
+		return writev(conn->sockfd, conn->iv, conn->iv_count);
+	}
+	struct iovec iv[2];
+	int count = 0;
+	for (; count<conn->iv_count && limit > 0; count++)
+	{
+		iv[count] = conn->iv[count];
+		if ((long)iv[count].iov_len > limit)
+		{
+			iv[count].iov_len = limit;
+		}
+		limit -= iv[count].iov_len;
+	}
+	return writev(conn->sockfd, iv, count);
+}
+
 bool http_conn_write(http_conn* conn)
 {
 	int temp = 0;
-	int bytes_have_send = 0;
-	int bytes_to_send =conn->write_index;
-	if (bytes_to_send == 0)
+	if (conn->write_index == 0)
 	{
-		mod_fd(epollfd, conn->sockfd, EPOLLIN);
+		mod_fd(conn->epollfd, conn->sockfd, EPOLLIN);
 		init(conn);
 		return TRUE;
 	}
 
 	while (TRUE)
 	{
-		temp = writev(conn->sockfd, conn->iv, conn->iv_count);
+		/* 超过limit_rate时由reactor的定时器在paced_until()时再写 */
+		long allowed = send_allowance(conn);
+		if (allowed <= 0)
+		{
+			record_event(conn, EVENT_PACED, 0);
+			return TRUE;
+		}
+		temp = write_limited(conn, allowed);
 		if (temp == -1)
 		{
 			/* 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件。虽然在此期间，
 			 * 服务器无法立即接收到同一客户的下一个请求，但这可以保证连接的完整性 */
 			if (errno == EAGAIN)
 			{
-				mod_fd(epollfd, conn->sockfd, EPOLLOUT);
+				record_event(conn, EVENT_EAGAIN, 0);
+				mod_fd(conn->epollfd, conn->sockfd, EPOLLOUT);
 				return TRUE;
 			}
 			unmap(conn);
 			return FALSE;
 		}
 
-		bytes_to_send -= temp;
-		bytes_have_send += temp;
-		if (bytes_to_send <= bytes_have_send)
+		/* writev可能只写出一部分， 下一次从没有写的位置继续 */
+		advance_iv(conn, temp);
+		__sync_fetch_and_sub(&output_pending, temp);
+		conn->bytes_sent += temp;
+		STAT_ADD(STAT_BYTES_OUT, temp);
+		STAT_ADD(STAT_OUTPUT_DONE, temp);
+		record_event(conn, EVENT_WRITE, temp);
+		if (output_left(conn) == 0)
 		{
 			/* 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接 */
 			unmap(conn);
-			if (conn->linger)
+			if (conn->cold->pacing > 0)
 			{
-				init(conn);
-				mod_fd(epollfd, conn->sockfd, EPOLLIN);
+				unsigned int unlimited = ~0U;
+				setsockopt(conn->sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &unlimited, sizeof(unlimited));
+			}
+			TRACEPOINT(TRACE_RESPONSE, conn->sockfd, conn->status, NULL);
+			stats_response(conn->status);
+			latency_record(STAGE_WRITE, conn->response_ready);
+			latency_record(STAGE_TOTAL, conn->request_start);
+			record_event(conn, EVENT_DONE, 0);
+			slow_log_request(conn);
+			access_log_request(conn);
+			conn->requests++;
+			if (conn->linger && !server_draining)
+			{
+				/* 已经读到下一个请求时不注册EPOLLIN, 由reactor直接交给线程池 */
+				int body = conn->cold->content_length > 0 ? conn->cold->content_length : 0;
+				init_next(conn, (long)conn->check_index + body);
+				if (conn->read_index == 0)
+				{
+					mod_fd(conn->epollfd, conn->sockfd, EPOLLIN);
+				}
 				return TRUE;
 			}
 			else
 			{
-				mod_fd(epollfd, conn->sockfd, EPOLLIN);
+				/* 监听socket设置了SO_LINGER 0, 直接close会用RST丢掉内核中还没有发出的响应 */
+				struct linger off = {0, 0};
+				setsockopt(conn->sockfd, SOL_SOCKET, SO_LINGER, &off, sizeof(off));
 				return FALSE;
 			}
 		}
@@ -213,7 +528,7 @@ http_code parse_request(http_conn* conn)
 	{
 		text = get_line(conn);
 		conn->start_line = conn->check_index;
-		printf("got one http line : %s\n", text);
+		TRACEPOINT(TRACE_LINE, conn->sockfd, conn->start_line, text);
 
 		switch (conn->curr_state)
 		{
@@ -283,15 +598,24 @@ bool fill_respond(http_conn* conn, http_code ret)
 			return FALSE;
 		}
 		break;
+	case STATUS_REQUEST:
+		add_status_line(conn, 200, ok_200_title);
+		add_headers(conn, conn->cold->file_stat.st_size);
+		conn->iv[0].iov_base = conn->cold->write_buf;
+		conn->iv[0].iov_len = conn->write_index;
+		conn->iv[1].iov_base = conn->cold->body;
+		conn->iv[1].iov_len = conn->cold->file_stat.st_size;
+		conn->iv_count = 2;
+		return TRUE;
 	case FILE_REQUEST:
 		add_status_line(conn, 200, ok_200_title);
-		if (conn->file_stat.st_size != 0)
+		if (conn->cold->file_stat.st_size != 0)
 		{
-			add_headers(conn, conn->file_stat.st_size);
-			conn->iv[0].iov_base = conn->write_buf;
+			add_headers(conn, conn->cold->file_stat.st_size);
+			conn->iv[0].iov_base = conn->cold->write_buf;
 			conn->iv[0].iov_len = conn->write_index;
 			conn->iv[1].iov_base = conn->file_address;
-			conn->iv[1].iov_len = conn->file_stat.st_size;
+			conn->iv[1].iov_len = conn->cold->file_stat.st_size;
 			conn->iv_count = 2;
 			return TRUE;
 		}
@@ -309,7 +633,7 @@ bool fill_respond(http_conn* conn, http_code ret)
 		return FALSE;
 	}
 
-	conn->iv[0].iov_base = conn->write_buf;
+	conn->iv[0].iov_base = conn->cold->write_buf;
 	conn->iv[0].iov_len = conn->write_index;
 	conn->iv_count = 1;
 	return TRUE;
@@ -318,12 +642,12 @@ bool fill_respond(http_conn* conn, http_code ret)
 /* 解析HTTP请求行，获得请求方法，目标URL，以及HTTP版本号 */
 http_code parse_request_line(http_conn* conn, char* text)
 {
-	conn->url = strpbrk(text, " \t");
-	if (!conn->url)
+	conn->cold->url = strpbrk(text, " \t");
+	if (!conn->cold->url)
 	{
 		return BAD_REQUEST;
 	}
-	*conn->url++ ='\0';
+	*conn->cold->url++ ='\0';
 
 	char* method = text;
 	if (strcasecmp(method, "GET") == 0)
@@ -367,24 +691,24 @@ http_code parse_request_line(http_conn* conn, char* text)
 		return BAD_REQUEST;
 	}
 
-	conn->url += strspn(conn->url, " \t");
-	conn->version = strpbrk(conn->url, " \t");
-	if (!conn->version)
+	conn->cold->url += strspn(conn->cold->url, " \t");
+	conn->cold->version = strpbrk(conn->cold->url, " \t");
+	if (!conn->cold->version)
 	{
 		return BAD_REQUEST;
 	}
-	*conn->version++ = '\0';
-	conn->version += strspn(conn->version, " \t");
-	if (strcasecmp(conn->version, "HTTP/1.1") != 0)
+	*conn->cold->version++ = '\0';
+	conn->cold->version += strspn(conn->cold->version, " \t");
+	if (strcasecmp(conn->cold->version, "HTTP/1.1") != 0)
 	{
 		return BAD_REQUEST;
 	}
-	if (strncasecmp(conn->url, "http://", 7) == 0)
+	if (strncasecmp(conn->cold->url, "http://", 7) == 0)
 	{
-		conn->url += 7;
-		conn->url = strchr(conn->url, '/');
+		conn->cold->url += 7;
+		conn->cold->url = strchr(conn->cold->url, '/');
 	}
-	if (!conn->url || conn->url[0] !=  '/')
+	if (!conn->cold->url || conn->cold->url[0] !=  '/')
 	{
 		return BAD_REQUEST;
 	}
@@ -401,7 +725,7 @@ http_code parse_headers(http_conn* conn, char* text)
 	{
 		/* 如果HTTP请求有消息体， 则还需要读取conn->content_length字节的消息体，
 		 *  状态机转移到CHECK_STATE_CON TENT */
-		if (conn->content_length != 0)
+		if (conn->cold->content_length != 0)
 		{
 			conn->curr_state = CHECK_STATE_CONTENT;
 			return NO_REQUEST;
@@ -414,7 +738,8 @@ http_code parse_headers(http_conn* conn, char* text)
 	{
 		text += 11;
 		text += strspn(text, " \t");
-		if (strcasecmp(text, "keep-alive") == 0)
+		/* keepalive_timeout 0 turns keep-alive off */
+		if (strcasecmp(text, "keep-alive") == 0 && conn->conf->keepalive_timeout > 0)
 		{
 			conn->linger = TRUE;
 		}
@@ -424,18 +749,33 @@ http_code parse_headers(http_conn* conn, char* text)
 	{
 		text += 15;
 		text += strspn(text, " \t");
-		conn->content_length = atol(text);
+		conn->cold->content_length = atol(text);
 	}
 	/* 处理Host头部字段 */
 	else if (strncasecmp(text, "Host:", 5) == 0)
 	{
 		text += 5;
 		text += strspn(text, " \t");
-		conn->host = text;
+		conn->cold->host = text;
+	}
+	else if (strncasecmp(text, "User-Agent:", 11) == 0)
+	{
+		text += 11;
+		conn->cold->user_agent = text + strspn(text, " \t");
+	}
+	else if (strncasecmp(text, "Referer:", 8) == 0)
+	{
+		text += 8;
+		conn->cold->referer = text + strspn(text, " \t");
+	}
+	else if (strncasecmp(text, "X-Forwarded-For:", 16) == 0)
+	{
+		text += 16;
+		conn->cold->forwarded_for = text + strspn(text, " \t");
 	}
 	else
 	{
-		printf("oop! unknow header %s\n", text);
+		TRACEPOINT(TRACE_UNKNOWN_HEADER, conn->sockfd, 0, text);
 	}
 
 	return NO_REQUEST;
@@ -444,47 +784,122 @@ http_code parse_headers(http_conn* conn, char* text)
 /* 没有解析真正HTTP请求的消息体， 只是判断它是否被完整的读入了 */
 http_code parse_content(http_conn* conn, char * text)
 {
-	if (conn->read_index >= (conn->content_length + conn->check_index))
+	if (conn->read_index >= (conn->cold->content_length + conn->check_index))
 	{
-		text[conn->content_length] = '\0';
+		text[conn->cold->content_length] = '\0';
 		return GET_REQUEST;
 	}
 
 	return NO_REQUEST;
 }
 
+/* url is the stub_status location, a query string is allowed */
+static bool is_status_uri(const char* uri, const char* url)
+{
+	size_t len = strlen(uri);
+	return strncmp(uri, url, len) == 0 && (url[len] == '\0' || url[len] == '?');
+}
+
+/* 状态页， "?format=prometheus"时使用Prometheus的格式 */
+static http_code do_status(http_conn* conn)
+{
+	bool prometheus = strstr(conn->cold->url, "format=prometheus") != NULL;
+	conn->cold->body = (char*)arena_alloc(&conn->cold->arena, STATUS_PAGE_SIZE);
+	if (conn->cold->body == NULL)
+	{
+		return INTERNAL_ERROR;
+	}
+
+	int len = stats_format(conn->cold->body, STATUS_PAGE_SIZE, prometheus);
+	int n = len < 0 ? -1 : latency_format(conn->cold->body + len, STATUS_PAGE_SIZE - len, prometheus);
+	len = n < 0 ? -1 : len + n;
+	n = len < 0 ? -1 : mem_format(conn->cold->body + len, STATUS_PAGE_SIZE - len, prometheus);
+	len = n < 0 ? -1 : len + n;
+	if (len < 0)
+	{
+		unmap(conn);
+		return INTERNAL_ERROR;
+	}
+	memset(&conn->cold->file_stat, 0, sizeof(conn->cold->file_stat));
+	conn->cold->file_stat.st_size = len;
+	return STATUS_REQUEST;
+}
+
 /* 当得到一个完整，正确的HTTP请求时， 就分析目标文件的属性，如果目标文件存在，对所有用户可读，
  * 并且不是目录，则使用mmap将其映射到内存地址file_address处，并告诉调用者获取文件成功 */
-http_code do_request(http_conn* conn)
+static http_code map_file(http_conn* conn)
 {
-	strcpy(conn->real_file, doc_root);
+	const char* doc_root = conn->conf->doc_root;
 	int len = strlen(doc_root);
-	strncpy(conn->real_file + len, conn->url, FILENAME_LEN - len - 1);
-	if (stat(conn->real_file, &conn->file_stat) < 0)
+	if (len >= FILENAME_LEN - 1)
+	{
+		return INTERNAL_ERROR;
+	}
+	strcpy(conn->cold->real_file, doc_root);
+	strncpy(conn->cold->real_file + len, conn->cold->url, FILENAME_LEN - len - 1);
+
+	/* 以'/'结尾的URL映射到目录下的index文件 */
+	len = strlen(conn->cold->real_file);
+	if (conn->cold->real_file[len - 1] == '/')
+	{
+		strncpy(conn->cold->real_file + len, conn->conf->index, FILENAME_LEN - len - 1);
+	}
+
+	if (stat(conn->cold->real_file, &conn->cold->file_stat) < 0)
 	{
 		return NO_RESOURCE;
 	}
 
-	if (!(conn->file_stat.st_mode & S_IROTH))
+	if (!(conn->cold->file_stat.st_mode & S_IROTH))
 	{
 		return BAD_REQUEST;
 	}
 
-	if (S_ISDIR(conn->file_stat.st_mode))
+	if (S_ISDIR(conn->cold->file_stat.st_mode))
 	{
 		return BAD_REQUEST;
 	}
 
-	int fd = open(conn->real_file, O_RDONLY);
-	conn->file_address = (char *)mmap(0, conn->file_stat.st_size, PROT_READ,
-			MAP_PRIVATE, fd, 0);
+	/* 空文件不映射， 响应一个空页面 */
+	if (conn->cold->file_stat.st_size == 0)
+	{
+		return FILE_REQUEST;
+	}
+
+	int fd = open(conn->cold->real_file, O_RDONLY);
+	if (fd < 0)
+	{
+		return FORBIDDEN_REQUEST;
+	}
+	char* address = (char *)mmap(0, conn->cold->file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	close(fd);
+	if (address == MAP_FAILED)
+	{
+		return INTERNAL_ERROR;
+	}
+	conn->file_address = address;
+	mem_add(MEM_FILE_MAPS, conn->cold->file_stat.st_size);
 	return FILE_REQUEST;
 }
 
+/* 计时各阶段， 状态页不经过文件系统 */
+http_code do_request(http_conn* conn)
+{
+	latency_record(STAGE_PARSE, conn->process_start);
+	if (conn->conf->status_uri[0] && is_status_uri(conn->conf->status_uri, conn->cold->url))
+	{
+		return do_status(conn);
+	}
+
+	unsigned long start = latency_now();
+	http_code ret = map_file(conn);
+	latency_record(STAGE_FILE, start);
+	return ret;
+}
+
 char* get_line(http_conn* conn)
 {
-	return conn->read_buf + conn->start_line;
+	return conn->cold->read_buf + conn->start_line;
 }
 
 line_status parse_line(http_conn* conn)
@@ -492,17 +907,17 @@ line_status parse_line(http_conn* conn)
 	char temp;
 	for (; conn->check_index<conn->read_index; ++conn->check_index)
 	{
-		temp = conn->read_buf[conn->check_index];
+		temp = conn->cold->read_buf[conn->check_index];
 		if (temp == '\r')
 		{
 			if ((conn->check_index + 1) == conn->read_index)
 			{
 				return LINE_OPEN;
 			}
-			else if (conn->read_buf[conn->check_index] == '\n')
+			else if (conn->cold->read_buf[conn->check_index + 1] == '\n')
 			{
-				conn->read_buf[conn->check_index++] = '\0';
-				conn->read_buf[conn->check_index++] = '\0';
+				conn->cold->read_buf[conn->check_index++] = '\0';
+				conn->cold->read_buf[conn->check_index++] = '\0';
 				return LINE_OK;
 			}
 
@@ -510,10 +925,10 @@ line_status parse_line(http_conn* conn)
 		}
 		else if (temp == '\n')
 		{
-			if ((conn->check_index > 1) && (conn->read_buf[conn->check_index - 1] == '\r'))
+			if ((conn->check_index > 1) && (conn->cold->read_buf[conn->check_index - 1] == '\r'))
 			{
-				conn->read_buf[conn->check_index-1] = '\0';
-				conn->read_buf[conn->check_index++] = '\0';
+				conn->cold->read_buf[conn->check_index-1] = '\0';
+				conn->cold->read_buf[conn->check_index++] = '\0';
 				return LINE_OK;
 			}
 
@@ -527,9 +942,12 @@ void unmap(http_conn* conn)
 {
 	if (conn->file_address)
 	{
-		munmap(conn->file_address, conn->file_stat.st_size);
+		munmap(conn->file_address, conn->cold->file_stat.st_size);
+		mem_sub(MEM_FILE_MAPS, conn->cold->file_stat.st_size);
 		conn->file_address = NULL;
 	}
+	/* 状态页在arena中， 随下一个请求的init()回收 */
+	conn->cold->body = NULL;
 }
 
 bool add_reponse(http_conn* conn, const char* format, ...)
@@ -541,7 +959,7 @@ bool add_reponse(http_conn* conn, const char* format, ...)
 
 	va_list arg_list;
 	va_start(arg_list, format);
-	int len = vsnprintf(conn->write_buf+conn->write_index,
+	int len = vsnprintf(conn->cold->write_buf+conn->write_index,
 			WRITE_BUFFER_SIZE-1-conn->write_index, format, arg_list);
 	if (len >= (WRITE_BUFFER_SIZE-1-conn->write_index))
 	{
@@ -559,12 +977,13 @@ bool add_content(http_conn* conn, const char* content)
 
 bool add_status_line(http_conn* conn, int status, const char* title)
 {
+	conn->status = status;
 	return add_reponse(conn, "%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
 bool add_headers(http_conn* conn, int content_length)
 {
-	if (add_content_length(conn, conn->content_length)
+	if (add_content_length(conn, content_length)
 			&& add_linger(conn) && add_blank_line(conn))
 	{
 		return TRUE;
@@ -577,7 +996,7 @@ bool add_headers(http_conn* conn, int content_length)
 
 bool add_content_length(http_conn* conn, int content_length)
 {
-	return add_reponse(conn, "Content-Length: %s\r\n", content_length);
+	return add_reponse(conn, "Content-Length: %d\r\n", content_length);
 }
 
 bool add_linger(http_conn* conn)
@@ -588,5 +1007,7 @@ bool add_linger(http_conn* conn)
 
 bool add_blank_line(http_conn* conn)
 {
-	return add_reponse(conn, "%s", "\r\n");
+	bool ret = add_reponse(conn, "%s", "\r\n");
+	conn->header_length = conn->write_index;
+	return ret;
 }
@@ -27,13 +27,23 @@
 
 #include "common.h"
 #include "queue.h"
+#include "config.h"
+#include "arena.h"
 
+/* events of a request kept for the slow log */
+#define CONN_EVENTS 16
+/* largest status page */
+#define STATUS_PAGE_SIZE 8192
 /* filename max length */
 #define FILENAME_LEN 200
 /* read buffer size */
 #define READ_BUFFER_SIZE 2048
 /* write buffer size */
 #define WRITE_BUFFER_SIZE 1024
+/* seconds a shed client is told to wait */
+#define SHED_RETRY_AFTER 1
+/* writes per second of a response under limit_rate */
+#define PACE_HZ 10
 
 typedef enum BOOL bool;
 typedef enum HTTP_CODE http_code;
@@ -41,56 +51,125 @@ typedef enum LINE_STATUS line_status;
 typedef enum CHECK_STATE check_state;
 typedef enum HTTP_METHOD http_method;
 
-extern int epollfd;
-extern int user_count;
+extern volatile bool server_draining;
 
-struct http_conn {
-	queue_t head;
+/* response bytes of this process not written yet, see output_watermarks */
+extern volatile long output_pending;
 
-	int sockfd;						//该HTTP连接的socket
-	struct sockaddr_in address;		//对方的socket地址
+/* one entry of a connection's event ring */
+typedef struct conn_event_s conn_event_t;
+struct conn_event_s {
+	unsigned int at;				//距请求开始的微秒数
+	unsigned int type:8;			//enum CONN_EVENT
+	unsigned int arg:24;			//字节数或http_code
+};
 
+/* the parts of a connection touched while parsing and logging a request,
+ * kept apart so the hot headers of the connection table stay dense */
+typedef struct http_conn_cold http_conn_cold;
+struct http_conn_cold {
 	char read_buf[READ_BUFFER_SIZE];//读缓冲区
-	int read_index;					//标识读缓冲中已经读入的客户端数据的最后一个字节的下一个位置
-	int check_index;				//当前正在分析的字符在缓冲区中的位置
-	int start_line;					//当前正在解析的行的起始位置
 	char write_buf[WRITE_BUFFER_SIZE];				//想写缓冲区
-	int write_index;				//写缓冲区待发送的字节数
-	check_state curr_state;			//主状态机当前所处的状态
-	http_method method;				//请求方法
-
 	char real_file[FILENAME_LEN];	//客户端请求的目标文件的完整路径，其内容等于doc_root + url, doc_root是网站根目录
+	struct sockaddr_in address;		//对方的socket地址
 	char* url;						//客户请求的目标文件的文件名
 	char* version;					//HTTP协议版本号，支持http/1.1
 	char* host;						//主机名
+	char* user_agent;				//User-Agent头部， 用于访问日志
+	char* referer;					//Referer头部
+	char* forwarded_for;			//X-Forwarded-For头部
 	int content_length;				//HTTP请求的消息体的长度
+	unsigned long start_usec;		//读到请求第一个字节的时间， 微秒
+	conn_event_t events[CONN_EVENTS];	//请求处理过程的事件， 慢请求时写入slow_log
+	unsigned int events_number;
+	unsigned int capture_id;		//capture文件中的连接号
+	unsigned long capture_start;	//连接建立的单调时间， 微秒
+	char* body;						//动态生成的响应体(状态页)， 在arena中
+	struct stat file_stat;			//目标文件的状态，通过它可以判断文件是否存在，是否为目录，是否可读，并获取文件大小等信息
+	arena_t arena;					//请求范围内的内存， init()时整体回收
+	int pacing;						//SO_MAX_PACING_RATE: 0没有设置， 1已经设置， -1设置失败改用定时器
+};
+
+/* what the event loops and the pool threads read on every event, in three
+ * cache lines; the first holds everything a read or write event checks.
+ * timer is linked and unlinked only by the owning event loop. */
+struct http_conn {
+	queue_t head;
+	int sockfd;						//该HTTP连接的socket
+	int epollfd;					//owning event loop's epoll fd
+	int read_index;					//标识读缓冲中已经读入的客户端数据的最后一个字节的下一个位置
+	int write_index;				//写缓冲区待发送的字节数
+	int check_index;				//当前正在分析的字符在缓冲区中的位置
+	int start_line;					//当前正在解析的行的起始位置
+	check_state curr_state;			//主状态机当前所处的状态
 	bool linger;					//HTTP请求是否要求保持连接
+	int requests;					//该连接上已经发送完成的响应数
+	int status;						//响应的状态码
+	http_conn_cold* cold;			//不常用的部分， 和连接表一起分配
+
+	const config_t* conf;			//处理当前请求使用的配置
+	int cpu;						//cpu of the owning event loop, -1 if unpinned
+	http_method method;				//请求方法
+	unsigned long request_start;	//以下是各阶段开始的单调时间， 纳秒
+	unsigned long enqueued;
+	unsigned long process_start;
+	unsigned long response_ready;
+	long bytes_sent;				//已经发送的响应字节数
+	int header_length;				//响应头部的长度
+	int iv_count;					//iv中被写内存块的数量
 
 	char* file_address;				//客户请求的目标文件被mmap到内存中的起始位置
-	struct stat file_stat;			//目标文件的状态，通过它可以判断文件是否存在，是否为目录，是否可读，并获取文件大小等信息
-	struct iovec iv[2];				//使用writev来执行写操作，所以定义下面两个成员，其中iv_count表示被写内存块的数量
-	int iv_count;
-};
+	struct iovec iv[2];				//使用writev来执行写操作， 响应头部和文件内容
+	queue_t timer;					//在reactor的idle, writing, parked或delayed列表中
+	unsigned long timer_since;		//进入列表的单调时间， 在delayed中是到期时间， 纳秒， 0表示不在任何列表中
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 typedef struct http_conn http_conn;
 
+/* bytes of the response still to be written */
+static inline long output_left(const http_conn* conn)
+{
+	return conn->iv_count == 0 ? 0 : (long)conn->iv[0].iov_len
+			+ (conn->iv_count > 1 ? (long)conn->iv[1].iov_len : 0);
+}
+
 /* initialize new accept connection */
-void init_new_connect(http_conn* conn, int sockfd, const struct sockaddr_in* addr);
+void init_new_connect(http_conn* conn, int epollfd, int cpu, int sockfd,
+		const struct sockaddr_in* addr);
 
+/* start the next request of the connection, its arena is reset */
 void init(http_conn* conn);
 
+/* add an event to the ring of conn, only while the slow log is on */
+void record_event(http_conn* conn, int type, int arg);
+
 /* close connection */
 void close_connect(http_conn* conn);
 
+/* close with a FIN even though the listener set SO_LINGER to 0, for
+ * connections without a request in flight or with a last reply queued */
+void close_gracefully(http_conn* conn);
+
+/* reply a preformatted 503 with Retry-After without parsing, and close */
+void shed_request(http_conn* conn);
+
 /* process client requst */
 void process(http_conn* conn);
 
 /* noblocking read */
 bool http_conn_read(http_conn* conn);
 
-/* noblocking write */
+/* whether read_buf holds a whole request, headers and Content-Length body */
+bool request_complete(const http_conn* conn);
+
+/* noblocking write, stops early when limit_rate allows no more for now;
+ * a keep-alive connection whose next request was already read is left
+ * with it in read_buf and not armed for EPOLLIN */
 bool http_conn_write(http_conn* conn);
 
+/* when limit_rate lets the response continue, 0 if it is not held back */
+unsigned long paced_until(const http_conn* conn);
+
 /* parse request*/
 http_code parse_request(http_conn* conn);
 
@@ -126,5 +205,13 @@ bool add_linger(http_conn* conn);
 
 bool add_blank_line(http_conn* conn);
 
+int set_nonblocking(int fd);
+
+void add_fd(int epollfd, int fd, bool one_shot);
+
+void remove_fd(int epollfd, int fd);
+
+void mod_fd(int epollfd, int fd, int ev);
+
 #endif
 
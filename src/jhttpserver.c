@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,17 +12,53 @@
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 
 #include "jhttpserver.h"
+#include "trace.h"
+#include "stats.h"
+#include "latency.h"
+#include "slow_log.h"
+#include "mem.h"
+#include "capture.h"
 
-#define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+/* fds besides connections: listeners, epoll instances, log files */
+#define RESERVED_FD 64
+#define MAX_LISTENERS 1024
+/* shared by the master and all workers */
+#define SHM_SIZE (4 * 1024 * 1024)
+/* epoll_wait timeout, bounds how late periodic work such as draining runs */
+#define TIMER_TICK 1000
 
-extern int epollfd;
-extern int user_count;
 log_handle_t g_log;
 
-extern int add_fd(int epollfd, int fd, bool one_shot);
+static http_conn* users = NULL;
+static int max_fd = 0;			//连接表的大小， 连接表以fd为下标
+static reactor* reactors = NULL;
+static int reactor_number = 0;
+static int* listeners = NULL;
+static int listener_number = 0;
+
+shm_zone_t g_shm;
+static worker_slot_t* worker_slots = NULL;
+static worker_slot_t* this_worker = NULL;	//本进程的worker记录
+static volatile sig_atomic_t need_dump_stats = 0;
+static volatile sig_atomic_t need_dump_latency = 0;
+static volatile sig_atomic_t need_reload = 0;
+static volatile sig_atomic_t need_quit = 0;
+static volatile sig_atomic_t need_upgrade = 0;
+static time_t drain_deadline = 0;
+static pid_t upgrade_pid = -1;			//新启动的二进制, 还没有开始服务
+static bool under_master = FALSE;
+
+/* 重新加载配置时需要的启动参数 */
+static const char* conf_file = NULL;
+static const char* cli_ip = NULL;
+static const char* cli_port = NULL;
+static bool cli_cpu_affinity = FALSE;
 
 void add_signal(int signal, void (handler)(int), bool restart)
 {
@@ -43,88 +80,622 @@ void show_error(int conn_fd, const char* info)
 	close(conn_fd);
 }
 
-int main(int argc, char* argv[])
+static void sig_dump_stats(int sig)
+{
+	need_dump_stats = 1;
+}
+
+static void sig_dump_latency(int sig)
+{
+	need_dump_latency = 1;
+}
+
+static void sig_reload(int sig)
+{
+	need_reload = 1;
+}
+
+static void sig_quit(int sig)
+{
+	need_quit = 1;
+}
+
+static void sig_upgrade(int sig)
+{
+	need_upgrade = 1;
+}
+
+/* command line arguments take precedence over the file */
+static void apply_overrides(config_t* conf)
+{
+	if (cli_ip)
+	{
+		snprintf(conf->listen_ip, sizeof(conf->listen_ip), "%s", cli_ip);
+		conf->listen_port = atoi(cli_port);
+	}
+	if (cli_cpu_affinity)
+	{
+		conf->worker_cpu_affinity = TRUE;
+	}
+}
+
+/* 重新读取配置文件并发布新的配置， 已经在处理中的请求继续使用旧的配置。
+ * 监听地址和线程数只在启动时生效， 修改它们需要重启 */
+void reload_config(void)
+{
+	char err[512];
+	const config_t* old = config_current();
+	config_t* conf = conf_file ? config_load(conf_file, err, sizeof(err)) : config_default();
+	if (conf == NULL)
+	{
+		ERROR(&g_log, "jhttpserver", "reload failed, keeping old configuration: %s", err);
+		return;
+	}
+	apply_overrides(conf);
+
+	if (config_validate(conf, err, sizeof(err)) < 0)
+	{
+		ERROR(&g_log, "jhttpserver", "reload failed, keeping old configuration: %s", err);
+		config_free(conf);
+		return;
+	}
+
+	if (strcmp(conf->listen_ip, old->listen_ip) != 0 || conf->listen_port != old->listen_port
+			|| conf->listen_backlog != old->listen_backlog
+			|| conf->worker_threads != old->worker_threads
+			|| conf->worker_max_requests != old->worker_max_requests
+			|| conf->worker_cpu_affinity != old->worker_cpu_affinity
+			|| conf->worker_processes != old->worker_processes)
+	{
+		WARNING(&g_log, "jhttpserver", "listen and worker settings changed, "
+				"they take effect after a restart");
+	}
+	if (strcmp(conf->access_log, old->access_log) != 0)
+	{
+		WARNING(&g_log, "jhttpserver", "access_log path changed, it takes effect after a restart");
+	}
+	if (strcmp(conf->slow_log, old->slow_log) != 0)
+	{
+		WARNING(&g_log, "jhttpserver", "slow_log path changed, it takes effect after a restart");
+	}
+	if (strcmp(conf->capture_file, old->capture_file) != 0)
+	{
+		WARNING(&g_log, "jhttpserver", "capture path changed, it takes effect after a restart");
+	}
+	if (users && conf->worker_connections + RESERVED_FD > max_fd)
+	{
+		WARNING(&g_log, "jhttpserver", "worker_connections %d exceeds the connection table, "
+				"limited to %d until restart", conf->worker_connections, max_fd - RESERVED_FD);
+		conf->worker_connections = max_fd - RESERVED_FD;
+	}
+
+	config_publish(conf);
+	log_set_loglevel(&g_log, conf->error_log_level);
+	log_logrotate(&g_log, SIGHUP);
+	access_log_reopen();
+	slow_log_reopen();
+	trace_enabled = conf->trace;
+	INFO(&g_log, "jhttpserver", "configuration reloaded from %s", conf_file ? conf_file : "defaults");
+}
+
+/* 每个事件循环的cpu亲和性统计， 用来判断连接是否一直留在同一个cpu上处理 */
+void dump_cpu_stats(void)
+{
+	int i = 0;
+	for (; i<reactor_number; i++)
+	{
+		reactor* r = &reactors[i];
+		INFO(&g_log, "jhttpserver", "reactor %d cpu %d: accepted %lu, rx on same cpu %lu,"
+				" requests processed on same cpu %lu, on other cpu %lu", r->id, r->cpu,
+				r->accepted, r->local_accepted, r->pool->local_processed,
+				r->pool->remote_processed);
+		INFO(&g_log, "jhttpserver", "reactor %d queue: fast %d small %d large %d", r->id,
+				r->pool->lane_number[LANE_FAST], r->pool->lane_number[LANE_SMALL],
+				r->pool->lane_number[LANE_LARGE]);
+	}
+	INFO(&g_log, "jhttpserver", "output pending: %ld bytes", output_pending);
+	if (g_log.async)
+	{
+		INFO(&g_log, "jhttpserver", "log lines dropped: %lu", log_async_dropped(&g_log));
+	}
+	if (config_current()->access_log[0])
+	{
+		INFO(&g_log, "jhttpserver", "access log lines dropped: %lu", access_log_dropped());
+	}
+	char page[STATUS_PAGE_SIZE];
+	if (stats_format(page, sizeof(page), FALSE) > 0)
+	{
+		INFO(&g_log, "jhttpserver", "counters of all workers:\n%s", page);
+	}
+	if (mem_format(page, sizeof(page), FALSE) > 0)
+	{
+		INFO(&g_log, "jhttpserver", "%s", page);
+	}
+	if (trace_enabled && trace_dump(config_current()->trace_file) < 0)
+	{
+		ERROR(&g_log, "jhttpserver", "failed to write %s", config_current()->trace_file);
+	}
+}
+
+/* 各阶段耗时的分位数， 由本进程所有线程的直方图合并得到 */
+void dump_latency(void)
+{
+	char page[STATUS_PAGE_SIZE];
+	if (latency_format(page, sizeof(page), FALSE) > 0)
+	{
+		INFO(&g_log, "jhttpserver", "request stage latency:\n%s", page);
+	}
+}
+
+/* 连接排到r的一个列表(header, idle, writing或parked)的队尾， 一个连接同时只在一个列表中 */
+static void timer_add(queue_t* list, http_conn* conn)
+{
+	conn->timer_since = latency_now();
+	queue_insert_tail(list, &conn->timer);
+}
+
+static void timer_remove(http_conn* conn)
+{
+	if (conn->timer_since)
+	{
+		queue_remove(&conn->timer);
+		conn->timer_since = 0;
+	}
+}
+
+/* close at most number of the oldest idle connections of r, those that
+ * have not sent a whole request first, then parked ones; no request is in
+ * flight on them so the client just reconnects; how many were closed */
+static long evict_idle(reactor* r, long number)
+{
+	long closed = 0;
+	while (closed < number && !queue_empty(&r->header))
+	{
+		close_gracefully(queue_data(queue_head(&r->header), http_conn, timer));
+		closed++;
+	}
+	while (closed < number && !queue_empty(&r->parked))
+	{
+		close_gracefully(queue_data(queue_head(&r->parked), http_conn, timer));
+		closed++;
+	}
+	while (closed < number && !queue_empty(&r->idle))
+	{
+		close_gracefully(queue_data(queue_head(&r->idle), http_conn, timer));
+		closed++;
+	}
+	if (closed)
+	{
+		STAT_ADD(STAT_IDLE_EVICTED, closed);
+	}
+	return closed;
+}
+
+/* the lists are in arrival order, so only their heads can have expired */
+static void expire_idle(reactor* r, const config_t* conf)
+{
+	unsigned long now = latency_now();
+	/* keep-alive关闭时不能用0, 那样连接来不及发请求 */
+	int seconds = conf->client_header_timeout > 0 ? conf->client_header_timeout
+			: (conf->keepalive_timeout > 0 ? conf->keepalive_timeout : 60);
+	unsigned long timeout = (unsigned long)seconds * 1000000000UL;
+	while (!queue_empty(&r->header))
+	{
+		http_conn* conn = queue_data(queue_head(&r->header), http_conn, timer);
+		if (now - conn->timer_since < timeout)
+		{
+			break;
+		}
+		close_gracefully(conn);
+		STAT_INC(STAT_HEADER_EXPIRED);
+	}
+
+	timeout = (unsigned long)conf->keepalive_timeout * 1000000000UL;
+	while (!queue_empty(&r->idle))
+	{
+		http_conn* conn = queue_data(queue_head(&r->idle), http_conn, timer);
+		if (now - conn->timer_since < timeout)
+		{
+			break;
+		}
+		close_gracefully(conn);
+		STAT_INC(STAT_IDLE_EXPIRED);
+	}
+}
+
+/* 把读到的请求交给线程池， 队列拒绝时回复503 */
+static void dispatch(reactor* r, http_conn* conn)
 {
-	if (argc <= 2)
+	if (!add_conn(r->pool, conn))
+	{
+		shed_request(conn);
+	}
+}
+
+/* 请求读完整了才交给线程池; 否则继续读， 在header中从accept或者读到请求的第一个
+ * 字节时开始计时， 线程池从不碰reactor的列表 */
+static void dispatch_complete(reactor* r, http_conn* conn)
+{
+	if (request_complete(conn))
+	{
+		timer_remove(conn);
+		dispatch(r, conn);
+		return;
+	}
+	if (!conn->timer_since)
+	{
+		timer_add(&r->header, conn);
+	}
+	mod_fd(conn->epollfd, conn->sockfd, EPOLLIN);
+}
+
+/* 待发送的字节超过高水位后， 发送完响应的keep-alive连接不再读下一个请求， 直到
+ * 降到低水位; 暂停的连接只等挂断事件 */
+static void update_throttle(reactor* r, const config_t* conf)
+{
+	long pending = output_pending;
+	if (!r->throttled)
+	{
+		r->throttled = conf->output_high > 0 && pending >= conf->output_high;
+		return;
+	}
+	if (conf->output_high > 0 && pending > conf->output_low)
+	{
+		return;
+	}
+	r->throttled = FALSE;
+	while (!queue_empty(&r->parked))
+	{
+		http_conn* conn = queue_data(queue_head(&r->parked), http_conn, timer);
+		timer_remove(conn);
+		if (conn->read_index > 0)
+		{
+			dispatch_complete(r, conn);
+			continue;
+		}
+		mod_fd(conn->epollfd, conn->sockfd, EPOLLIN);
+		timer_add(&r->idle, conn);
+	}
+}
+
+/* delayed按到期时间排序， 同一个limit_rate下新到期的通常在队尾 */
+static void delay_add(reactor* r, http_conn* conn, unsigned long due)
+{
+	queue_t* q = queue_last(&r->delayed);
+	for (; q != queue_sentinel(&r->delayed); q = queue_prev(q))
+	{
+		http_conn* prev = queue_data(q, http_conn, timer);
+		if (prev->timer_since <= due)
+		{
+			break;
+		}
+	}
+	conn->timer_since = due;
+	queue_insert_after(q, &conn->timer);
+}
+
+/* a response written completely, up to EAGAIN or up to what limit_rate
+ * allows: the connection waits in writing, delayed, idle or parked */
+static void written(reactor* r, http_conn* conn)
+{
+	if (output_left(conn) > 0)
+	{
+		unsigned long due = paced_until(conn);
+		if (due)
+		{
+			timer_remove(conn);
+			delay_add(r, conn, due);
+		}
+		else if (!conn->timer_since)
+		{
+			timer_add(&r->writing, conn);
+		}
+		return;
+	}
+	timer_remove(conn);
+	if (conn->requests == 0 || conn->write_index != 0)
+	{
+		return;
+	}
+	if (r->throttled)
+	{
+		mod_fd(conn->epollfd, conn->sockfd, 0);
+		timer_add(&r->parked, conn);
+		STAT_INC(STAT_PARKED);
+	}
+	else if (conn->read_index > 0)
+	{
+		/* 流水线中已经读到的下一个请求 */
+		dispatch_complete(r, conn);
+	}
+	else
+	{
+		timer_add(&r->idle, conn);
+	}
+}
+
+static void write_connection(reactor* r, http_conn* conn)
+{
+	if (!http_conn_write(conn))
+	{
+		close_connect(conn);
+	}
+	else
+	{
+		written(r, conn);
+	}
+}
+
+/* 限速到期的连接直接写， 不经过EPOLLOUT */
+static void run_delayed(reactor* r)
+{
+	unsigned long now = latency_now();
+	while (!queue_empty(&r->delayed))
+	{
+		http_conn* conn = queue_data(queue_head(&r->delayed), http_conn, timer);
+		if (conn->timer_since > now)
+		{
+			break;
+		}
+		timer_remove(conn);
+		write_connection(r, conn);
+	}
+}
+
+/* epoll_wait最多等到下一个限速的连接到期 */
+static int next_timeout(reactor* r)
+{
+	if (queue_empty(&r->delayed))
+	{
+		return TIMER_TICK;
+	}
+	http_conn* conn = queue_data(queue_head(&r->delayed), http_conn, timer);
+	unsigned long due = conn->timer_since;
+	unsigned long now = latency_now();
+	if (due <= now)
 	{
-		printf("Usage: %s ip_address port_number\n", argv[0]);
 		return 0;
 	}
+	unsigned long ms = (due - now + 999999) / 1000000;
+	return ms < TIMER_TICK ? (int)ms : TIMER_TICK;
+}
 
-	log_globals_init(&g_log);
-	log_init(&g_log, "jhttpserver.log", NULL);
-	log_set_loglevel(&g_log, LOG_DEBUG);
+/* 每秒检查一次: 写了send_min_time以上、 平均速度低于send_min_rate的连接已经没有
+ * 希望写完， 关闭它们， 释放映射的文件 */
+static void check_send_rate(reactor* r, const config_t* conf)
+{
+	unsigned long now = latency_now();
+	if (conf->send_min_rate <= 0 || now - r->rate_checked < 1000000000UL)
+	{
+		return;
+	}
+	r->rate_checked = now;
+	unsigned long after = (unsigned long)conf->send_min_time * 1000000UL;
+	/* 限速本身不能让连接低于最低速度 */
+	long min_rate = conf->send_min_rate;
+	if (conf->limit_rate > 0 && conf->limit_rate < min_rate)
+	{
+		min_rate = conf->limit_rate;
+	}
+	queue_t* q = queue_head(&r->writing);
+	while (q != queue_sentinel(&r->writing))
+	{
+		http_conn* conn = queue_data(q, http_conn, timer);
+		q = queue_next(q);
+		if (now - conn->timer_since < after)
+		{
+			break;
+		}
+		double seconds = (now - conn->response_ready) / 1e9;
+		if (conn->bytes_sent < min_rate * seconds)
+		{
+			close_connect(conn);
+			STAT_INC(STAT_SLOW_CLOSED);
+		}
+	}
+}
 
-	const char* ip = argv[1];
-	int port = atoi(argv[2]);
+/* 监听socket是边沿触发的， 必须一直accept到EAGAIN; 连接数超过高水位时关闭最老的空闲
+ * 连接， 直到降到低水位 */
+void accept_connections(reactor* r, const config_t* conf)
+{
+	long active = stats_active_connections();
+	long high = (long)conf->worker_connections * conf->keepalive_high / 100;
+	long low = (long)conf->worker_connections * conf->keepalive_low / 100;
+	while (true)
+	{
+		if (active >= high)
+		{
+			active -= evict_idle(r, active - low + 1);
+		}
 
-	INFO(&g_log, "jhttpserver", "%s : %d", ip, port);
+		unsigned long start = latency_now();
+		struct sockaddr_in client_address;
+		socklen_t client_addr_len = sizeof(client_address);
+		int conn_fd = accept(r->listen_fd, (struct sockaddr*)&client_address,
+				&client_addr_len);
+		if (conn_fd < 0)
+		{
+			/* 进程的fd用完时， 关闭一个空闲连接再试 */
+			if ((errno == EMFILE || errno == ENFILE) && evict_idle(r, 1) > 0)
+			{
+				active--;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				ERROR(&g_log, "jhttpserver", "accept failed: %s", strerror(errno));
+			}
+			break;
+		}
+		if (conn_fd >= max_fd || active >= conf->worker_connections)
+		{
+			show_error(conn_fd, "Internal server busy");
+			continue;
+		}
+		active++;
+		r->accepted++;
+		__sync_fetch_and_add(&this_worker->accepted, 1);
+		if (r->cpu >= 0 && incoming_cpu(conn_fd) == r->cpu)
+		{
+			r->local_accepted++;
+		}
+		init_new_connect(&users[conn_fd], r->epollfd, r->cpu, conn_fd,
+				&client_address);
+		timer_add(&r->header, &users[conn_fd]);
+		latency_record(STAGE_ACCEPT, start);
+	}
+}
 
-	add_signal(SIGPIPE, SIG_IGN, TRUE);
+/* 启动新的二进制， 它继承所有监听socket， 开始服务后向本进程发送SIGQUIT */
+void upgrade_binary(void)
+{
+	/* 在master中新的二进制退出时已经被回收, 此时kill会失败 */
+	if (upgrade_pid > 0 && kill(upgrade_pid, 0) == 0)
+	{
+		WARNING(&g_log, "jhttpserver", "upgrade to pid %d already in progress", upgrade_pid);
+		return;
+	}
 
-	thread_pool* pool = create_thread_pool(8 ,10000);
-	if (pool == NULL)
+	upgrade_pid = upgrade_spawn(listeners, listener_number);
+	if (upgrade_pid < 0)
 	{
-		printf("create thread pool is failed.");
-		ERROR(&g_log, "jhttpserver", "create thread pool is failed.");
-		return 1;
+		ERROR(&g_log, "jhttpserver", "failed to start new binary: %s", strerror(errno));
+		return;
 	}
+	INFO(&g_log, "jhttpserver", "started new binary, pid %d", upgrade_pid);
+}
 
-	http_conn* users = (http_conn*)malloc(sizeof(http_conn) * MAX_FD);
-	assert(users);
+/* 新的二进制没能启动时回收它， 本进程继续服务 */
+static void check_upgrade(void)
+{
+	int status = 0;
+	if (upgrade_pid > 0 && waitpid(upgrade_pid, &status, WNOHANG) == upgrade_pid)
+	{
+		ERROR(&g_log, "jhttpserver", "new binary %d exited with status %d, upgrade aborted",
+				upgrade_pid, status);
+		upgrade_pid = -1;
+	}
+}
 
-	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-	struct linger tmp = {1, 0};
-	setsockopt(listen_fd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+/* 不再接受新连接: 先把已经在accept队列中的连接取出来处理， 再关闭监听socket */
+static void stop_accepting(reactor* r, const config_t* conf)
+{
+	epoll_ctl(r->epollfd, EPOLL_CTL_DEL, r->listen_fd, 0);
+	accept_connections(r, conf);
+	close(r->listen_fd);
 
-	int ret = 0;
-	struct sockaddr_in address;
-	bzero(&address, sizeof(address));
-	address.sin_family = AF_INET;
-	address.sin_port = htons(port);
-	inet_pton(AF_INET, ip, &address.sin_addr);
+	int i = 0;
+	for (; i<listener_number; i++)
+	{
+		if (listeners[i] == r->listen_fd)
+		{
+			listeners[i] = -1;
+		}
+	}
+	r->listen_fd = -1;
+}
 
-	ret = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
-	assert(ret >= 0);
-	ret = listen(listen_fd, 5);
-	assert(ret >= 0);
+/* 关闭本事件循环上等待下一个请求的keep-alive连接和还没有发送任何字节的连接，
+ * 正在处理的请求完成后再关闭， 已经读了一部分的请求等它读完 */
+static void close_idle_connections(reactor* r)
+{
+	queue_t* q = queue_head(&r->header);
+	while (q != queue_sentinel(&r->header))
+	{
+		http_conn* conn = queue_data(q, http_conn, timer);
+		q = queue_next(q);
+		if (conn->read_index == 0)
+		{
+			close_gracefully(conn);
+		}
+	}
+	while (!queue_empty(&r->idle))
+	{
+		close_gracefully(queue_data(queue_head(&r->idle), http_conn, timer));
+	}
+	while (!queue_empty(&r->parked))
+	{
+		close_gracefully(queue_data(queue_head(&r->parked), http_conn, timer));
+	}
+}
 
+void* event_loop(void* arg)
+{
+	reactor* r = (reactor*)arg;
 	struct epoll_event events[MAX_EVENT_NUMBER];
-	epollfd = epoll_create(5);
-	assert(epollfd != -1);
-	add_fd(epollfd, listen_fd, false);
+
+	if (pin_current_thread(r->cpu) != 0)
+	{
+		ERROR(&g_log, "jhttpserver", "failed to pin reactor %d to cpu %d", r->id, r->cpu);
+	}
 
 	while (true)
 	{
-		int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+		int number = epoll_wait(r->epollfd, events, MAX_EVENT_NUMBER, next_timeout(r));
 		if ((number < 0) && (errno != EINTR))
 		{
 			printf("epoll failure\n");
 			break;
 		}
 
+		if (r->id == 0)
+		{
+			if (need_dump_stats)
+			{
+				need_dump_stats = 0;
+				dump_cpu_stats();
+			}
+			if (need_dump_latency)
+			{
+				need_dump_latency = 0;
+				dump_latency();
+			}
+			if (need_reload)
+			{
+				need_reload = 0;
+				reload_config();
+			}
+			if (need_upgrade)
+			{
+				need_upgrade = 0;
+				upgrade_binary();
+			}
+			check_upgrade();
+			if (need_quit && !server_draining)
+			{
+				server_draining = TRUE;
+				drain_deadline = time(NULL) + config_current()->worker_shutdown_timeout;
+				INFO(&g_log, "jhttpserver", "draining %ld connections", stats_active_connections());
+			}
+		}
+
+		const config_t* conf = config_acquire();
+		update_throttle(r, conf);
+
+		if (server_draining)
+		{
+			if (r->listen_fd >= 0)
+			{
+				stop_accepting(r, conf);
+			}
+			close_idle_connections(r);
+			long active = r->id == 0 ? stats_active_connections() : 1;
+			if (r->id == 0 && (active <= 0 || time(NULL) >= drain_deadline))
+			{
+				INFO(&g_log, "jhttpserver", "drained, %ld connections left", active);
+				config_release(conf);
+				break;
+			}
+		}
+
 		int i=0;
 		for (; i<number; i++)
 		{
 			int sockfd = events[i].data.fd;
-			if (sockfd == listen_fd)
+			if (sockfd == r->listen_fd)
 			{
-				struct sockaddr_in client_address;
-				socklen_t client_addr_len = sizeof(client_address);
-				int conn_fd = accept(listen_fd, (struct sockaddr*)&client_address,
-						&client_addr_len);
-				if (conn_fd < 0)
-				{
-					printf("errno is : %d\n", errno);
-					continue;
-				}
-				if (user_count > MAX_FD)
-				{
-					show_error(conn_fd, "Internal server busy");
-					continue;
-				}
-				init_new_connect(&users[conn_fd], conn_fd, &client_address);
-
+				accept_connections(r, conf);
 			}
 			else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
 			{
@@ -132,9 +703,18 @@ int main(int argc, char* argv[])
 			}
 			else if (events[i].events & EPOLLIN)
 			{
-				if (http_conn_read(&users[sockfd]))
+				/* 空闲的keep-alive连接开始新的请求， 离开idle; 请求没有读完的留在header */
+				http_conn* conn = &users[sockfd];
+				if (conn->read_index == 0 && conn->requests > 0)
+				{
+					timer_remove(conn);
+				}
+				unsigned long start = latency_now();
+				bool read_ret = http_conn_read(conn);
+				latency_record(STAGE_READ, start);
+				if (read_ret)
 				{
-					add_conn(pool, users + sockfd);
+					dispatch_complete(r, conn);
 				}
 				else
 				{
@@ -143,18 +723,348 @@ int main(int argc, char* argv[])
 			}
 			else if (events[i].events & EPOLLOUT)
 			{
-				if (!http_conn_write(&users[sockfd]))
-				{
-					close_connect(&users[sockfd]);
-				}
+				write_connection(r, &users[sockfd]);
 			}
 		}
+		run_delayed(r);
+		expire_idle(r, conf);
+		check_send_rate(r, conf);
+		config_release(conf);
+	}
+	return NULL;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-a] [-c config_file] [ip_address port_number]\n", name);
+	printf("  -a  one event loop and worker pool per cpu, connections steered to the cpu that received them\n");
+	printf("  -c  configuration file, ip_address and port_number override its listen directive\n");
+}
+
+/* 连接表以fd为下标， 所以它的大小和进程能打开的最大fd数一致 */
+static int setup_connection_table(const config_t* conf)
+{
+	struct rlimit rl;
+	max_fd = conf->worker_connections + RESERVED_FD;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)max_fd)
+	{
+		rl.rlim_cur = rl.rlim_max < (rlim_t)max_fd ? rl.rlim_max : (rlim_t)max_fd;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < (rlim_t)max_fd)
+		{
+			WARNING(&g_log, "jhttpserver", "open file limit %d is below worker_connections %d",
+					(int)rl.rlim_cur, conf->worker_connections);
+		}
+	}
+
+	/* 热的部分按cache line对齐， 不常用的部分单独一张表， 页面用到时才分配 */
+	http_conn_cold* cold = (http_conn_cold*)malloc(sizeof(http_conn_cold) * max_fd);
+	if (cold == NULL || posix_memalign((void**)&users, CACHE_LINE_SIZE,
+			sizeof(http_conn) * max_fd) != 0)
+	{
+		free(cold);
+		return -1;
+	}
+	long buffers = (long)(READ_BUFFER_SIZE + WRITE_BUFFER_SIZE) * max_fd;
+	mem_add(MEM_BUFFERS, buffers);
+	mem_add(MEM_CONNECTIONS, (long)(sizeof(http_conn) + sizeof(http_conn_cold)) * max_fd - buffers);
+
+	int fd = 0;
+	for (; fd<max_fd; fd++)
+	{
+		users[fd].sockfd = -1;
+		users[fd].cold = &cold[fd];
+	}
+	return 0;
+}
+
+/* 继承的监听socket必须绑定在配置的地址上 */
+static bool listener_matches(int fd, const config_t* conf)
+{
+	struct sockaddr_in address;
+	socklen_t len = sizeof(address);
+	char ip[INET_ADDRSTRLEN];
+	if (getsockname(fd, (struct sockaddr*)&address, &len) < 0 || address.sin_family != AF_INET
+			|| inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip)) == NULL)
+	{
+		return FALSE;
+	}
+	return ntohs(address.sin_port) == conf->listen_port && strcmp(ip, conf->listen_ip) == 0;
+}
+
+/* 按顺序创建监听socket， reuseport组中socket的下标就是它在listeners中的下标 */
+static int create_listeners(const config_t* conf, int number)
+{
+	bool reuseport = number > 1 || conf->worker_cpu_affinity;
+	listeners = (int*)malloc(sizeof(int) * number);
+	assert(listeners);
+	listener_number = number;
+
+	int inherited[MAX_LISTENERS];
+	int inherited_number = upgrade_inherited_listeners(inherited, MAX_LISTENERS);
+
+	int i = 0;
+	for (; i<number; i++)
+	{
+		if (i < inherited_number && listener_matches(inherited[i], conf))
+		{
+			listeners[i] = inherited[i];
+			continue;
+		}
+		if (i < inherited_number)
+		{
+			WARNING(&g_log, "jhttpserver", "inherited listener %d does not match listen, closed",
+					inherited[i]);
+			close(inherited[i]);
+		}
+		listeners[i] = create_listener(conf->listen_ip, conf->listen_port,
+				conf->listen_backlog, reuseport);
+		if (listeners[i] < 0)
+		{
+			ERROR(&g_log, "jhttpserver", "listen on %s:%d failed: %s", conf->listen_ip,
+					conf->listen_port, strerror(errno));
+			return -1;
+		}
 	}
 
-	close(epollfd);
-	close(listen_fd);
-	free(users);
-	destroy_thread_pool(pool);
+	for (; i<inherited_number; i++)
+	{
+		close(inherited[i]);
+	}
+	if (inherited_number > 0)
+	{
+		INFO(&g_log, "jhttpserver", "inherited %d listening sockets", inherited_number);
+	}
+
+	if (conf->worker_cpu_affinity && attach_reuseport_cpu_filter(listeners[0], number) < 0)
+	{
+		ERROR(&g_log, "jhttpserver", "attach reuseport cpu filter failed: %s, falling back to hash",
+				strerror(errno));
+	}
 	return 0;
 }
 
+/* 在当前进程中为listeners[first, first+number)各运行一个事件循环， 第i个
+ * 事件循环和它的线程池绑定到first_cpu+i号cpu上 */
+static int run_worker(int first, int number, int first_cpu)
+{
+	const config_t* conf = config_current();
+
+	add_signal(SIGUSR1, sig_dump_stats, TRUE);
+	add_signal(SIGUSR2, sig_dump_latency, TRUE);
+	add_signal(SIGHUP, sig_reload, TRUE);
+	add_signal(SIGQUIT, sig_quit, TRUE);
+	if (!under_master)
+	{
+		add_signal(SIGWINCH, sig_upgrade, TRUE);
+	}
+
+	trace_enabled = conf->trace;
+	if (setup_connection_table(conf) < 0)
+	{
+		ERROR(&g_log, "jhttpserver", "failed to allocate connection table of %d", max_fd);
+		return 1;
+	}
+
+	reactor_number = number;
+	reactors = (reactor*)calloc(reactor_number, sizeof(reactor));
+	assert(reactors);
+
+	/* 信号只由主线程(0号事件循环)处理， 其他线程继承屏蔽所有信号的掩码 */
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+	if (conf->error_log_async && log_async_start(&g_log, conf->error_log_overflow,
+			conf->error_log_binary) < 0)
+	{
+		WARNING(&g_log, "jhttpserver", "failed to start the log thread, logging synchronously");
+	}
+	if (conf->access_log[0] && access_log_open(conf->access_log) < 0)
+	{
+		WARNING(&g_log, "jhttpserver", "failed to open access log %s", conf->access_log);
+	}
+	if (conf->slow_log[0] && slow_log_open(conf->slow_log) < 0)
+	{
+		WARNING(&g_log, "jhttpserver", "failed to open slow log %s", conf->slow_log);
+	}
+
+	int i = 0;
+	for (; i<reactor_number; i++)
+	{
+		reactor* r = &reactors[i];
+		r->id = i;
+		r->cpu = conf->worker_cpu_affinity ? (first_cpu + i) % cpu_count() : -1;
+		r->listen_fd = listeners[first + i];
+		r->epollfd = epoll_create(5);
+		assert(r->epollfd != -1);
+		add_fd(r->epollfd, r->listen_fd, false);
+		queue_init(&r->header);
+		queue_init(&r->idle);
+		queue_init(&r->writing);
+		queue_init(&r->parked);
+		queue_init(&r->delayed);
+
+		r->pool = create_thread_pool(conf->worker_threads, conf->worker_max_requests, r->cpu);
+		if (r->pool == NULL)
+		{
+			printf("create thread pool is failed.");
+			ERROR(&g_log, "jhttpserver", "create thread pool is failed.");
+			access_log_close();
+			slow_log_close();
+			log_async_stop(&g_log);
+			return 1;
+		}
+	}
+
+	for (i=1; i<reactor_number; i++)
+	{
+		mem_add_stack(NULL);
+		assert(pthread_create(&reactors[i].thread, NULL, event_loop, &reactors[i]) == 0);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	if (!under_master)
+	{
+		upgrade_notify_parent();
+	}
+
+	event_loop(&reactors[0]);
+	access_log_close();
+	slow_log_close();
+	capture_close();
+	log_async_stop(&g_log);
+
+	/* 工作线程和其他事件循环还在运行， 线程池和连接表随进程退出释放 */
+	return 0;
+}
+
+/* master模式下每个worker进程只使用属于自己的那个监听socket */
+static int worker_process(int slot)
+{
+	int i = 0;
+	for (; i<listener_number; i++)
+	{
+		if (i != slot)
+		{
+			close(listeners[i]);
+		}
+	}
+	under_master = TRUE;
+	this_worker = &worker_slots[slot];
+	this_worker->accepted = 0;
+	stats_attach(slot);
+	capture_attach(slot);
+	return run_worker(slot, 1, slot);
+}
+
+static void master_dump_stats(void)
+{
+	dump_worker_stats(worker_slots, listener_number);
+}
+
+int main(int argc, char* argv[])
+{
+	upgrade_save_argv(argc, argv);
+
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "ac:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			cli_cpu_affinity = TRUE;
+			break;
+		case 'c':
+			conf_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((conf_file == NULL && argc - optind < 2) || (argc - optind == 1))
+	{
+		usage(argv[0]);
+		return 0;
+	}
+
+	char err[512];
+	config_t* conf = conf_file ? config_load(conf_file, err, sizeof(err)) : config_default();
+	if (conf == NULL)
+	{
+		fprintf(stderr, "ERROR: %s\n", err);
+		return 1;
+	}
+	if (argc - optind >= 2)
+	{
+		cli_ip = argv[optind];
+		cli_port = argv[optind + 1];
+	}
+	apply_overrides(conf);
+	if (config_validate(conf, err, sizeof(err)) < 0)
+	{
+		fprintf(stderr, "ERROR: %s\n", err);
+		return 1;
+	}
+	config_publish(conf);
+
+	log_globals_init(&g_log);
+	log_init(&g_log, conf->error_log, NULL);
+	log_set_loglevel(&g_log, conf->error_log_level);
+
+	INFO(&g_log, "jhttpserver", "%s : %d", conf->listen_ip, conf->listen_port);
+
+	add_signal(SIGPIPE, SIG_IGN, TRUE);
+
+	bool master = conf->master_process || conf->worker_processes > 1;
+	int worker_number = master ? conf->worker_processes : 1;
+	if (shm_create(&g_shm, SHM_SIZE + sizeof(stats_shard_t) * STATS_SHARDS * worker_number) < 0
+			|| (worker_slots = (worker_slot_t*)shm_alloc(&g_shm,
+					sizeof(worker_slot_t) * worker_number)) == NULL
+			|| stats_init(&g_shm, worker_number) < 0)
+	{
+		ERROR(&g_log, "jhttpserver", "failed to create shared memory: %s", strerror(errno));
+		return 1;
+	}
+	mem_add(MEM_SHM, g_shm.size);
+
+	/* workers append to the file opened here, with O_APPEND */
+	if (conf->capture_file[0] && capture_open(conf->capture_file) < 0)
+	{
+		WARNING(&g_log, "jhttpserver", "failed to open capture file %s: %s", conf->capture_file,
+				strerror(errno));
+	}
+
+	int ret = 0;
+	if (master)
+	{
+		/* 每个worker一个reuseport监听socket， 由内核在worker之间分配连接 */
+		master_hooks_t hooks = { worker_process, reload_config, master_dump_stats,
+				upgrade_binary, upgrade_notify_parent };
+		ret = create_listeners(conf, worker_number) < 0 ? 1
+				: master_cycle(worker_slots, worker_number, &hooks);
+	}
+	else
+	{
+		int number = conf->worker_cpu_affinity ? cpu_count() : 1;
+		this_worker = &worker_slots[0];
+		this_worker->pid = getpid();
+		this_worker->started = time(NULL);
+		stats_attach(0);
+		ret = create_listeners(conf, number) < 0 ? 1 : run_worker(0, number, 0);
+	}
+
+	int i = 0;
+	for (; i<listener_number; i++)
+	{
+		if (listeners[i] >= 0)
+		{
+			close(listeners[i]);
+		}
+	}
+	free(listeners);
+	shm_destroy(&g_shm);
+	config_release(config_current());
+	return ret;
+}
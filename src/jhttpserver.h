@@ -11,10 +11,50 @@
 #include "http_connect.h"
 #include "thread_pool.h"
 #include "log.h"
+#include "shm.h"
+#include "master.h"
+#include "upgrade.h"
+
+/* one event loop: its epoll instance, the listener it accepts on and the
+ * pool its requests are handed to */
+struct reactor_t
+{
+	int id;
+	int cpu;						//绑定的cpu, -1表示不绑定
+	int epollfd;
+	int listen_fd;
+	pthread_t thread;
+	thread_pool* pool;
+	unsigned long accepted;			//accept的连接数
+	unsigned long local_accepted;	//网卡软中断也在本cpu上处理的连接数
+	queue_t header;					//刚accept或者请求还没有读完整的连接， 最早开始等的在队头
+	queue_t idle;					//等待下一个请求的keep-alive连接， 最老的在队头
+	queue_t writing;				//响应没有一次写完的连接， 最早开始等的在队头
+	queue_t parked;					//待发送的字节超过output_watermarks时暂停读的keep-alive连接
+	queue_t delayed;				//被limit_rate限速的连接， 按到期时间排序
+	bool throttled;					//在output_watermarks的高水位和低水位之间
+	unsigned long rate_checked;		//上次检查send_min_rate的单调时间， 纳秒
+};
+
+typedef struct reactor_t reactor;
+
+void* event_loop(void* arg);
+
+void accept_connections(reactor* r, const config_t* conf);
+
+void upgrade_binary(void);
+
+void dump_cpu_stats(void);
+
+void dump_latency(void);
+
+void reload_config(void);
 
 void add_signal(int signal, void (handler)(int), bool restart);
 void show_error(int conn_fd, const char* info);
 
 extern log_handle_t g_log;
 
+extern shm_zone_t g_shm;
+
 #endif
@@ -0,0 +1,103 @@
+/*
+ * lane.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "lane.h"
+
+/* hash of the URL in the upper 32 bits and the lane + 1 in the lower, 0
+ * for an empty entry; one word loaded and stored with relaxed atomics, so
+ * a reader never sees half an update, and a collision only puts a request
+ * in another lane */
+static unsigned long hints[LANE_HINTS];
+
+static const char* lane_names[] = { "fast", "small", "large" };
+
+static unsigned int hash(const char* url, int length)
+{
+	unsigned int h = 2166136261U;
+	int i = 0;
+	for (; i<length; i++)
+	{
+		h = (h ^ (unsigned char)url[i]) * 16777619U;
+	}
+	return h;
+}
+
+/* what the hints are keyed by: the target as parse_request_line() leaves
+ * it, without an absolute-form "http://host" prefix; the query is kept */
+static const char* lane_key(const char* url, int* length)
+{
+	if (*length >= 7 && strncasecmp(url, "http://", 7) == 0)
+	{
+		const char* path = memchr(url + 7, '/', *length - 7);
+		if (path)
+		{
+			*length -= path - url;
+			return path;
+		}
+	}
+	return url;
+}
+
+static int url_length(const char* url, int length)
+{
+	int i = 0;
+	while (i < length && url[i] != ' ' && url[i] != '\t' && url[i] != '\r' && url[i] != '\n')
+	{
+		i++;
+	}
+	return i;
+}
+
+lane_t lane_classify(const char* buf, int length)
+{
+	/* 跳过方法， 请求行还没读完时处理它只是再等数据 */
+	int i = url_length(buf, length);
+	while (i < length && (buf[i] == ' ' || buf[i] == '\t'))
+	{
+		i++;
+	}
+	int n = url_length(buf + i, length - i);
+	if (n == 0 || i + n == length)
+	{
+		return LANE_FAST;
+	}
+
+	const char* url = lane_key(buf + i, &n);
+	unsigned int h = hash(url, n);
+	unsigned long hint = __atomic_load_n(&hints[h & (LANE_HINTS - 1)], __ATOMIC_RELAXED);
+	if (hint == 0 || (unsigned int)(hint >> 32) != h)
+	{
+		return LANE_LARGE;
+	}
+	return (lane_t)((hint & 0xffffffffUL) - 1);
+}
+
+void lane_learn(const char* url, int status, long size, long small)
+{
+	lane_t lane = LANE_LARGE;
+	if (status >= 400)
+	{
+		lane = LANE_FAST;
+	}
+	else if (size <= small)
+	{
+		lane = LANE_SMALL;
+	}
+	int n = strlen(url);
+	url = lane_key(url, &n);
+	unsigned int h = hash(url, n);
+	__atomic_store_n(&hints[h & (LANE_HINTS - 1)], ((unsigned long)h << 32) | (lane + 1),
+			__ATOMIC_RELAXED);
+}
+
+const char* lane_name(lane_t lane)
+{
+	return lane_names[lane];
+}
@@ -0,0 +1,32 @@
+/*
+ * lane.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef LANE_H_
+#define LANE_H_
+
+/* entries of the table of what each URL turned out to be, a power of 2 */
+#define LANE_HINTS 4096
+
+/* the pool queue a request waits in, taken in weighted turns */
+typedef enum {
+	LANE_FAST = 0,		/* errors and requests not complete yet */
+	LANE_SMALL,			/* the status page and files up to worker_queue_lanes */
+	LANE_LARGE,			/* larger files and URLs not seen yet */
+	LANE_NUMBER
+} lane_t;
+
+/* the lane of the raw request in buf, from its URL alone; the bytes are
+ * not parsed yet, so the request is only read up to the URL */
+lane_t lane_classify(const char* buf, int length);
+
+/* remember for the next requests of url that it was answered with status
+ * and a body of size bytes */
+void lane_learn(const char* url, int status, long size, long small);
+
+const char* lane_name(lane_t lane);
+
+#endif /* LANE_H_ */
@@ -0,0 +1,164 @@
+/*
+ * latency.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "latency.h"
+#include "mem.h"
+#include "stats.h"
+
+/* one thread's histograms, written only by it and never freed */
+typedef struct histogram_s histogram_t;
+struct histogram_s {
+	unsigned long counts[STAGE_NUMBER][LATENCY_BUCKETS];
+	unsigned long max[STAGE_NUMBER];
+	histogram_t* next;
+};
+
+static const char* stage_names[] = { "accept", "read", "queue", "parse", "file", "write",
+		"total" };
+
+static histogram_t* histograms = NULL;
+static pthread_mutex_t histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread histogram_t* my_histogram = NULL;
+
+static int bucket_of(unsigned long v)
+{
+	if (v < LATENCY_SUB_BUCKETS)
+	{
+		return v;
+	}
+	int shift = 63 - __builtin_clzl(v) - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + ((v >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the middle of a bucket */
+static unsigned long value_of(int bucket)
+{
+	if (bucket < LATENCY_SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	unsigned long sub = bucket % LATENCY_SUB_BUCKETS;
+	return ((LATENCY_SUB_BUCKETS + sub) << shift) + ((1UL << shift) >> 1);
+}
+
+void latency_record(stage_t stage, unsigned long start)
+{
+	histogram_t* h = my_histogram;
+	if (__builtin_expect(h == NULL, 0))
+	{
+		h = (histogram_t*)calloc(1, sizeof(histogram_t));
+		if (h == NULL)
+		{
+			return;
+		}
+		mem_add(MEM_INSTRUMENTATION, sizeof(histogram_t));
+		pthread_mutex_lock(&histograms_lock);
+		h->next = histograms;
+		histograms = h;
+		pthread_mutex_unlock(&histograms_lock);
+		my_histogram = h;
+	}
+
+	unsigned long now = latency_now();
+	unsigned long v = now > start ? now - start : 0;
+	h->counts[stage][bucket_of(v)]++;
+	if (v > h->max[stage])
+	{
+		h->max[stage] = v;
+	}
+}
+
+/* the value below which q of the samples are, at most the largest one */
+static unsigned long quantile(const unsigned long* counts, unsigned long total,
+		unsigned long max, double q)
+{
+	unsigned long rank = (unsigned long)(q * total);
+	unsigned long seen = 0;
+	int i = 0;
+	for (; i<LATENCY_BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen > rank)
+		{
+			return value_of(i) < max ? value_of(i) : max;
+		}
+	}
+	return 0;
+}
+
+int latency_format(char* buf, size_t size, bool prometheus)
+{
+	histogram_t* merged = (histogram_t*)calloc(1, sizeof(histogram_t));
+	if (merged == NULL)
+	{
+		return -1;
+	}
+
+	/* 合并各线程的直方图， 读的时候线程还在写， 个别样本可能算进下一次 */
+	pthread_mutex_lock(&histograms_lock);
+	histogram_t* h = histograms;
+	for (; h; h=h->next)
+	{
+		int s = 0;
+		for (; s<STAGE_NUMBER; s++)
+		{
+			int i = 0;
+			for (; i<LATENCY_BUCKETS; i++)
+			{
+				merged->counts[s][i] += h->counts[s][i];
+			}
+			merged->max[s] = h->max[s] > merged->max[s] ? h->max[s] : merged->max[s];
+		}
+	}
+	pthread_mutex_unlock(&histograms_lock);
+
+	size_t len = 0;
+	if (prometheus)
+	{
+		buf_append(buf, size, &len,
+				"# HELP jhttpserver_stage_seconds Time spent in each stage of a request.\n"
+				"# TYPE jhttpserver_stage_seconds summary\n");
+	}
+	int s = 0;
+	for (; s<STAGE_NUMBER; s++)
+	{
+		unsigned long total = 0;
+		int i = 0;
+		for (; i<LATENCY_BUCKETS; i++)
+		{
+			total += merged->counts[s][i];
+		}
+		unsigned long p50 = quantile(merged->counts[s], total, merged->max[s], 0.5);
+		unsigned long p99 = quantile(merged->counts[s], total, merged->max[s], 0.99);
+		unsigned long p999 = quantile(merged->counts[s], total, merged->max[s], 0.999);
+
+		if (prometheus)
+		{
+			buf_append(buf, size, &len, "jhttpserver_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+					"jhttpserver_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+					"jhttpserver_stage_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n"
+					"jhttpserver_stage_seconds_count{stage=\"%s\"} %lu\n",
+					stage_names[s], p50 / 1e9, stage_names[s], p99 / 1e9,
+					stage_names[s], p999 / 1e9, stage_names[s], total);
+		}
+		else
+		{
+			buf_append(buf, size, &len, "%-6s count %lu p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+					stage_names[s], total, p50 / 1e3, p99 / 1e3, p999 / 1e3,
+					merged->max[s] / 1e3);
+		}
+	}
+
+	free(merged);
+	return len < size ? (int)len : -1;
+}
@@ -0,0 +1,52 @@
+/*
+ * latency.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "common.h"
+
+typedef enum BOOL bool;
+
+/* log-linear buckets: values below 2^LATENCY_SUB_BITS nanoseconds are
+ * exact, above that every power of two is split in 2^LATENCY_SUB_BITS
+ * buckets, so a quantile is off by at most 1/16 */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef enum {
+	STAGE_ACCEPT = 0,		/* accept() until the connection is registered */
+	STAGE_READ,				/* recv() of a readable connection */
+	STAGE_QUEUE,			/* add_conn() until a pool thread takes it */
+	STAGE_PARSE,			/* process() until the request is parsed */
+	STAGE_FILE,				/* stat, open and mmap in do_request() */
+	STAGE_WRITE,			/* response ready until its last byte is sent */
+	STAGE_TOTAL,			/* first byte read until the last byte is sent */
+	STAGE_NUMBER
+} stage_t;
+
+/* monotonic nanoseconds */
+static inline unsigned long latency_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* add the time since start to stage in the calling thread's histogram */
+void latency_record(stage_t stage, unsigned long start);
+
+/* p50, p99, p999 and max of every stage merged over the threads of this
+ * process, in Prometheus summary format or as text; the length, or -1 if
+ * buf is too small */
+int latency_format(char* buf, size_t len, bool prometheus);
+
+#endif /* LATENCY_H_ */
@@ -27,6 +27,7 @@
 #endif /* USE_SYSLOG */
 
 #include "log.h"
+#include "log_async.h"
 
 #ifdef LINUX_HOST_OS
 #include <syslog.h>
@@ -72,6 +73,48 @@ static inline void time_fmt (char *dst, size_t sz_dst, time_t utime, unsigned in
 void log_logrotate(log_handle_t* log, int signum)
 {
 	log->logrotate = 1;
+	log_async_reopen(log);
+}
+
+int log_reopen(log_handle_t* log)
+{
+	FILE *new_logfile = NULL;
+	int fd = -1;
+
+	log->logrotate = 0;
+	if (!log->filename)
+	{
+		return 0;
+	}
+
+	fd = open(log->filename, O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		log(log, "logrotate", LOG_ERROR, "%s", strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	new_logfile = fopen(log->filename, "a");
+	if (!new_logfile)
+	{
+		log(log, "logrotate", LOG_CRITICAL,
+				"failed to open logfile %s (%s)", log->filename,
+				strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&log->logfile_mutex);
+	{
+		if (log->logfile)
+		{
+			fclose(log->logfile);
+		}
+
+		log->log_logfile = log->logfile = new_logfile;
+	}
+	pthread_mutex_unlock(&log->logfile_mutex);
+	return 0;
 }
 
 void log_enable_syslog(log_handle_t* log)
@@ -326,6 +369,7 @@ void syslog(int error_code, int facility_priority, char *format, ...)
 void log_globals_init(log_handle_t* log) {
 	pthread_mutex_init(&log->logfile_mutex, NULL);
 
+	log->async = NULL;
 	log->loglevel = LOG_INFO;
 	log->log_syslog = 1;
 	log->sys_log_level = LOG_CRITICAL;
@@ -731,11 +775,10 @@ out:
 	return ret;
 }
 
-int _log(log_handle_t* log, const char *domain, const char *file,
-		const char *function, int line, loglevel_t level, const char *fmt, ...) {
+int _vlog(log_handle_t* log, const char *domain, const char *file,
+		const char *function, int line, loglevel_t level, const char *fmt, va_list ap) {
 	const char *basename = NULL;
-	FILE *new_logfile = NULL;
-	va_list ap;
+	va_list aq;
 	char timestr[256] = { 0, };
 	struct timeval tv = { 0, };
 	char *str1 = NULL;
@@ -743,7 +786,6 @@ int _log(log_handle_t* log, const char *domain, const char *file,
 	char *msg = NULL;
 	size_t len = 0;
 	int ret = 0;
-	int fd = -1;
 
 	if (level > log->loglevel)
 	{
@@ -794,9 +836,7 @@ int _log(log_handle_t* log, const char *domain, const char *file,
 			priority = level - 1;
 		}
 
-		va_start (ap, fmt);
 		vasprintf (&str2, fmt, ap);
-		va_end (ap);
 
 		syslog (ERR_DEV, priority,
 				"[%s:%d:%s] %d-%s: %s",
@@ -806,49 +846,30 @@ int _log(log_handle_t* log, const char *domain, const char *file,
 	}
 #endif /* USE_SYSLOG */
 
-	if (log->logrotate)
+	/* 异步写日志时由写日志的线程重新打开 */
+	if (log->logrotate && !log->async)
 	{
-		log->logrotate = 0;
-		fd = open(log->filename, O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR);
-		if (fd < 0)
-		{
-			free(msg);
-			free(str1);
-			free(str2);
-			log(log, "logrotate", LOG_ERROR, "%s", strerror(errno));
-			return -1;
-		}
-		close(fd);
-
-		new_logfile = fopen(log->filename, "a");
-		if (!new_logfile)
-		{
-			log(log, "logrotate", LOG_CRITICAL,
-					"failed to open logfile %s (%s)", log->filename,
-					strerror(errno));
-			goto log;
-		}
+		log_reopen(log);
+	}
 
-		pthread_mutex_lock(&log->logfile_mutex);
+	if (log->async)
+	{
+		/* formatted into the calling thread's ring, written by the log thread */
+		va_copy(aq, ap);
+		ret = log_async_vwrite(log, level_strings[level], basename, line, function,
+				domain, fmt, aq);
+		va_end(aq);
+		if (0 == ret)
 		{
-			if (log->logfile)
-			{
-				fclose(log->logfile);
-			}
-
-			log->log_logfile = log->logfile = new_logfile;
+			goto out;
 		}
-		pthread_mutex_unlock(&log->logfile_mutex);
-
 	}
 
-log:
 	ret = gettimeofday(&tv, NULL);
 	if (-1 == ret)
 	{
 		goto out;
 	}
-	va_start(ap, fmt);
 	time_fmt(timestr, sizeof timestr, tv.tv_sec, timefmt_FT);
 	snprintf(timestr + strlen(timestr), sizeof timestr - strlen(timestr),
 			".%"PRI_SUSECONDS, tv.tv_usec);
@@ -866,8 +887,6 @@ log:
 		goto err;
 	}
 
-	va_end(ap);
-
 	len = strlen(str1);
 	msg = (char*)malloc(sizeof(char) * (len + strlen(str2) + 1));
 
@@ -907,6 +926,31 @@ out:
 	return (0);
 }
 
+int _log(log_handle_t* log, const char *domain, const char *file,
+		const char *function, int line, loglevel_t level, const char *fmt, ...) {
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, fmt);
+	ret = _vlog(log, domain, file, function, line, level, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+int _log_site(log_handle_t* log, const log_site_t *site, ...) {
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, site);
+	if (!log->async || log_async_vbinary(log, site, ap) < 0)
+	{
+		ret = _vlog(log, site->domain, site->file, site->function, site->line,
+				site->level, site->fmt, ap);
+	}
+	va_end(ap);
+	return ret;
+}
+
 int _log_eh(log_handle_t* log, const char *function, const char *fmt, ...) {
 	int ret = -1;
 	va_list ap;
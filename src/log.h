@@ -51,6 +51,30 @@ typedef enum {
 #define DEFAULT_LOG_FILE_DIRECTORY            DATADIR "/log/jhttpserver"
 #define DEFAULT_LOG_LEVEL                     LOG_INFO
 
+/* the number of the highest loglevel_t compiled in, see --with-log-level;
+ * DEBUG() and friends above it expand to nothing, so does log() once the
+ * compiler drops the constant false branch */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL                     9       /* LOG_TRACE */
+#endif
+#if LOG_COMPILE_LEVEL < 1 || LOG_COMPILE_LEVEL > 9
+#error "LOG_COMPILE_LEVEL must be the number of a loglevel_t, e.g. 7 for LOG_INFO"
+#endif
+
+/* what a log() call site knows at compile time; one static instance per
+ * site in section log_sites, its index there is the site id written to
+ * the binary log */
+typedef struct log_site_ {
+        const char      *domain;
+        const char      *file;
+        const char      *function;
+        const char      *fmt;
+        int              line;
+        loglevel_t       level;
+} log_site_t;
+
+#define LOG_SITE_SECTION                      "log_sites"
+
 typedef struct log_handle_ {
         pthread_mutex_t  logfile_mutex;
         uint8_t          logrotate;
@@ -63,6 +87,7 @@ typedef struct log_handle_ {
         FILE            *log_logfile;
         char            *cmd_log_filename;
         FILE            *cmdlogfile;
+        struct log_async_s *async;      /* NULL: _log writes synchronously */
 #ifdef USE_SYSLOG
         int              log_control_file_found;
         char            *ident;
@@ -99,12 +124,22 @@ int log_init(log_handle_t* log, const char *filename, const char *ident);
 
 void log_logrotate(log_handle_t* log, int signum);
 
+/* reopen the log file after it was renamed, logrotate does this lazily */
+int log_reopen(log_handle_t* log);
+
 //void log_cleanup(log_handle_t log);
 
 int _log(log_handle_t* log, const char *domain, const char *file,
              const char *function, int32_t line, loglevel_t level,
              const char *fmt, ...);
 
+int _vlog(log_handle_t* log, const char *domain, const char *file,
+             const char *function, int32_t line, loglevel_t level,
+             const char *fmt, va_list ap);
+
+/* a binary record if the log thread writes a binary log, else _log() */
+int _log_site(log_handle_t* log, const log_site_t *site, ...);
+
 int _log_callingfn(log_handle_t* log, const char *domain, const char *file,
                        const char *function, int32_t line, loglevel_t level,
                        const char *fmt, ...);
@@ -119,10 +154,17 @@ int _log_eh(log_handle_t* log, const char *function, const char *fmt, ...);
 
 #define FMT_WARN(fmt...) do { if (0) printf (fmt); } while (0)
 
-#define log(logger, dom, levl, fmt...) do {                                  \
-                FMT_WARN (fmt);                                         \
-                _log (logger, dom, __FILE__, __FUNCTION__, __LINE__,         \
-                         levl, ##fmt);                                  \
+#define log(logger, dom, levl, format, args...) do {                        \
+                if ((levl) <= LOG_COMPILE_LEVEL                          \
+                    && (levl) <= (logger)->loglevel) {                   \
+                        static log_site_t __log_site                     \
+                        __attribute__((section(LOG_SITE_SECTION),         \
+                                       aligned(8))) = {                  \
+                                dom, __FILE__, __FUNCTION__, format,     \
+                                __LINE__, levl };                        \
+                        FMT_WARN (format, ##args);                       \
+                        _log_site (logger, &__log_site, ##args);         \
+                }                                                        \
         } while (0)
 
 #define log_eh(logger, fmt...) do {                                          \
@@ -167,13 +209,33 @@ int j_asprintf(char **string_ptr, const char *format, ...);
 
 int j_vasprintf(char **string_ptr, const char *format, va_list arg);
 
+/* still type checks the arguments, so they are not unused */
+#define LOG_DISABLED(logger, name, format, args...)                    \
+        FMT_WARN (format, ##args)
+
+#if LOG_COMPILE_LEVEL >= 8
 #define DEBUG(logger, name, format, args...)                           \
         log(logger, name, LOG_DEBUG, format, ##args)
+#else
+#define DEBUG LOG_DISABLED
+#endif
+#if LOG_COMPILE_LEVEL >= 7
 #define INFO(logger, name, format, args...)                            \
         log(logger, name, LOG_INFO, format, ##args)
+#else
+#define INFO LOG_DISABLED
+#endif
+#if LOG_COMPILE_LEVEL >= 5
 #define WARNING(logger, name, format, args...)                         \
         log(logger, name, LOG_WARNING, format, ##args)
+#else
+#define WARNING LOG_DISABLED
+#endif
+#if LOG_COMPILE_LEVEL >= 4
 #define ERROR(logger, name, format, args...)                           \
         log(logger, name, LOG_ERROR, format, ##args)
+#else
+#define ERROR LOG_DISABLED
+#endif
 
 #endif /* LOG_H_ */
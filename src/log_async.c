@@ -0,0 +1,647 @@
+/*
+ * log_async.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "log_async.h"
+#include "log_binary.h"
+#include "mem.h"
+
+typedef enum BOOL bool;
+
+/* a record is a 4 byte length followed by the line, padded to 8 bytes;
+ * a record that does not fit before the end of the ring starts at offset 0
+ * and a RECORD_WRAP length tells the writer to skip the rest */
+#define RECORD_HEADER sizeof(unsigned int)
+#define RECORD_ALIGN 8
+#define RECORD_WRAP 0xffffffffu
+#define RECORD_BINARY 0x80000000u		/* a log_record_t instead of a text line */
+#define RECORD_SIZE(len) (((len) + RECORD_HEADER + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1))
+
+#define WRITE_BATCH IOV_MAX
+
+/* most arguments a deferred call site may have */
+#define SITE_MAX_ARGS 15
+
+/* the log() call sites, laid out by the linker */
+extern log_site_t __start_log_sites[] __attribute__((weak));
+extern log_site_t __stop_log_sites[] __attribute__((weak));
+
+/* single producer (the owning thread), single consumer (the writer) */
+typedef struct log_ring_s log_ring_t;
+struct log_ring_s {
+	unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));	//只由所属线程修改
+	unsigned long dropped;
+	unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));	//只由写线程修改
+	unsigned long batch_tail;			//本批写完后的tail
+	log_ring_t* next;
+	char buf[LOG_RING_SIZE];
+};
+
+typedef struct log_async_s log_async_t;
+struct log_async_s {
+	log_handle_t* log;
+	log_overflow_t overflow;
+	volatile bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;				//保护rings链表和cond
+	pthread_cond_t cond;
+	log_ring_t* volatile rings;
+	unsigned long reported_dropped;
+
+	int binary_fd;						//二进制日志， -1表示只写文本
+	char* binary_path;
+	volatile bool reopen;
+	char (*site_types)[SITE_MAX_ARGS + 1];	//每个site的参数类型， 空串以外以'!'开头的不能延迟格式化
+	char* sites_block;					//LOG_BLOCK_SITES块， 每次打开文件时先写
+	size_t sites_length;
+};
+
+/* 线程在每个log_async_t上各有一个环， 一个进程里只有错误日志和访问日志 */
+#define THREAD_RINGS 4
+static __thread struct {
+	log_async_t* owner;
+	log_ring_t* ring;
+} my_rings[THREAD_RINGS];
+static __thread time_t cached_second = 0;
+static __thread char cached_time[32];
+
+static log_ring_t* thread_ring(log_async_t* async)
+{
+	int i = 0;
+	for (; i<THREAD_RINGS && my_rings[i].owner; i++)
+	{
+		if (my_rings[i].owner == async)
+		{
+			return my_rings[i].ring;
+		}
+	}
+	if (i == THREAD_RINGS)
+	{
+		return NULL;
+	}
+
+	{
+		log_ring_t* ring = NULL;
+		if (posix_memalign((void**)&ring, CACHE_LINE_SIZE, sizeof(log_ring_t)) != 0)
+		{
+			return NULL;
+		}
+		ring->head = ring->tail = ring->batch_tail = 0;
+		ring->dropped = 0;
+		mem_add(MEM_LOG, sizeof(log_ring_t));
+
+		/* 写线程不加锁遍历链表， 先写好next再发布 */
+		pthread_mutex_lock(&async->lock);
+		ring->next = async->rings;
+		__sync_synchronize();
+		async->rings = ring;
+		pthread_mutex_unlock(&async->lock);
+		my_rings[i].owner = async;
+		my_rings[i].ring = ring;
+		return ring;
+	}
+}
+
+/* "[YYYY-MM-DD hh:mm:ss.uuuuuu]" like _log(), strftime only once a second */
+static int format_time(char* dst, size_t len)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec != cached_second)
+	{
+		struct tm tm;
+		gmtime_r(&tv.tv_sec, &tm);
+		strftime(cached_time, sizeof(cached_time), "%F %T", &tm);
+		cached_second = tv.tv_sec;
+	}
+	return snprintf(dst, len, "[%s.%06ld]", cached_time, (long)tv.tv_usec);
+}
+
+/* 写线程被唤醒的条件: 环中的数据超过一半 */
+static void wake_writer(log_async_t* async)
+{
+	pthread_mutex_lock(&async->lock);
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+}
+
+/* reserve room for the longest line at the head of ring, NULL if full */
+static char* reserve(log_ring_t* ring)
+{
+	unsigned long need = RECORD_SIZE(LOG_LINE_MAX);
+	unsigned long tail = ring->tail;
+	__sync_synchronize();
+
+	unsigned long pos = ring->head % LOG_RING_SIZE;
+	unsigned long skip = LOG_RING_SIZE - pos < need ? LOG_RING_SIZE - pos : 0;
+	if (LOG_RING_SIZE - (ring->head - tail) < skip + need)
+	{
+		return NULL;
+	}
+	if (skip > 0)
+	{
+		*(unsigned int*)(ring->buf + pos) = RECORD_WRAP;
+		ring->head += skip;
+		pos = 0;
+	}
+	return ring->buf + pos + RECORD_HEADER;
+}
+
+/* room for LOG_LINE_MAX bytes in the calling thread's ring; NULL with
+ * *ringp NULL if the caller has to write synchronously, NULL with *ringp
+ * set if the ring is full and the line was dropped */
+static char* begin_record(log_async_t* async, log_ring_t** ringp)
+{
+	*ringp = NULL;
+	if (async == NULL || !async->running)
+	{
+		return NULL;
+	}
+
+	log_ring_t* ring = thread_ring(async);
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+	*ringp = ring;
+
+	char* p = reserve(ring);
+	while (p == NULL)
+	{
+		if (async->overflow == LOG_OVERFLOW_DROP || !async->running)
+		{
+			ring->dropped++;
+			return NULL;
+		}
+		wake_writer(async);
+		usleep(1000);
+		p = reserve(ring);
+	}
+	return p;
+}
+
+/* publish the record begin_record() returned, length is its size possibly
+ * or'ed with RECORD_BINARY */
+static void end_record(log_async_t* async, log_ring_t* ring, char* p, unsigned int length)
+{
+	unsigned int size = RECORD_SIZE(length & ~RECORD_BINARY);
+	unsigned long used = ring->head - ring->tail;
+	*(unsigned int*)(p - RECORD_HEADER) = length;
+	__sync_synchronize();
+	ring->head += size;
+
+	if (used < LOG_RING_SIZE / 2 && used + size >= LOG_RING_SIZE / 2)
+	{
+		wake_writer(async);
+	}
+}
+
+char* log_async_reserve(log_handle_t* log)
+{
+	log_ring_t* ring = NULL;
+	return begin_record(log->async, &ring);
+}
+
+void log_async_commit(log_handle_t* log, char* line, int length)
+{
+	log_async_t* async = log->async;
+	if (async)
+	{
+		end_record(async, thread_ring(async), line, length);
+	}
+}
+
+int log_async_vwrite(log_handle_t* log, const char* level, const char* file, int line,
+		const char* function, const char* domain, const char* fmt, va_list ap)
+{
+	log_async_t* async = log->async;
+	log_ring_t* ring = NULL;
+	char* p = begin_record(async, &ring);
+	if (p == NULL)
+	{
+		return ring ? 0 : -1;
+	}
+
+	/* 和_log()相同的格式， 直接写进环里， 不分配内存 */
+	int len = format_time(p, LOG_LINE_MAX);
+	len += snprintf(p + len, LOG_LINE_MAX - len, " %s [%s:%d:%s] %s: ",
+			level, file, line, function, domain);
+	if (len < LOG_LINE_MAX - 1)
+	{
+		int n = vsnprintf(p + len, LOG_LINE_MAX - len, fmt, ap);
+		len = n < 0 ? len : (len + n < LOG_LINE_MAX - 1 ? len + n : LOG_LINE_MAX - 1);
+	}
+	else
+	{
+		len = LOG_LINE_MAX - 1;
+	}
+	p[len++] = '\n';
+
+	end_record(async, ring, p, len);
+	return 0;
+}
+
+int log_async_vbinary(log_handle_t* log, const log_site_t* site, va_list ap)
+{
+	log_async_t* async = log->async;
+	if (async == NULL || !async->running || async->binary_fd < 0
+			|| site < __start_log_sites || site >= __stop_log_sites)
+	{
+		return -1;
+	}
+
+	uint32_t id = site - __start_log_sites;
+	const char* types = async->site_types[id];
+	if (types[0] == '!')
+	{
+		return -1;
+	}
+
+	log_ring_t* ring = NULL;
+	char* p = begin_record(async, &ring);
+	if (p == NULL)
+	{
+		return ring ? 0 : -1;
+	}
+
+	/* 只复制参数， 格式化留给JLogDecode */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	log_record_t record = { 0, id, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec };
+	char* q = p + sizeof(record);
+	char* end = p + LOG_LINE_MAX;
+	for (; *types; types++)
+	{
+		int64_t v = 0;
+		double d = 0;
+		switch (*types)
+		{
+		case LOG_ARG_INT:
+			v = va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			v = va_arg(ap, long);
+			break;
+		case LOG_ARG_LLONG:
+			v = va_arg(ap, long long);
+			break;
+		case LOG_ARG_PTR:
+			v = (intptr_t)va_arg(ap, void*);
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(q, &d, sizeof(d));
+			q += sizeof(d);
+			continue;
+		case LOG_ARG_STRING:
+		{
+			const char* str = va_arg(ap, const char*);
+			str = str ? str : "(null)";
+			/* 字符串太长时截断， 给后面的定长参数留出位置 */
+			long room = end - q - sizeof(uint32_t) - SITE_MAX_ARGS * sizeof(int64_t);
+			uint32_t len = strnlen(str, room > 0 ? room : 0);
+			memcpy(q, &len, sizeof(len));
+			memcpy(q + sizeof(len), str, len);
+			q += sizeof(len) + len;
+			continue;
+		}
+		}
+		memcpy(q, &v, sizeof(v));
+		q += sizeof(v);
+	}
+
+	record.size = q - p;
+	memcpy(p, &record, sizeof(record));
+
+	end_record(async, ring, p, record.size | RECORD_BINARY);
+	return 0;
+}
+
+static void write_all(int fd, struct iovec* iov, int count)
+{
+	while (count > 0)
+	{
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/* append everything buffered in the rings, WRITE_BATCH lines per writev;
+ * lines of different threads are not merged by time. Binary records go to
+ * the binary log as one LOG_BLOCK_RECORDS block per writev. */
+static void flush_rings(log_async_t* async)
+{
+	struct iovec iov[WRITE_BATCH];
+	struct iovec biov[WRITE_BATCH];
+	char dropped_line[128];
+	bool more = TRUE;
+
+	while (more)
+	{
+		int count = 0;
+		int bcount = 1;
+		log_block_t block = { LOG_BLOCK_MAGIC, LOG_BLOCK_RECORDS, getpid(), 0 };
+		more = FALSE;
+
+		log_ring_t* ring = async->rings;
+		for (; ring; ring=ring->next)
+		{
+			unsigned long head = ring->head;
+			__sync_synchronize();
+
+			unsigned long tail = ring->tail;
+			while (tail != head && count < WRITE_BATCH && bcount < WRITE_BATCH)
+			{
+				unsigned long pos = tail % LOG_RING_SIZE;
+				unsigned int len = *(unsigned int*)(ring->buf + pos);
+				if (len == RECORD_WRAP)
+				{
+					tail += LOG_RING_SIZE - pos;
+					continue;
+				}
+				if (len & RECORD_BINARY)
+				{
+					len &= ~RECORD_BINARY;
+					biov[bcount].iov_base = ring->buf + pos + RECORD_HEADER;
+					biov[bcount].iov_len = len;
+					bcount++;
+					block.length += len;
+				}
+				else
+				{
+					iov[count].iov_base = ring->buf + pos + RECORD_HEADER;
+					iov[count].iov_len = len;
+					count++;
+				}
+				tail += RECORD_SIZE(len);
+			}
+			ring->batch_tail = tail;
+			more = more || tail != head;
+		}
+
+		unsigned long dropped = log_async_dropped(async->log);
+		if (dropped != async->reported_dropped && count < WRITE_BATCH)
+		{
+			int n = format_time(dropped_line, sizeof(dropped_line));
+			n += snprintf(dropped_line + n, sizeof(dropped_line) - n,
+					" W [log_async.c] log: ring full, %lu lines dropped\n",
+					dropped - async->reported_dropped);
+			iov[count].iov_base = dropped_line;
+			iov[count].iov_len = n;
+			count++;
+			async->reported_dropped = dropped;
+		}
+
+		if (count == 0 && bcount == 1)
+		{
+			return;
+		}
+
+		if (count > 0)
+		{
+			log_handle_t* log = async->log;
+			pthread_mutex_lock(&log->logfile_mutex);
+			{
+				FILE* file = log->logfile ? log->logfile : stderr;
+				fflush(file);
+				write_all(fileno(file), iov, count);
+			}
+			pthread_mutex_unlock(&log->logfile_mutex);
+		}
+		if (bcount > 1)
+		{
+			biov[0].iov_base = &block;
+			biov[0].iov_len = sizeof(block);
+			write_all(async->binary_fd, biov, bcount);
+		}
+
+		__sync_synchronize();
+		for (ring=async->rings; ring; ring=ring->next)
+		{
+			ring->tail = ring->batch_tail;
+		}
+	}
+}
+
+/* describe every call site so JLogDecode can render records of this binary */
+static int build_sites_block(log_async_t* async)
+{
+	size_t number = __stop_log_sites - __start_log_sites;
+	size_t length = sizeof(log_block_t);
+	size_t i = 0;
+	for (; i<number; i++)
+	{
+		const log_site_t* site = &__start_log_sites[i];
+		length += 3 * sizeof(uint32_t) + strlen(site->domain) + strlen(site->file)
+				+ strlen(site->function) + strlen(site->fmt) + 4;
+	}
+
+	async->site_types = calloc(number ? number : 1, sizeof(async->site_types[0]));
+	async->sites_block = malloc(length);
+	if (async->site_types == NULL || async->sites_block == NULL)
+	{
+		return -1;
+	}
+
+	log_block_t block = { LOG_BLOCK_MAGIC, LOG_BLOCK_SITES, getpid(),
+			length - sizeof(log_block_t) };
+	char* p = async->sites_block;
+	memcpy(p, &block, sizeof(block));
+	p += sizeof(block);
+	for (i=0; i<number; i++)
+	{
+		const log_site_t* site = &__start_log_sites[i];
+		uint32_t head[3] = { i, site->level, site->line };
+		memcpy(p, head, sizeof(head));
+		p += sizeof(head);
+		p = stpcpy(p, site->domain) + 1;
+		p = stpcpy(p, site->file) + 1;
+		p = stpcpy(p, site->function) + 1;
+		p = stpcpy(p, site->fmt) + 1;
+
+		if (log_format_types(site->fmt, async->site_types[i], SITE_MAX_ARGS + 1) < 0)
+		{
+			strcpy(async->site_types[i], "!");
+		}
+	}
+	async->sites_length = length;
+	return 0;
+}
+
+static int open_binary(log_async_t* async)
+{
+	int fd = open(async->binary_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	struct iovec iov = { async->sites_block, async->sites_length };
+	write_all(fd, &iov, 1);
+	if (async->binary_fd >= 0)
+	{
+		close(async->binary_fd);
+	}
+	async->binary_fd = fd;
+	return 0;
+}
+
+static void* writer(void* arg)
+{
+	log_async_t* async = (log_async_t*)arg;
+	while (async->running)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&async->lock);
+		if (async->running)
+		{
+			pthread_cond_timedwait(&async->cond, &async->lock, &deadline);
+		}
+		pthread_mutex_unlock(&async->lock);
+
+		flush_rings(async);
+		if (async->reopen)
+		{
+			async->reopen = FALSE;
+			log_reopen(async->log);
+			if (async->binary_fd >= 0 && open_binary(async) < 0)
+			{
+				ERROR(async->log, "log", "failed to reopen %s: %s", async->binary_path,
+						strerror(errno));
+			}
+		}
+	}
+	flush_rings(async);
+	return NULL;
+}
+
+int log_async_start(log_handle_t* log, log_overflow_t overflow, const char* binary_path)
+{
+	log_async_t* async = (log_async_t*)calloc(1, sizeof(log_async_t));
+	if (async == NULL)
+	{
+		return -1;
+	}
+
+	async->log = log;
+	async->overflow = overflow;
+	async->binary_fd = -1;
+	if (binary_path && binary_path[0])
+	{
+		async->binary_path = strdup(binary_path);
+		if (async->binary_path == NULL || build_sites_block(async) < 0
+				|| open_binary(async) < 0)
+		{
+			free(async->binary_path);
+			free(async->site_types);
+			free(async->sites_block);
+			free(async);
+			return -1;
+		}
+	}
+	async->running = TRUE;
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->cond, NULL);
+	mem_add_stack(NULL);
+	if (pthread_create(&async->thread, NULL, writer, async) != 0)
+	{
+		pthread_mutex_destroy(&async->lock);
+		pthread_cond_destroy(&async->cond);
+		if (async->binary_fd >= 0)
+		{
+			close(async->binary_fd);
+		}
+		free(async->binary_path);
+		free(async->site_types);
+		free(async->sites_block);
+		free(async);
+		return -1;
+	}
+
+	log->async = async;
+	return 0;
+}
+
+/* the rings are not freed, threads that are still running may hold one */
+void log_async_stop(log_handle_t* log)
+{
+	log_async_t* async = log->async;
+	if (async == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->running = FALSE;
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+	pthread_join(async->thread, NULL);
+	log->async = NULL;
+	if (async->binary_fd >= 0)
+	{
+		close(async->binary_fd);
+	}
+}
+
+void log_async_reopen(log_handle_t* log)
+{
+	if (log->async)
+	{
+		log->async->reopen = TRUE;
+	}
+}
+
+unsigned long log_async_dropped(log_handle_t* log)
+{
+	unsigned long dropped = 0;
+	log_ring_t* ring = log->async ? log->async->rings : NULL;
+	for (; ring; ring=ring->next)
+	{
+		dropped += ring->dropped;
+	}
+	return dropped;
+}
@@ -0,0 +1,59 @@
+/*
+ * log_async.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef LOG_ASYNC_H_
+#define LOG_ASYNC_H_
+
+#include <stdarg.h>
+
+#include "log.h"
+
+/* bytes of log lines one thread can buffer before the writer catches up */
+#define LOG_RING_SIZE (256 * 1024)
+/* longest line, longer ones are truncated */
+#define LOG_LINE_MAX 2048
+/* the writer wakes at least this often, in milliseconds */
+#define LOG_FLUSH_INTERVAL 100
+
+typedef enum {
+	LOG_OVERFLOW_DROP = 0,		/* lose the line and count it */
+	LOG_OVERFLOW_BLOCK,			/* wait until the writer made room */
+} log_overflow_t;
+
+/* start the writer thread, from then on _log() formats into a ring owned by
+ * the calling thread and the writer appends the rings to log's file with
+ * writev. Must be called in the process that logs (threads do not survive
+ * fork) and with signals blocked, the writer inherits the mask.
+ * With binary_path, log() only copies the arguments into the ring and the
+ * writer appends them to binary_path for JLogDecode to format. */
+int log_async_start(log_handle_t* log, log_overflow_t overflow, const char* binary_path);
+
+/* write out what is buffered and stop the writer, later lines are written
+ * synchronously */
+void log_async_stop(log_handle_t* log);
+
+/* called by _log(), -1 if the line has to be written synchronously */
+int log_async_vwrite(log_handle_t* log, const char* level, const char* file, int line,
+		const char* function, const char* domain, const char* fmt, va_list ap);
+
+/* LOG_LINE_MAX bytes at the head of the calling thread's ring for a line
+ * the caller formats itself, NULL if the line has to be dropped */
+char* log_async_reserve(log_handle_t* log);
+
+/* hand the line to the writer, length includes the '\n' */
+void log_async_commit(log_handle_t* log, char* line, int length);
+
+/* called by _log_site(), -1 if the line has to be formatted as text */
+int log_async_vbinary(log_handle_t* log, const log_site_t* site, va_list ap);
+
+/* reopen the log files after they were rotated, done by the writer */
+void log_async_reopen(log_handle_t* log);
+
+/* lines lost because a ring was full */
+unsigned long log_async_dropped(log_handle_t* log);
+
+#endif /* LOG_ASYNC_H_ */
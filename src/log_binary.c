@@ -0,0 +1,119 @@
+/*
+ * log_binary.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <string.h>
+
+#include "log_binary.h"
+
+const char* log_next_conv(const char* fmt, log_conv_t* conv)
+{
+	const char* p = strchr(fmt, '%');
+	if (p == NULL)
+	{
+		return NULL;
+	}
+
+	memset(conv, 0, sizeof(log_conv_t));
+	conv->start = p++;
+
+	/* flags, width, precision */
+	while (*p && strchr("-+ #0'", *p))
+	{
+		p++;
+	}
+	if (*p == '*')
+	{
+		conv->star_width = 1;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+	{
+		p++;
+	}
+	if (*p == '.')
+	{
+		p++;
+		if (*p == '*')
+		{
+			conv->star_precision = 1;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+		{
+			p++;
+		}
+	}
+
+	/* length modifier */
+	int longs = 0;
+	while (*p && strchr("hlLqjzt", *p))
+	{
+		longs += (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't') ? 1 : 0;
+		longs += (*p == 'q' || *p == 'L') ? 2 : 0;
+		p++;
+	}
+
+	switch (*p)
+	{
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		conv->type = longs >= 2 ? LOG_ARG_LLONG : (longs == 1 ? LOG_ARG_LONG : LOG_ARG_INT);
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		conv->type = LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		conv->type = LOG_ARG_STRING;
+		break;
+	case 'p':
+		conv->type = LOG_ARG_PTR;
+		break;
+	case '\0':
+		conv->length = p - conv->start;
+		return p;
+	case '%':
+		conv->type = LOG_ARG_NONE;
+		break;
+	default:
+		conv->type = LOG_ARG_UNKNOWN;
+		break;
+	}
+
+	p++;
+	conv->length = p - conv->start;
+	return p;
+}
+
+int log_format_types(const char* fmt, char* types, int len)
+{
+	log_conv_t conv;
+	int n = 0;
+	while ((fmt = log_next_conv(fmt, &conv)) != NULL)
+	{
+		if (n + conv.star_width + conv.star_precision + 1 >= len)
+		{
+			return -1;
+		}
+		if (conv.star_width)
+		{
+			types[n++] = LOG_ARG_INT;
+		}
+		if (conv.star_precision)
+		{
+			types[n++] = LOG_ARG_INT;
+		}
+		if (conv.type == LOG_ARG_UNKNOWN)
+		{
+			return -1;
+		}
+		if (conv.type != LOG_ARG_NONE)
+		{
+			types[n++] = conv.type;
+		}
+	}
+	types[n] = '\0';
+	return n;
+}
@@ -0,0 +1,79 @@
+/*
+ * log_binary.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef LOG_BINARY_H_
+#define LOG_BINARY_H_
+
+#include <stdint.h>
+
+/* The binary error log is a sequence of blocks, each written with one
+ * writev by one process:
+ *
+ *   log_block_t, then length bytes of payload
+ *
+ * A LOG_BLOCK_SITES payload describes every log call site of the binary
+ * that wrote it, repeated for each site:
+ *
+ *   uint32 id, uint32 level, uint32 line, domain\0 file\0 function\0 format\0
+ *
+ * A LOG_BLOCK_RECORDS payload holds the lines, each one a log_record_t
+ * followed by the arguments in format order: integers and pointers as
+ * int64, doubles as double, strings as uint32 length and the bytes. */
+
+#define LOG_BLOCK_MAGIC 0x474f4c4a		/* "JLOG" */
+
+enum {
+	LOG_BLOCK_SITES = 1,
+	LOG_BLOCK_RECORDS,
+};
+
+typedef struct log_block_s log_block_t;
+struct log_block_s {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t pid;					//写这个块的进程， 它的sites块描述了site id
+	uint32_t length;
+};
+
+typedef struct log_record_s log_record_t;
+struct log_record_s {
+	uint32_t size;					//包括参数的长度
+	uint32_t site;
+	uint64_t usec;					//gettimeofday
+};
+
+/* kind of argument a conversion consumes, as stored in the record */
+enum {
+	LOG_ARG_NONE = 0,				/* "%%" or the end of the format */
+	LOG_ARG_INT = 'i',				/* int, char, short */
+	LOG_ARG_LONG = 'l',				/* long, size_t, ptrdiff_t, intmax_t */
+	LOG_ARG_LLONG = 'L',
+	LOG_ARG_PTR = 'p',
+	LOG_ARG_DOUBLE = 'f',
+	LOG_ARG_STRING = 's',
+	LOG_ARG_UNKNOWN = '?',			/* e.g. "%m", needs to be formatted at once */
+};
+
+/* one conversion of a printf format */
+typedef struct log_conv_s log_conv_t;
+struct log_conv_s {
+	const char* start;				//'%'
+	int length;						//长度, 包括'%'和转换字符
+	int type;						//LOG_ARG_*
+	int star_width;					//"*"宽度前多一个int参数
+	int star_precision;
+};
+
+/* find the next conversion of fmt, NULL at the end of the format */
+const char* log_next_conv(const char* fmt, log_conv_t* conv);
+
+/* the argument kinds of fmt in order, "*" counts as LOG_ARG_INT; returns
+ * the number of arguments, -1 if types is too short or fmt has a
+ * conversion that cannot be deferred */
+int log_format_types(const char* fmt, char* types, int len);
+
+#endif /* LOG_BINARY_H_ */
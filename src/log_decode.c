@@ -0,0 +1,370 @@
+/*
+ * log_decode.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ *
+ * JLogDecode: render a binary error log (error_log_binary) as the text
+ * lines _log() would have written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "log_binary.h"
+
+#define STRING_MAX 4096
+
+typedef struct site_s site_t;
+struct site_s {
+	uint32_t level;
+	uint32_t line;
+	const char* domain;
+	const char* file;
+	const char* function;
+	const char* fmt;
+};
+
+/* the call sites of one process, from its last LOG_BLOCK_SITES block */
+typedef struct site_table_s site_table_t;
+struct site_table_s {
+	uint32_t pid;
+	uint32_t number;
+	site_t* sites;
+	char* payload;
+	site_table_t* next;
+};
+
+static site_table_t* tables = NULL;
+
+static const char* level_strings[] = { "", "M", "A", "C", "E", "W", "N", "I", "D", "T" };
+
+static site_table_t* find_table(uint32_t pid)
+{
+	site_table_t* t = tables;
+	for (; t; t=t->next)
+	{
+		if (t->pid == pid)
+		{
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static const char* next_string(const char** p, const char* end)
+{
+	const char* s = *p;
+	const char* nul = memchr(s, '\0', end - s);
+	if (nul == NULL)
+	{
+		return NULL;
+	}
+	*p = nul + 1;
+	return s;
+}
+
+/* takes ownership of payload */
+static int load_sites(uint32_t pid, char* payload, uint32_t length)
+{
+	uint32_t number = 0;
+	uint32_t capacity = 64;
+	site_t* sites = calloc(capacity, sizeof(site_t));
+	const char* p = payload;
+	const char* end = payload + length;
+
+	while (sites && p + 3 * sizeof(uint32_t) <= end)
+	{
+		uint32_t head[3];
+		memcpy(head, p, sizeof(head));
+		p += sizeof(head);
+		if (head[0] >= capacity)
+		{
+			uint32_t old = capacity;
+			while (head[0] >= capacity)
+			{
+				capacity *= 2;
+			}
+			site_t* bigger = realloc(sites, capacity * sizeof(site_t));
+			if (bigger == NULL)
+			{
+				break;
+			}
+			sites = bigger;
+			memset(sites + old, 0, (capacity - old) * sizeof(site_t));
+		}
+
+		site_t* site = &sites[head[0]];
+		site->level = head[1];
+		site->line = head[2];
+		site->domain = next_string(&p, end);
+		site->file = site->domain ? next_string(&p, end) : NULL;
+		site->function = site->file ? next_string(&p, end) : NULL;
+		site->fmt = site->function ? next_string(&p, end) : NULL;
+		if (site->fmt == NULL)
+		{
+			free(sites);
+			free(payload);
+			return -1;
+		}
+		number = head[0] + 1 > number ? head[0] + 1 : number;
+	}
+	if (sites == NULL)
+	{
+		free(payload);
+		return -1;
+	}
+
+	site_table_t* t = find_table(pid);
+	if (t == NULL)
+	{
+		t = calloc(1, sizeof(site_table_t));
+		t->pid = pid;
+		t->next = tables;
+		tables = t;
+	}
+	else
+	{
+		free(t->sites);
+		free(t->payload);
+	}
+	t->number = number;
+	t->sites = sites;
+	t->payload = payload;
+	return 0;
+}
+
+/* read the next argument of the given kind, -1 if the record is short */
+static int next_arg(const char** p, const char* end, int type, int64_t* v, double* d,
+		char* str)
+{
+	uint32_t len = 0;
+	switch (type)
+	{
+	case LOG_ARG_DOUBLE:
+		if (*p + sizeof(double) > end)
+		{
+			return -1;
+		}
+		memcpy(d, *p, sizeof(double));
+		*p += sizeof(double);
+		return 0;
+	case LOG_ARG_STRING:
+		if (*p + sizeof(len) > end)
+		{
+			return -1;
+		}
+		memcpy(&len, *p, sizeof(len));
+		*p += sizeof(len);
+		if (*p + len > end)
+		{
+			return -1;
+		}
+		len = len < STRING_MAX - 1 ? len : STRING_MAX - 1;
+		memcpy(str, *p, len);
+		str[len] = '\0';
+		*p += len;
+		return 0;
+	default:
+		if (*p + sizeof(int64_t) > end)
+		{
+			return -1;
+		}
+		memcpy(v, *p, sizeof(int64_t));
+		*p += sizeof(int64_t);
+		return 0;
+	}
+}
+
+#define PRINT_ARG(arg) do {													\
+		if (stars == 0)															\
+			fprintf(out, spec, arg);											\
+		else if (stars == 1)													\
+			fprintf(out, spec, star[0], arg);									\
+		else																	\
+			fprintf(out, spec, star[0], star[1], arg);							\
+	} while (0)
+
+/* print the message of one record with the site's format */
+static void render_message(FILE* out, const char* fmt, const char* args, const char* end)
+{
+	char spec[64];
+	char str[STRING_MAX];
+	log_conv_t conv;
+	const char* next = NULL;
+
+	while ((next = log_next_conv(fmt, &conv)) != NULL)
+	{
+		fwrite(fmt, 1, conv.start - fmt, out);
+		fmt = next;
+
+		if (conv.type == LOG_ARG_NONE && conv.length >= 2)
+		{
+			fputc('%', out);
+			continue;
+		}
+		if (conv.type == LOG_ARG_NONE || conv.length >= (int)sizeof(spec))
+		{
+			fwrite(conv.start, 1, conv.length, out);
+			continue;
+		}
+		memcpy(spec, conv.start, conv.length);
+		spec[conv.length] = '\0';
+
+		int star[2];
+		int stars = 0;
+		int64_t v = 0;
+		double d = 0;
+		int truncated = 0;
+		if (conv.star_width)
+		{
+			truncated |= next_arg(&args, end, LOG_ARG_INT, &v, &d, str);
+			star[stars++] = (int)v;
+		}
+		if (conv.star_precision)
+		{
+			truncated |= next_arg(&args, end, LOG_ARG_INT, &v, &d, str);
+			star[stars++] = (int)v;
+		}
+		if (truncated || next_arg(&args, end, conv.type, &v, &d, str) < 0)
+		{
+			fputs("<truncated>", out);
+			return;
+		}
+
+		switch (conv.type)
+		{
+		case LOG_ARG_INT:
+			PRINT_ARG((int)v);
+			break;
+		case LOG_ARG_LONG:
+			PRINT_ARG((long)v);
+			break;
+		case LOG_ARG_LLONG:
+			PRINT_ARG((long long)v);
+			break;
+		case LOG_ARG_PTR:
+			PRINT_ARG((void*)(intptr_t)v);
+			break;
+		case LOG_ARG_DOUBLE:
+			PRINT_ARG(d);
+			break;
+		case LOG_ARG_STRING:
+			PRINT_ARG(str);
+			break;
+		}
+	}
+	fputs(fmt, out);
+}
+
+static void render_records(FILE* out, uint32_t pid, const char* p, const char* end)
+{
+	site_table_t* t = find_table(pid);
+	while (p + sizeof(log_record_t) <= end)
+	{
+		log_record_t record;
+		memcpy(&record, p, sizeof(record));
+		if (record.size < sizeof(record) || p + record.size > end)
+		{
+			fprintf(stderr, "JLogDecode: corrupt record of pid %u\n", pid);
+			return;
+		}
+
+		time_t sec = record.usec / 1000000;
+		struct tm tm;
+		char timestr[32];
+		gmtime_r(&sec, &tm);
+		strftime(timestr, sizeof(timestr), "%F %T", &tm);
+
+		if (t == NULL || record.site >= t->number || t->sites[record.site].fmt == NULL)
+		{
+			fprintf(out, "[%s.%06ld] ? [pid %u: unknown site %u]\n", timestr,
+					(long)(record.usec % 1000000), pid, record.site);
+			p += record.size;
+			continue;
+		}
+
+		const site_t* site = &t->sites[record.site];
+		const char* basename = strrchr(site->file, '/');
+		basename = basename ? basename + 1 : site->file;
+		fprintf(out, "[%s.%06ld] %s [%s:%u:%s] %s: ", timestr, (long)(record.usec % 1000000),
+				site->level <= LOG_TRACE ? level_strings[site->level] : "",
+				basename, site->line, site->function, site->domain);
+		render_message(out, site->fmt, p + sizeof(record), p + record.size);
+		fputc('\n', out);
+		p += record.size;
+	}
+}
+
+static int decode(FILE* in, const char* name, FILE* out)
+{
+	log_block_t block;
+	while (fread(&block, sizeof(block), 1, in) == 1)
+	{
+		if (block.magic != LOG_BLOCK_MAGIC)
+		{
+			fprintf(stderr, "JLogDecode: %s: bad block magic at offset %ld\n", name,
+					ftell(in) - (long)sizeof(block));
+			return -1;
+		}
+
+		char* payload = malloc(block.length ? block.length : 1);
+		if (payload == NULL || fread(payload, 1, block.length, in) != block.length)
+		{
+			fprintf(stderr, "JLogDecode: %s: truncated block\n", name);
+			free(payload);
+			return -1;
+		}
+
+		if (block.type == LOG_BLOCK_SITES)
+		{
+			if (load_sites(block.pid, payload, block.length) < 0)
+			{
+				fprintf(stderr, "JLogDecode: %s: bad site table of pid %u\n", name, block.pid);
+			}
+			continue;
+		}
+		if (block.type == LOG_BLOCK_RECORDS)
+		{
+			render_records(out, block.pid, payload, payload + block.length);
+		}
+		free(payload);
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int ret = 0;
+	int i = 1;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s binary_log ...\n", argv[0]);
+		return 1;
+	}
+
+	for (; i<argc; i++)
+	{
+		FILE* in = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+		if (in == NULL)
+		{
+			perror(argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (decode(in, argv[i], stdout) < 0)
+		{
+			ret = 1;
+		}
+		if (in != stdin)
+		{
+			fclose(in);
+		}
+	}
+	return ret;
+}
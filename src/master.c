@@ -0,0 +1,274 @@
+/*
+ * master.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "master.h"
+#include "log.h"
+
+/* a worker exiting sooner than this after start is restarted with a delay */
+#define RESPAWN_DELAY 1
+
+extern log_handle_t g_log;
+
+static volatile sig_atomic_t child_exited = 0;
+static volatile sig_atomic_t need_reload = 0;
+static volatile sig_atomic_t need_dump = 0;
+static volatile sig_atomic_t need_dump_latency = 0;
+static volatile sig_atomic_t need_stop = 0;
+static volatile sig_atomic_t need_quit = 0;
+static volatile sig_atomic_t need_upgrade = 0;
+
+static void master_signal(int sig)
+{
+	switch (sig)
+	{
+	case SIGCHLD:
+		child_exited = 1;
+		break;
+	case SIGHUP:
+		need_reload = 1;
+		break;
+	case SIGUSR1:
+		need_dump = 1;
+		break;
+	case SIGUSR2:
+		need_dump_latency = 1;
+		break;
+	case SIGQUIT:
+		need_quit = 1;
+		break;
+	case SIGWINCH:
+		need_upgrade = 1;
+		break;
+	default:
+		need_stop = 1;
+		break;
+	}
+}
+
+static void set_handler(int sig, void (*handler)(int))
+{
+	struct sigaction sa;
+	memset(&sa, '\0', sizeof(sa));
+	sa.sa_handler = handler;
+	sa.sa_flags = SA_RESTART;
+	sigfillset(&sa.sa_mask);
+	sigaction(sig, &sa, NULL);
+}
+
+static pid_t spawn_worker(worker_slot_t* slot, int index, const master_hooks_t* hooks,
+		const sigset_t* worker_mask)
+{
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		ERROR(&g_log, "master", "fork worker %d failed: %s", index, strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		/* worker: exit together with the master, keep the signal handlers
+		 * installed before the fork except the master only ones */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		set_handler(SIGCHLD, SIG_DFL);
+		set_handler(SIGTERM, SIG_DFL);
+		set_handler(SIGINT, SIG_DFL);
+		set_handler(SIGWINCH, SIG_DFL);
+		sigprocmask(SIG_SETMASK, worker_mask, NULL);
+		exit(hooks->worker_main(index));
+	}
+
+	slot->pid = pid;
+	slot->started = time(NULL);
+	INFO(&g_log, "master", "started worker %d, pid %d", index, pid);
+	return pid;
+}
+
+static void signal_workers(worker_slot_t* slots, int worker_number, int sig)
+{
+	int i = 0;
+	for (; i<worker_number; i++)
+	{
+		if (slots[i].pid > 0)
+		{
+			kill(slots[i].pid, sig);
+		}
+	}
+}
+
+/* 回收退出的worker， 没有在停止时就重新拉起 */
+static int reap_workers(worker_slot_t* slots, int worker_number, bool stopping)
+{
+	int status = 0;
+	int alive = 0;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		int i = 0;
+		for (; i<worker_number; i++)
+		{
+			if (slots[i].pid != pid)
+			{
+				continue;
+			}
+			slots[i].pid = -1;
+			slots[i].last_status = status;
+			if (stopping)
+			{
+				INFO(&g_log, "master", "worker %d (pid %d) stopped", i, pid);
+			}
+			else if (WIFSIGNALED(status))
+			{
+				ERROR(&g_log, "master", "worker %d (pid %d) killed by signal %d",
+						i, pid, WTERMSIG(status));
+			}
+			else
+			{
+				WARNING(&g_log, "master", "worker %d (pid %d) exited with code %d",
+						i, pid, WEXITSTATUS(status));
+			}
+		}
+	}
+
+	int i = 0;
+	for (; i<worker_number; i++)
+	{
+		if (slots[i].pid > 0)
+		{
+			alive++;
+		}
+	}
+	return alive;
+}
+
+void dump_worker_stats(const worker_slot_t* slots, int worker_number)
+{
+	int i = 0;
+	for (; i<worker_number; i++)
+	{
+		INFO(&g_log, "master", "worker %d: pid %d, restarts %d, up %lds, accepted %lu",
+				i, slots[i].pid, slots[i].respawns, (long)(time(NULL) - slots[i].started),
+				slots[i].accepted);
+	}
+}
+
+int master_cycle(worker_slot_t* slots, int worker_number, const master_hooks_t* hooks)
+{
+	sigset_t set, worker_mask, empty;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGQUIT);
+	sigaddset(&set, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &set, &worker_mask);
+	sigemptyset(&empty);
+
+	set_handler(SIGCHLD, master_signal);
+	set_handler(SIGHUP, master_signal);
+	set_handler(SIGUSR1, master_signal);
+	set_handler(SIGUSR2, master_signal);
+	set_handler(SIGTERM, master_signal);
+	set_handler(SIGINT, master_signal);
+	set_handler(SIGQUIT, master_signal);
+	set_handler(SIGWINCH, master_signal);
+
+	INFO(&g_log, "master", "master %d starting %d workers", getpid(), worker_number);
+
+	int i = 0;
+	for (; i<worker_number; i++)
+	{
+		slots[i].pid = -1;
+		spawn_worker(&slots[i], i, hooks, &worker_mask);
+	}
+	hooks->started();
+
+	while (!need_stop && !need_quit)
+	{
+		sigsuspend(&empty);
+
+		if (child_exited)
+		{
+			child_exited = 0;
+			reap_workers(slots, worker_number, FALSE);
+		}
+
+		if (need_reload)
+		{
+			need_reload = 0;
+			hooks->reload();
+			signal_workers(slots, worker_number, SIGHUP);
+		}
+
+		if (need_dump)
+		{
+			need_dump = 0;
+			hooks->dump_stats();
+			signal_workers(slots, worker_number, SIGUSR1);
+		}
+
+		if (need_dump_latency)
+		{
+			need_dump_latency = 0;
+			signal_workers(slots, worker_number, SIGUSR2);
+		}
+
+		if (need_upgrade)
+		{
+			need_upgrade = 0;
+			hooks->upgrade();
+		}
+
+		for (i=0; i<worker_number && !need_stop && !need_quit; i++)
+		{
+			if (slots[i].pid > 0)
+			{
+				continue;
+			}
+			/* 刚启动就退出的worker延迟重启， 避免反复崩溃时占满cpu */
+			if (time(NULL) - slots[i].started < RESPAWN_DELAY)
+			{
+				sleep(RESPAWN_DELAY);
+			}
+			slots[i].respawns++;
+			spawn_worker(&slots[i], i, hooks, &worker_mask);
+		}
+	}
+
+	if (need_quit && !need_stop)
+	{
+		/* 等待worker处理完已有的连接， 期间收到SIGTERM就直接停止 */
+		INFO(&g_log, "master", "draining workers");
+		signal_workers(slots, worker_number, SIGQUIT);
+		while (!need_stop && reap_workers(slots, worker_number, TRUE) > 0)
+		{
+			sigsuspend(&empty);
+		}
+	}
+
+	INFO(&g_log, "master", "stopping workers");
+	signal_workers(slots, worker_number, SIGTERM);
+	while (reap_workers(slots, worker_number, TRUE) > 0)
+	{
+		usleep(10000);
+	}
+	sigprocmask(SIG_SETMASK, &worker_mask, NULL);
+	return 0;
+}
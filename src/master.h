@@ -0,0 +1,34 @@
+/*
+ * master.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef MASTER_H_
+#define MASTER_H_
+
+#include "common.h"
+#include "shm.h"
+
+typedef enum BOOL bool;
+
+/* what the master does for its workers and on signals */
+typedef struct master_hooks_s master_hooks_t;
+struct master_hooks_s {
+	int (*worker_main)(int slot);	//runs in the forked worker, returns its exit code
+	void (*reload)(void);			//SIGHUP, before it is forwarded to the workers
+	void (*dump_stats)(void);		//SIGUSR1, before it is forwarded to the workers
+	void (*upgrade)(void);			//SIGWINCH, start a new binary
+	void (*started)(void);			//after the first workers are forked
+};
+
+/* fork worker_number workers and restart any that exits until SIGTERM or
+ * SIGINT, which is forwarded to the workers before returning; SIGQUIT is
+ * forwarded as well but waits for the workers to drain their connections */
+int master_cycle(worker_slot_t* slots, int worker_number, const master_hooks_t* hooks);
+
+/* log pid, restarts and accepted connections of each worker */
+void dump_worker_stats(const worker_slot_t* slots, int worker_number);
+
+#endif /* MASTER_H_ */
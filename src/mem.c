@@ -0,0 +1,89 @@
+/*
+ * mem.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+
+#include "mem.h"
+#include "stats.h"
+
+/* changed by any thread, one cache line per tag */
+typedef struct mem_counter_s mem_counter_t;
+struct mem_counter_s {
+	volatile long current;
+	volatile long peak;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static mem_counter_t counters[MEM_TAGS];
+
+static const char* tag_names[] = { "connections", "buffers", "file_maps", "log_buffers",
+		"instrumentation", "shared_memory", "thread_stacks" };
+
+void mem_add(mem_tag_t tag, long bytes)
+{
+	long current = __sync_add_and_fetch(&counters[tag].current, bytes);
+	long peak = counters[tag].peak;
+	while (current > peak && !__sync_bool_compare_and_swap(&counters[tag].peak, peak, current))
+	{
+		peak = counters[tag].peak;
+	}
+}
+
+void mem_sub(mem_tag_t tag, long bytes)
+{
+	__sync_sub_and_fetch(&counters[tag].current, bytes);
+}
+
+void mem_add_stack(const pthread_attr_t* attr)
+{
+	pthread_attr_t defaults;
+	size_t size = 0;
+	if (attr == NULL)
+	{
+		pthread_attr_init(&defaults);
+		pthread_attr_getstacksize(&defaults, &size);
+		pthread_attr_destroy(&defaults);
+	}
+	else
+	{
+		pthread_attr_getstacksize(attr, &size);
+	}
+	mem_add(MEM_STACKS, size);
+}
+
+int mem_format(char* buf, size_t size, bool prometheus)
+{
+	size_t len = 0;
+	int i = 0;
+	if (prometheus)
+	{
+		buf_append(buf, size, &len,
+				"# HELP jhttpserver_memory_bytes Memory of this worker by use.\n"
+				"# TYPE jhttpserver_memory_bytes gauge\n");
+		for (i=0; i<MEM_TAGS; i++)
+		{
+			buf_append(buf, size, &len, "jhttpserver_memory_bytes{tag=\"%s\"} %ld\n", tag_names[i],
+					counters[i].current);
+		}
+		buf_append(buf, size, &len,
+				"# HELP jhttpserver_memory_peak_bytes Highest memory of this worker by use.\n"
+				"# TYPE jhttpserver_memory_peak_bytes gauge\n");
+		for (i=0; i<MEM_TAGS; i++)
+		{
+			buf_append(buf, size, &len, "jhttpserver_memory_peak_bytes{tag=\"%s\"} %ld\n",
+					tag_names[i], counters[i].peak);
+		}
+		return len < size ? (int)len : -1;
+	}
+
+	buf_append(buf, size, &len, "Memory (current / peak KB):\n");
+	for (i=0; i<MEM_TAGS; i++)
+	{
+		buf_append(buf, size, &len, "%-16s %ld / %ld\n", tag_names[i],
+				counters[i].current / 1024, counters[i].peak / 1024);
+	}
+	return len < size ? (int)len : -1;
+}
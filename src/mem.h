@@ -0,0 +1,42 @@
+/*
+ * mem.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef MEM_H_
+#define MEM_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "common.h"
+
+typedef enum BOOL bool;
+
+/* what the memory of this process is used for */
+typedef enum {
+	MEM_CONNECTIONS = 0,	/* connection table without its buffers */
+	MEM_BUFFERS,			/* read and write buffers, generated responses */
+	MEM_FILE_MAPS,			/* files mmapped by requests being sent */
+	MEM_LOG,				/* per-thread rings of the log threads */
+	MEM_INSTRUMENTATION,	/* trace rings and latency histograms */
+	MEM_SHM,				/* shared with the other workers */
+	MEM_STACKS,				/* reserved for thread stacks */
+	MEM_TAGS
+} mem_tag_t;
+
+void mem_add(mem_tag_t tag, long bytes);
+
+void mem_sub(mem_tag_t tag, long bytes);
+
+/* account the stack of a thread about to be created with attr, NULL for
+ * the default attributes */
+void mem_add_stack(const pthread_attr_t* attr);
+
+/* current and peak bytes of every tag, in Prometheus format or as text;
+ * the length, or -1 if buf is too small */
+int mem_format(char* buf, size_t len, bool prometheus);
+
+#endif /* MEM_H_ */
@@ -0,0 +1,47 @@
+/*
+ * shm.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <sys/mman.h>
+
+#include "shm.h"
+
+int shm_create(shm_zone_t* zone, size_t size)
+{
+	zone->addr = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (zone->addr == MAP_FAILED)
+	{
+		zone->addr = NULL;
+		return -1;
+	}
+	zone->size = size;
+	zone->used = 0;
+	return 0;
+}
+
+void* shm_alloc(shm_zone_t* zone, size_t size)
+{
+	size = (size + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+	if (zone->addr == NULL || zone->used + size > zone->size)
+	{
+		return NULL;
+	}
+
+	/* the mapping is zero filled and never reused */
+	void* p = zone->addr + zone->used;
+	zone->used += size;
+	return p;
+}
+
+void shm_destroy(shm_zone_t* zone)
+{
+	if (zone->addr)
+	{
+		munmap(zone->addr, zone->size);
+		zone->addr = NULL;
+	}
+}
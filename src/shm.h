@@ -0,0 +1,43 @@
+/*
+ * shm.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "common.h"
+
+/* an anonymous shared mapping created before the workers are forked, so
+ * every process sees the same memory at the same address */
+typedef struct shm_zone_s shm_zone_t;
+struct shm_zone_s {
+	char* addr;
+	size_t size;
+	size_t used;
+};
+
+/* supervision state of one worker process, written by the master */
+typedef struct worker_slot_s worker_slot_t;
+struct worker_slot_s {
+	pid_t pid;
+	int respawns;				//被master重新拉起的次数
+	time_t started;
+	int last_status;			//上一次退出时waitpid得到的状态
+	unsigned long accepted;		//worker自己累加
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+int shm_create(shm_zone_t* zone, size_t size);
+
+/* cache line aligned, zero filled; only before fork, returns NULL when full */
+void* shm_alloc(shm_zone_t* zone, size_t size);
+
+void shm_destroy(shm_zone_t* zone);
+
+#endif /* SHM_H_ */
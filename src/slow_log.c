@@ -0,0 +1,108 @@
+/*
+ * slow_log.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "slow_log.h"
+#include "http_connect.h"
+#include "latency.h"
+#include "log_async.h"
+#include "lane.h"
+
+static const char* event_names[] = { "read", "enqueue", "dequeue", "parsed", "write",
+		"eagain", "done", "paced" };
+
+static log_handle_t slow_log;
+static bool slow_log_opened = FALSE;
+
+void slow_log_request(http_conn* conn)
+{
+	unsigned long elapsed = (latency_now() - conn->request_start) / 1000;
+	if (!slow_log_opened || conn->conf->slow_request_time <= 0
+			|| elapsed < (unsigned long)conn->conf->slow_request_time * 1000)
+	{
+		return;
+	}
+
+	char* line = log_async_reserve(&slow_log);
+	if (line == NULL)
+	{
+		return;
+	}
+
+	struct timeval tv;
+	struct tm tm;
+	char addr[INET_ADDRSTRLEN];
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	inet_ntop(AF_INET, &conn->cold->address.sin_addr, addr, sizeof(addr));
+
+	int size = LOG_LINE_MAX - 1;
+	int len = strftime(line, size, "[%F %T] ", &tm);
+	len += snprintf(line + len, size - len, "%s:%d \"%s\" status %d %lums:", addr,
+			ntohs(conn->cold->address.sin_port), conn->cold->url ? conn->cold->url : "-", conn->status,
+			elapsed / 1000);
+
+	/* 只保留最后CONN_EVENTS个事件 */
+	unsigned int first = conn->cold->events_number > CONN_EVENTS ? conn->cold->events_number - CONN_EVENTS : 0;
+	if (first > 0 && len < size)
+	{
+		len += snprintf(line + len, size - len, " (%u events lost)", first);
+	}
+	unsigned int i = first;
+	for (; i<conn->cold->events_number && len < size; i++)
+	{
+		const conn_event_t* e = &conn->cold->events[i % CONN_EVENTS];
+		len += snprintf(line + len, size - len, " %s+%uus", event_names[e->type], e->at);
+		if (e->type == EVENT_READ || e->type == EVENT_WRITE || e->type == EVENT_PARSED)
+		{
+			len += len < size ? snprintf(line + len, size - len, "(%d)", e->arg) : 0;
+		}
+		else if (e->type == EVENT_ENQUEUE && e->arg < LANE_NUMBER)
+		{
+			len += len < size ? snprintf(line + len, size - len, "(%s)", lane_name(e->arg)) : 0;
+		}
+	}
+	len = len < size ? len : size;
+	line[len++] = '\n';
+	log_async_commit(&slow_log, line, len);
+}
+
+int slow_log_open(const char* path)
+{
+	log_globals_init(&slow_log);
+	if (log_init(&slow_log, path, NULL) < 0)
+	{
+		return -1;
+	}
+	if (log_async_start(&slow_log, LOG_OVERFLOW_DROP, NULL) < 0)
+	{
+		return -1;
+	}
+	slow_log_opened = TRUE;
+	return 0;
+}
+
+void slow_log_reopen(void)
+{
+	if (slow_log_opened)
+	{
+		log_logrotate(&slow_log, 0);
+	}
+}
+
+void slow_log_close(void)
+{
+	if (slow_log_opened)
+	{
+		log_async_stop(&slow_log);
+		slow_log_opened = FALSE;
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * slow_log.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef SLOW_LOG_H_
+#define SLOW_LOG_H_
+
+/* what happened to a request, kept in the connection's event ring */
+enum CONN_EVENT {
+	EVENT_READ = 0,			/* recv() of a readable connection, bytes */
+	EVENT_ENQUEUE,			/* handed to the thread pool */
+	EVENT_DEQUEUE,			/* taken by a pool thread */
+	EVENT_PARSED,			/* request parsed, http_code */
+	EVENT_WRITE,			/* one writev(), bytes */
+	EVENT_EAGAIN,			/* socket buffer full, waiting for EPOLLOUT */
+	EVENT_DONE,				/* last byte sent */
+	EVENT_PACED				/* held back by limit_rate */
+};
+
+/* open path and let a log thread write it; like access_log_open() */
+int slow_log_open(const char* path);
+
+/* write the timeline of conn if its request took longer than the
+ * slow_request_time of its configuration */
+struct http_conn;
+void slow_log_request(struct http_conn* conn);
+
+void slow_log_reopen(void);
+
+void slow_log_close(void);
+
+#endif /* SLOW_LOG_H_ */
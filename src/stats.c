@@ -0,0 +1,236 @@
+/*
+ * stats.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+#include "lane.h"
+
+static stats_shard_t* all_shards = NULL;		//worker_number * STATS_SHARDS, in shm
+static int workers = 0;
+static stats_shard_t* my_slice = NULL;			//本进程的STATS_SHARDS个shard
+static int shards_taken = 0;
+
+/* threads that count before stats_attach, e.g. in the master */
+static stats_shard_t process_shard = { { 0 }, TRUE };
+
+static __thread stats_shard_t* my_shard = NULL;
+
+stats_shard_t* stats_shard(void)
+{
+	stats_shard_t* shard = my_shard;
+	if (__builtin_expect(shard != NULL, 1))
+	{
+		return shard;
+	}
+
+	if (my_slice == NULL)
+	{
+		return &process_shard;
+	}
+
+	int i = __sync_fetch_and_add(&shards_taken, 1);
+	if (i >= STATS_SHARDS - 1)
+	{
+		i = STATS_SHARDS - 1;
+		my_slice[i].shared = TRUE;
+	}
+	my_shard = &my_slice[i];
+	return my_shard;
+}
+
+void stats_response(int status)
+{
+	if (status >= 100 && status < 600)
+	{
+		STAT_INC(STAT_STATUS_1XX + status / 100 - 1);
+	}
+	STAT_INC(STAT_REQUESTS);
+}
+
+int stats_init(shm_zone_t* zone, int worker_number)
+{
+	all_shards = (stats_shard_t*)shm_alloc(zone,
+			sizeof(stats_shard_t) * STATS_SHARDS * worker_number);
+	if (all_shards == NULL)
+	{
+		return -1;
+	}
+	workers = worker_number;
+	return 0;
+}
+
+void stats_attach(int slot)
+{
+	if (all_shards == NULL || slot >= workers)
+	{
+		return;
+	}
+
+	my_slice = &all_shards[slot * STATS_SHARDS];
+	shards_taken = 0;
+	my_shard = NULL;
+
+	/* 前一个worker留下的连接和队列已经不存在了 */
+	int i = 0;
+	for (; i<STATS_SHARDS; i++)
+	{
+		stats_shard_t* shard = &my_slice[i];
+		shard->counters[STAT_CLOSED] = shard->counters[STAT_ACCEPTED];
+		shard->counters[STAT_DEQUEUED] = shard->counters[STAT_ENQUEUED];
+		int lane = 0;
+		for (; lane<LANE_NUMBER; lane++)
+		{
+			shard->counters[STAT_DEQUEUED_FAST + lane] = shard->counters[STAT_ENQUEUED_FAST + lane];
+		}
+		shard->shared = FALSE;
+	}
+}
+
+void stats_sum(int slot, unsigned long* totals)
+{
+	memset(totals, 0, sizeof(unsigned long) * STAT_NUMBER);
+	if (all_shards == NULL)
+	{
+		return;
+	}
+
+	int first = slot < 0 ? 0 : slot * STATS_SHARDS;
+	int last = slot < 0 ? workers * STATS_SHARDS : first + STATS_SHARDS;
+	int i = first;
+	for (; i<last; i++)
+	{
+		int j = 0;
+		for (; j<STAT_NUMBER; j++)
+		{
+			totals[j] += all_shards[i].counters[j];
+		}
+	}
+}
+
+long stats_active_connections(void)
+{
+	if (my_slice == NULL)
+	{
+		return 0;
+	}
+
+	long active = 0;
+	int i = 0;
+	for (; i<STATS_SHARDS; i++)
+	{
+		active += my_slice[i].counters[STAT_ACCEPTED] - my_slice[i].counters[STAT_CLOSED];
+	}
+	return active;
+}
+
+static int format_text(char* buf, size_t size, const unsigned long* t)
+{
+	size_t len = 0;
+	buf_append(buf, size, &len, "Active connections: %ld\n",
+			(long)(t[STAT_ACCEPTED] - t[STAT_CLOSED]));
+	buf_append(buf, size, &len, "server accepts closed requests\n %lu %lu %lu\n",
+			t[STAT_ACCEPTED], t[STAT_CLOSED], t[STAT_REQUESTS]);
+	buf_append(buf, size, &len, "Status: 1xx %lu 2xx %lu 3xx %lu 4xx %lu 5xx %lu\n",
+			t[STAT_STATUS_1XX], t[STAT_STATUS_2XX], t[STAT_STATUS_3XX], t[STAT_STATUS_4XX],
+			t[STAT_STATUS_5XX]);
+	buf_append(buf, size, &len, "Bytes: in %lu out %lu\n", t[STAT_BYTES_IN], t[STAT_BYTES_OUT]);
+	buf_append(buf, size, &len, "Queue depth: %ld", (long)(t[STAT_ENQUEUED] - t[STAT_DEQUEUED]));
+	int lane = 0;
+	for (; lane<LANE_NUMBER; lane++)
+	{
+		buf_append(buf, size, &len, " %s %ld", lane_name(lane),
+				(long)(t[STAT_ENQUEUED_FAST + lane] - t[STAT_DEQUEUED_FAST + lane]));
+	}
+	buf_append(buf, size, &len, "\n");
+	buf_append(buf, size, &len, "Idle closed: evicted %lu expired %lu header timeout %lu\n",
+			t[STAT_IDLE_EVICTED], t[STAT_IDLE_EXPIRED], t[STAT_HEADER_EXPIRED]);
+	buf_append(buf, size, &len, "Shed: %lu\n", t[STAT_SHED]);
+	buf_append(buf, size, &len, "Output pending: %ld parked %lu too slow %lu\n",
+			(long)(t[STAT_OUTPUT_QUEUED] - t[STAT_OUTPUT_DONE]), t[STAT_PARKED], t[STAT_SLOW_CLOSED]);
+	return len < size ? (int)len : -1;
+}
+
+static int format_prometheus(char* buf, size_t size, const unsigned long* t)
+{
+	static const char* classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+	size_t len = 0;
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_connections_accepted_total Connections accepted.\n"
+			"# TYPE jhttpserver_connections_accepted_total counter\n"
+			"jhttpserver_connections_accepted_total %lu\n", t[STAT_ACCEPTED]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_connections_closed_total Connections closed.\n"
+			"# TYPE jhttpserver_connections_closed_total counter\n"
+			"jhttpserver_connections_closed_total %lu\n", t[STAT_CLOSED]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_connections_active Open client connections.\n"
+			"# TYPE jhttpserver_connections_active gauge\n"
+			"jhttpserver_connections_active %ld\n", (long)(t[STAT_ACCEPTED] - t[STAT_CLOSED]));
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_requests_total Responses sent by status class.\n"
+			"# TYPE jhttpserver_requests_total counter\n");
+	int i = 0;
+	for (; i<5; i++)
+	{
+		buf_append(buf, size, &len, "jhttpserver_requests_total{code=\"%s\"} %lu\n", classes[i],
+				t[STAT_STATUS_1XX + i]);
+	}
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_received_bytes_total Bytes read from clients.\n"
+			"# TYPE jhttpserver_received_bytes_total counter\n"
+			"jhttpserver_received_bytes_total %lu\n", t[STAT_BYTES_IN]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_sent_bytes_total Bytes written to clients.\n"
+			"# TYPE jhttpserver_sent_bytes_total counter\n"
+			"jhttpserver_sent_bytes_total %lu\n", t[STAT_BYTES_OUT]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_queue_depth Requests waiting for a pool thread.\n"
+			"# TYPE jhttpserver_queue_depth gauge\n"
+			"jhttpserver_queue_depth %ld\n", (long)(t[STAT_ENQUEUED] - t[STAT_DEQUEUED]));
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_queue_lane_depth Requests waiting for a pool thread by lane.\n"
+			"# TYPE jhttpserver_queue_lane_depth gauge\n");
+	for (i=0; i<LANE_NUMBER; i++)
+	{
+		buf_append(buf, size, &len, "jhttpserver_queue_lane_depth{lane=\"%s\"} %ld\n", lane_name(i),
+				(long)(t[STAT_ENQUEUED_FAST + i] - t[STAT_DEQUEUED_FAST + i]));
+	}
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_idle_closed_total Idle connections closed by the server.\n"
+			"# TYPE jhttpserver_idle_closed_total counter\n"
+			"jhttpserver_idle_closed_total{reason=\"evicted\"} %lu\n"
+			"jhttpserver_idle_closed_total{reason=\"expired\"} %lu\n"
+			"jhttpserver_idle_closed_total{reason=\"header_timeout\"} %lu\n",
+			t[STAT_IDLE_EVICTED], t[STAT_IDLE_EXPIRED], t[STAT_HEADER_EXPIRED]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_shed_total Requests answered 503 because the pool queue was overloaded.\n"
+			"# TYPE jhttpserver_shed_total counter\n"
+			"jhttpserver_shed_total %lu\n", t[STAT_SHED]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_output_pending_bytes Response bytes not written to clients yet.\n"
+			"# TYPE jhttpserver_output_pending_bytes gauge\n"
+			"jhttpserver_output_pending_bytes %ld\n",
+			(long)(t[STAT_OUTPUT_QUEUED] - t[STAT_OUTPUT_DONE]));
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_parked_total Keep-alive connections whose reads were paused for pending output.\n"
+			"# TYPE jhttpserver_parked_total counter\n"
+			"jhttpserver_parked_total %lu\n", t[STAT_PARKED]);
+	buf_append(buf, size, &len,
+			"# HELP jhttpserver_slow_closed_total Connections closed for reading slower than send_min_rate.\n"
+			"# TYPE jhttpserver_slow_closed_total counter\n"
+			"jhttpserver_slow_closed_total %lu\n", t[STAT_SLOW_CLOSED]);
+	return len < size ? (int)len : -1;
+}
+
+int stats_format(char* buf, size_t len, bool prometheus)
+{
+	unsigned long totals[STAT_NUMBER];
+	stats_sum(-1, totals);
+	return prometheus ? format_prometheus(buf, len, totals) : format_text(buf, len, totals);
+}
@@ -0,0 +1,119 @@
+/*
+ * stats.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "common.h"
+#include "shm.h"
+
+typedef enum BOOL bool;
+
+/* shards one worker process has, threads beyond that share the last one */
+#define STATS_SHARDS 256
+
+typedef enum {
+	STAT_ACCEPTED = 0,
+	STAT_CLOSED,
+	STAT_REQUESTS,
+	STAT_STATUS_1XX,
+	STAT_STATUS_2XX,
+	STAT_STATUS_3XX,
+	STAT_STATUS_4XX,
+	STAT_STATUS_5XX,
+	STAT_BYTES_IN,
+	STAT_BYTES_OUT,
+	STAT_ENQUEUED,			/* handed to a thread pool */
+	STAT_DEQUEUED,			/* taken by a pool thread */
+	STAT_IDLE_EVICTED,		/* idle or silent connection closed to admit new clients */
+	STAT_IDLE_EXPIRED,		/* idle keep-alive closed after keepalive_timeout */
+	STAT_SHED,				/* answered 503 by the pool queue's admission control */
+	STAT_ENQUEUED_FAST,		/* STAT_ENQUEUED by lane_t */
+	STAT_ENQUEUED_SMALL,
+	STAT_ENQUEUED_LARGE,
+	STAT_DEQUEUED_FAST,		/* STAT_DEQUEUED by lane_t */
+	STAT_DEQUEUED_SMALL,
+	STAT_DEQUEUED_LARGE,
+	STAT_OUTPUT_QUEUED,		/* response bytes ready to be written */
+	STAT_OUTPUT_DONE,		/* of those, written or dropped with the connection */
+	STAT_PARKED,			/* keep-alive reads paused by output_watermarks */
+	STAT_SLOW_CLOSED,		/* closed below send_min_rate */
+	STAT_HEADER_EXPIRED,	/* closed without a complete request after client_header_timeout */
+	STAT_NUMBER
+} stat_t;
+
+/* counters of one thread, only that thread writes them so the increments
+ * need no atomics and no cache line is shared with another thread */
+typedef struct stats_shard_s stats_shard_t;
+struct stats_shard_s {
+	unsigned long counters[STAT_NUMBER];
+	bool shared;			//more threads than shards, add atomically
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* the shard of the calling thread, taken on first use */
+stats_shard_t* stats_shard(void);
+
+#define STAT_ADD(stat, n) do {												\
+		stats_shard_t* shard_ = stats_shard();									\
+		if (__builtin_expect(shard_->shared, 0))								\
+			__sync_fetch_and_add(&shard_->counters[stat], (n));				\
+		else																	\
+			shard_->counters[stat] += (n);										\
+	} while (0)
+
+#define STAT_INC(stat) STAT_ADD(stat, 1)
+
+/* count a finished response by its status class */
+void stats_response(int status);
+
+/* shards for worker_number processes, in zone so that a worker sees the
+ * counters of the others; before fork */
+int stats_init(shm_zone_t* zone, int worker_number);
+
+/* use the shards of worker slot in this process. A respawned worker keeps
+ * the totals of its predecessor, whose connections and queue are gone. */
+void stats_attach(int slot);
+
+/* totals over the shards of one worker, or of all workers if slot < 0 */
+void stats_sum(int slot, unsigned long* totals);
+
+/* open connections of this process */
+long stats_active_connections(void);
+
+/* the status page into buf, Prometheus exposition format or plain text;
+ * the length, or -1 if buf is too small */
+int stats_format(char* buf, size_t len, bool prometheus);
+
+/* snprintf at *len of buf for the status page formatters; text that does
+ * not fit leaves *len at size and every later call fails too, so a
+ * formatter checks once at the end: -1, or 0 */
+static inline int buf_append(char* buf, size_t size, size_t* len, const char* fmt, ...)
+		__attribute__((format(printf, 4, 5)));
+static inline int buf_append(char* buf, size_t size, size_t* len, const char* fmt, ...)
+{
+	if (*len >= size)
+	{
+		return -1;
+	}
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+	if (n < 0 || (size_t)n >= size - *len)
+	{
+		*len = size;
+		return -1;
+	}
+	*len += n;
+	return 0;
+}
+
+#endif /* STATS_H_ */
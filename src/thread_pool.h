@@ -10,10 +10,17 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
 
 #include "locker.h"
 #include "http_connect.h"
 #include "queue.h"
+#include "cpu_affinity.h"
+#include "stats.h"
+#include "latency.h"
+#include "slow_log.h"
+#include "mem.h"
+#include "lane.h"
 
 struct thread_pool_t
 {
@@ -21,14 +28,87 @@ struct thread_pool_t
 	int conn_number;	//请求连接的个数
 	int max_resquests;	//请求队列中允许的最大请求数
 	pthread_t* threads;	//描述线程池的数组，
-	queue_t conn_head;
+	queue_t lanes[LANE_NUMBER];		//按lane_t分开的请求队列
+	int lane_number[LANE_NUMBER];	//各队列中的连接数
+	int weights[LANE_NUMBER];		//出队的权重， 来自最近入队请求的配置
+	int credits[LANE_NUMBER];		//平滑加权轮询的当前值
 	pthread_mutex_t locker;
 	sem_t sem;
 	bool stop;
+	int cpu;			//所有线程绑定到的cpu, -1表示不绑定
+	unsigned long local_processed;	//在连接所属cpu上处理的请求数
+	unsigned long remote_processed;	//在其他cpu上处理的请求数
+	unsigned long window_end;		//当前interval结束的单调时间， 纳秒
+	unsigned long window_min;		//当前interval内出队连接的最小排队时间
+	bool overloaded;				//上一个interval内排队时间一直超过target
 };
 
 typedef struct thread_pool_t thread_pool;
 
+/* CoDel on the request queue, with pool->locker held: the minimum time the
+ * connections taken in one interval have queued is a standing queue the
+ * threads cannot work off when it is above the target. While that is so,
+ * a connection that queued longer than the target gets a 503 instead of
+ * being processed, its client would have waited for nothing. An empty
+ * queue ends the overload at once. */
+static bool queue_delay(thread_pool* pool, http_conn* conn)
+{
+	unsigned long target = (unsigned long)conn->conf->worker_queue_target * 1000000;
+	if (target == 0)
+	{
+		pool->overloaded = FALSE;
+		return FALSE;
+	}
+
+	unsigned long now = latency_now();
+	unsigned long sojourn = now > conn->enqueued ? now - conn->enqueued : 0;
+	if (sojourn < pool->window_min)
+	{
+		pool->window_min = sojourn;
+	}
+	if (pool->conn_number == 0)
+	{
+		pool->window_min = 0;
+		pool->overloaded = FALSE;
+	}
+	if (now >= pool->window_end)
+	{
+		pool->overloaded = pool->window_min > target;
+		pool->window_min = ~0UL;
+		pool->window_end = now + (unsigned long)conn->conf->worker_queue_interval * 1000000;
+	}
+	return pool->overloaded && sojourn > target;
+}
+
+/* smooth weighted round robin over the lanes holding connections, the way
+ * nginx picks an upstream peer: each gains its weight, the one with the most
+ * credit is taken and pays the weights of all; a large file still gets its
+ * turn while small ones overtake it. -1 if every lane is empty. */
+static int next_lane(thread_pool* pool)
+{
+	int best = -1;
+	int total = 0;
+	int lane = 0;
+	for (; lane<LANE_NUMBER; lane++)
+	{
+		if (queue_empty(&pool->lanes[lane]))
+		{
+			continue;
+		}
+		pool->credits[lane] += pool->weights[lane];
+		total += pool->weights[lane];
+		if (best < 0 || pool->credits[lane] > pool->credits[best])
+		{
+			best = lane;
+		}
+	}
+	if (best >= 0)
+	{
+		pool->credits[best] -= total;
+	}
+	return best;
+}
+
 void* worker(void* arg)
 {
 	thread_pool* pool = (thread_pool*)arg;
@@ -38,27 +118,44 @@ void* worker(void* arg)
 		sem_wait(&pool->sem);
 		pthread_mutex_lock(&pool->locker);
 
-		if (queue_empty(&pool->conn_head))
+		int lane = next_lane(pool);
+		if (lane < 0)
 		{
 			pthread_mutex_unlock(&pool->locker);
 			continue;
 		}
 
-		queue_t* curr_node = queue_head(&pool->conn_head);
+		queue_t* curr_node = queue_head(&pool->lanes[lane]);
 		queue_remove(curr_node);
-		pthread_mutex_unlock(&pool->locker);
+		pool->conn_number--;
+		pool->lane_number[lane]--;
 		http_conn* conn = (http_conn *) ((u_char *) curr_node - ((size_t) &((http_conn *)0)->head));
-		if (conn == NULL)
+		bool shed = queue_delay(pool, conn);
+		pthread_mutex_unlock(&pool->locker);
+		STAT_INC(STAT_DEQUEUED);
+		STAT_INC(STAT_DEQUEUED_FAST + lane);
+		latency_record(STAGE_QUEUE, conn->enqueued);
+		record_event(conn, EVENT_DEQUEUE, 0);
+		if (shed)
 		{
-			printf("error: http_conn is NULL.");
+			shed_request(conn);
 			continue;
 		}
+		if (conn->cpu < 0 || sched_getcpu() == conn->cpu)
+		{
+			__sync_fetch_and_add(&pool->local_processed, 1);
+		}
+		else
+		{
+			__sync_fetch_and_add(&pool->remote_processed, 1);
+		}
 		process(conn);
 	}
 	return NULL;
 }
 
-thread_pool* create_thread_pool(int thread_number, int max_requests)
+/* cpu >= 0 pins every thread of the pool to that cpu */
+thread_pool* create_thread_pool(int thread_number, int max_requests, int cpu)
 {
 	if ((thread_number <= 0) || (max_requests <= 0))
 	{
@@ -81,7 +178,21 @@ thread_pool* create_thread_pool(int thread_number, int max_requests)
 	pool->conn_number = 0;
 	pool->thread_number = thread_number;
 	pool->max_resquests = max_requests;
-	queue_init(&pool->conn_head);
+	pool->stop = FALSE;
+	pool->cpu = cpu;
+	pool->local_processed = 0;
+	pool->remote_processed = 0;
+	pool->window_end = 0;
+	pool->window_min = ~0UL;
+	pool->overloaded = FALSE;
+	int lane = 0;
+	for (; lane<LANE_NUMBER; lane++)
+	{
+		queue_init(&pool->lanes[lane]);
+		pool->lane_number[lane] = 0;
+		pool->weights[lane] = 1;
+		pool->credits[lane] = 0;
+	}
 
 	if (sem_init(&pool->sem, 0, 0) != 0)
 	{
@@ -98,12 +209,18 @@ thread_pool* create_thread_pool(int thread_number, int max_requests)
 		return NULL;
 	}
 
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	set_attr_cpu(&attr, cpu);
+
 	int i=0;
 	for (; i<thread_number; ++i)
 	{
 		printf("create the %dth thread\n", i);
-		if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+		mem_add_stack(&attr);
+		if (pthread_create(&pool->threads[i], &attr, worker, pool) != 0)
 		{
+			pthread_attr_destroy(&attr);
 			sem_destroy(&pool->sem);
 			pthread_mutex_destroy(&pool->locker);
 			free(pool->threads);
@@ -113,6 +230,7 @@ thread_pool* create_thread_pool(int thread_number, int max_requests)
 
 		if (pthread_detach(pool->threads[i]))
 		{
+			pthread_attr_destroy(&attr);
 			sem_destroy(&pool->sem);
 			pthread_mutex_destroy(&pool->locker);
 			free(pool->threads);
@@ -120,30 +238,54 @@ thread_pool* create_thread_pool(int thread_number, int max_requests)
 			return NULL;
 		}
 	}
+	pthread_attr_destroy(&attr);
 
 	return pool;
 }
 
 void destroy_thread_pool(thread_pool *pool)
 {
+	pool->stop = TRUE;
 	sem_destroy(&pool->sem);
 	pthread_mutex_destroy(&pool->locker);
 	free(pool->threads);
 	free(pool);
-	pool->stop = TRUE;
 }
 
+/* FALSE when the queue is full, or overloaded with the oldest connection
+ * of the lane of conn already past the target; the caller sheds conn */
 bool add_conn(thread_pool *pool, http_conn* conn)
 {
+	const config_t* conf = conn->conf;
+	lane_t lane = conf->worker_queue_lanes
+			? lane_classify(conn->cold->read_buf, conn->read_index) : LANE_SMALL;
+	unsigned long now = latency_now();
 	pthread_mutex_lock(&pool->locker);
-	if (pool->conn_number > pool->max_resquests)
+	if (pool->conn_number >= pool->max_resquests)
 	{
 		pthread_mutex_unlock(&pool->locker);
 		return FALSE;
 	}
+	if (pool->overloaded && !queue_empty(&pool->lanes[lane]))
+	{
+		http_conn* oldest = (http_conn *) ((u_char *) queue_head(&pool->lanes[lane])
+				- ((size_t) &((http_conn *)0)->head));
+		if (now > oldest->enqueued && now - oldest->enqueued > (unsigned long)conf->worker_queue_target * 1000000)
+		{
+			pthread_mutex_unlock(&pool->locker);
+			return FALSE;
+		}
+	}
 
-	queue_insert_tail(&pool->conn_head, &conn->head);
+	conn->enqueued = now;
+	record_event(conn, EVENT_ENQUEUE, lane);
+	memcpy(pool->weights, conf->worker_queue_weights, sizeof(pool->weights));
+	queue_insert_tail(&pool->lanes[lane], &conn->head);
+	pool->conn_number++;
+	pool->lane_number[lane]++;
 	pthread_mutex_unlock(&pool->locker);
+	STAT_INC(STAT_ENQUEUED);
+	STAT_INC(STAT_ENQUEUED_FAST + lane);
 	sem_post(&pool->sem);
 	return TRUE;
 }
@@ -0,0 +1,138 @@
+/*
+ * trace.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "mem.h"
+
+typedef struct trace_event_s trace_event_t;
+struct trace_event_s {
+	unsigned long usec;
+	unsigned short point;
+	unsigned short length;
+	int fd;
+	long arg;
+	char text[TRACE_TEXT];
+};
+
+/* written only by its thread, never freed; a dump racing with the owner
+ * may print an event that is being overwritten */
+typedef struct trace_ring_s trace_ring_t;
+struct trace_ring_s {
+	unsigned long head;				//下一个事件的序号
+	unsigned long dumped;			//上次导出到的序号
+	pid_t tid;
+	trace_ring_t* next;
+	trace_event_t events[TRACE_RING_EVENTS];
+};
+
+static const char* point_names[] = { "accept", "close", "line", "unknown_header", "response" };
+
+volatile int trace_enabled = 0;
+
+static trace_ring_t* rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t* my_ring = NULL;
+
+static trace_ring_t* create_ring(void)
+{
+	trace_ring_t* ring = (trace_ring_t*)calloc(1, sizeof(trace_ring_t));
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+	ring->tid = syscall(SYS_gettid);
+	mem_add(MEM_INSTRUMENTATION, sizeof(trace_ring_t));
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	return ring;
+}
+
+void trace_event(int point, int fd, long arg, const char* text)
+{
+	trace_ring_t* ring = my_ring;
+	if (ring == NULL)
+	{
+		ring = my_ring = create_ring();
+		if (ring == NULL)
+		{
+			return;
+		}
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	trace_event_t* e = &ring->events[ring->head % TRACE_RING_EVENTS];
+	e->usec = (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	e->point = point;
+	e->fd = fd;
+	e->arg = arg;
+	e->length = 0;
+	if (text)
+	{
+		e->length = strnlen(text, TRACE_TEXT);
+		memcpy(e->text, text, e->length);
+	}
+	__sync_synchronize();
+	ring->head++;
+}
+
+int trace_dump(const char* path)
+{
+	FILE* fp = fopen(path, "a");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	trace_ring_t* ring = rings;
+	for (; ring; ring=ring->next)
+	{
+		unsigned long head = ring->head;
+		unsigned long seq = ring->dumped;
+		if (head - seq > TRACE_RING_EVENTS)
+		{
+			fprintf(fp, "tid %d: %lu events lost\n", ring->tid, head - seq - TRACE_RING_EVENTS);
+			seq = head - TRACE_RING_EVENTS;
+		}
+
+		for (; seq<head; seq++)
+		{
+			const trace_event_t* e = &ring->events[seq % TRACE_RING_EVENTS];
+			time_t sec = e->usec / 1000000;
+			struct tm tm;
+			char timestr[32];
+			localtime_r(&sec, &tm);
+			strftime(timestr, sizeof(timestr), "%F %T", &tm);
+			fprintf(fp, "[%s.%06lu] %d/%d %s fd=%d arg=%ld", timestr, e->usec % 1000000,
+					getpid(), ring->tid,
+					e->point < TRACE_POINTS ? point_names[e->point] : "?", e->fd, e->arg);
+			if (e->length)
+			{
+				fprintf(fp, " \"%.*s\"", e->length, e->text);
+			}
+			fputc('\n', fp);
+		}
+		ring->dumped = head;
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * trace.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "common.h"
+
+/* events a thread keeps, older ones are overwritten */
+#define TRACE_RING_EVENTS 4096
+/* bytes of text an event keeps, e.g. the start of a header line */
+#define TRACE_TEXT 40
+
+typedef enum {
+	TRACE_ACCEPT = 0,		/* fd, remote port */
+	TRACE_CLOSE,			/* fd, responses sent on the connection */
+	TRACE_LINE,				/* fd, check_index, request or header line */
+	TRACE_UNKNOWN_HEADER,	/* fd, 0, header line */
+	TRACE_RESPONSE,			/* fd, status */
+	TRACE_POINTS
+} trace_point_t;
+
+/* switched by the "trace" directive, read by every tracepoint */
+extern volatile int trace_enabled;
+
+/* a disabled tracepoint costs one well predicted branch */
+#define TRACEPOINT(point, fd, arg, text) do {								\
+		if (__builtin_expect(trace_enabled, 0))									\
+			trace_event((point), (fd), (arg), (text));							\
+	} while (0)
+
+/* record an event in the calling thread's ring, text may be NULL */
+void trace_event(int point, int fd, long arg, const char* text);
+
+/* append the events recorded since the last dump to path, one line each */
+int trace_dump(const char* path);
+
+#endif /* TRACE_H_ */
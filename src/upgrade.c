@@ -0,0 +1,193 @@
+/*
+ * upgrade.c
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "upgrade.h"
+#include "log.h"
+
+extern log_handle_t g_log;
+extern char** environ;
+
+static char exe_path[PATH_MAX];
+static char** saved_argv = NULL;
+
+void upgrade_save_argv(int argc, char* argv[])
+{
+	/* argv[0] without a '/' was found through PATH, execvp searches it again */
+	if (strchr(argv[0], '/') == NULL || realpath(argv[0], exe_path) == NULL)
+	{
+		snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+	}
+
+	saved_argv = (char**)calloc(argc + 1, sizeof(char*));
+	int i = 0;
+	for (; saved_argv && i<argc; i++)
+	{
+		saved_argv[i] = strdup(argv[i]);
+	}
+}
+
+static int is_passed(int fd, const int* fds, int n)
+{
+	int i = 0;
+	for (; i<n; i++)
+	{
+		if (fds[i] == fd)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+pid_t upgrade_spawn(const int* fds, int n)
+{
+	char env[4096];
+	char parent[64];
+	size_t len = 0;
+	int i = 0;
+
+	if (saved_argv == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = snprintf(env, sizeof(env), "%s=", UPGRADE_LISTEN_ENV);
+	for (; i<n && len < sizeof(env); i++)
+	{
+		len += snprintf(env + len, sizeof(env) - len, "%d;", fds[i]);
+	}
+	if (len >= sizeof(env))
+	{
+		errno = E2BIG;
+		return -1;
+	}
+	snprintf(parent, sizeof(parent), "%s=%d", UPGRADE_PARENT_ENV, getpid());
+
+	/* the environment is built before fork, the child of a threaded
+	 * process may only call async-signal-safe functions */
+	int count = 0;
+	while (environ[count])
+	{
+		count++;
+	}
+	char** envp = (char**)malloc(sizeof(char*) * (count + 3));
+	if (envp == NULL)
+	{
+		return -1;
+	}
+	int j = 0;
+	for (i=0; i<count; i++)
+	{
+		if (strncmp(environ[i], UPGRADE_LISTEN_ENV "=", strlen(UPGRADE_LISTEN_ENV) + 1) != 0
+				&& strncmp(environ[i], UPGRADE_PARENT_ENV "=", strlen(UPGRADE_PARENT_ENV) + 1) != 0)
+		{
+			envp[j++] = environ[i];
+		}
+	}
+	envp[j++] = env;
+	envp[j++] = parent;
+	envp[j] = NULL;
+
+	struct rlimit rl;
+	int max_fd = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+	{
+		max_fd = (int)rl.rlim_cur;
+	}
+
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid != 0)
+	{
+		free(envp);
+		return pid;
+	}
+
+	/* child: only the calling thread exists, connections, epoll instances
+	 * and log files must not leak into the new binary */
+	int fd = 3;
+	for (; fd<max_fd; fd++)
+	{
+		if (!is_passed(fd, fds, n))
+		{
+			close(fd);
+		}
+	}
+	for (i=0; i<n; i++)
+	{
+		fcntl(fds[i], F_SETFD, 0);
+	}
+
+	sigset_t empty;
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+
+	execvpe(exe_path, saved_argv, envp);
+	_exit(127);
+}
+
+int upgrade_inherited_listeners(int* fds, int max)
+{
+	const char* env = getenv(UPGRADE_LISTEN_ENV);
+	int n = 0;
+	if (env == NULL)
+	{
+		return 0;
+	}
+
+	while (*env && n < max)
+	{
+		char* end = NULL;
+		long fd = strtol(env, &end, 10);
+		int type = 0;
+		socklen_t len = sizeof(type);
+		if (end == env)
+		{
+			break;
+		}
+		if (getsockopt((int)fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM)
+		{
+			fds[n++] = (int)fd;
+		}
+		else
+		{
+			WARNING(&g_log, "upgrade", "ignoring invalid inherited fd %ld", fd);
+		}
+		env = (*end == ';') ? end + 1 : end;
+	}
+	unsetenv(UPGRADE_LISTEN_ENV);
+	return n;
+}
+
+void upgrade_notify_parent(void)
+{
+	const char* env = getenv(UPGRADE_PARENT_ENV);
+	if (env == NULL)
+	{
+		return;
+	}
+
+	pid_t parent = (pid_t)atoi(env);
+	unsetenv(UPGRADE_PARENT_ENV);
+	if (parent > 1 && kill(parent, SIGQUIT) == 0)
+	{
+		INFO(&g_log, "upgrade", "serving, asked previous binary %d to drain", parent);
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * upgrade.h
+ *
+ *  Created on: 2026-10-19
+ *      Author: brucewoo
+ */
+
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include <sys/types.h>
+
+/* listening fds passed to a new binary, "fd;fd;...;" */
+#define UPGRADE_LISTEN_ENV "JHTTPSERVER_LISTEN_FDS"
+/* pid of the process to send SIGQUIT to once the new binary serves */
+#define UPGRADE_PARENT_ENV "JHTTPSERVER_PARENT_PID"
+
+/* remember how this binary was started, call before any chdir */
+void upgrade_save_argv(int argc, char* argv[]);
+
+/* fork and exec the binary at the saved path with the saved arguments,
+ * passing fds[0..n) and closing every other descriptor, returns the pid */
+pid_t upgrade_spawn(const int* fds, int n);
+
+/* the listening fds passed by the previous binary, in order; returns
+ * their number and removes the variable from the environment */
+int upgrade_inherited_listeners(int* fds, int max);
+
+/* tell the previous binary to stop accepting and drain */
+void upgrade_notify_parent(void);
+
+#endif /* UPGRADE_H_ */
@@ -0,0 +1,254 @@
+#!/bin/sh
+#
+# perf.sh
+#
+#  Created on: 2026-10-19
+#      Author: brucewoo
+#
+# Runs fixed load scenarios against JHttpServer on loopback and compares
+# them with a baseline, see "make perf".
+#
+#   perf.sh [-u] server baseline results
+#   perf.sh -n server results
+#   perf.sh -c baseline results
+#
+# Every run of every scenario is one JSON line of stress_test output in
+# results, tagged with "scenario", "run" and the CPU time the server used
+# in "server_cpu_ms". With -u the results replace the baseline, with -n
+# they are only written, -c compares two result files without running.
+# The median of each metric is compared with the median in the baseline;
+# a metric regresses when it is worse by more than its tolerance or twice
+# the spread (max - min over median) of the runs, whichever is larger, so
+# noisy scenarios need a bigger change to fail. Any run with errors (failed
+# or unsent requests) fails on its own, and is never recorded as a baseline.
+#
+# PERF_RUNS (3), PERF_DURATION (5 seconds) and PERF_PORT (18480) change
+# the defaults, CC builds stress_test.
+
+mode=compare
+case "$1" in
+-u) mode=update; shift ;;
+-n) mode=run; shift ;;
+-c) mode=report; shift ;;
+esac
+case "$mode:$#" in
+compare:3|update:3) server=$1; baseline=$2; results=$3 ;;
+run:2) server=$1; baseline=; results=$2 ;;
+report:2) server=; baseline=$1; results=$2 ;;
+*)
+	echo "Usage: $0 [-u] server baseline results | -n server results | -c baseline results" >&2
+	exit 1
+	;;
+esac
+runs=${PERF_RUNS:-3}
+duration=${PERF_DURATION:-5}
+port=${PERF_PORT:-18480}
+testdir=$(cd "$(dirname "$0")" && pwd)
+
+# medians of results against the baseline, fails on a regression
+compare() {
+	awk '
+	function value(line, key,    s) {
+		if (!match(line, "\"" key "\":[-0-9.e+]+"))
+			return "";
+		s = substr(line, RSTART, RLENGTH);
+		return substr(s, index(s, ":") + 1) + 0;
+	}
+	# median and spread of the values of one scenario and metric
+	function stats(which, name, metric,    n, i, j, v, t) {
+		n = count[which, name, metric];
+		for (i = 1; i <= n; i++)
+			v[i] = values[which, name, metric, i];
+		for (i = 2; i <= n; i++)
+			for (j = i; j > 1 && v[j - 1] > v[j]; j--) {
+				t = v[j]; v[j] = v[j - 1]; v[j - 1] = t;
+			}
+		median = n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2;
+		spread = median > 0 ? (v[n] - v[1]) / median : 0;
+	}
+	BEGIN {
+		# 指标， 越大越好还是越小越好， 相对容差， 绝对容差
+		split("throughput p50 p99 server_cpu_ms errors", metrics, " ");
+		better["throughput"] = "higher"; tolerance["throughput"] = 0.10; slack["throughput"] = 0;
+		better["p50"] = "lower"; tolerance["p50"] = 0.25; slack["p50"] = 50;
+		better["p99"] = "lower"; tolerance["p99"] = 0.25; slack["p99"] = 200;
+		better["server_cpu_ms"] = "lower"; tolerance["server_cpu_ms"] = 0.15; slack["server_cpu_ms"] = 30;
+		better["errors"] = "lower"; tolerance["errors"] = 0; slack["errors"] = 0;
+	}
+	{
+		which = FILENAME == ARGV[1] ? "base" : "now";
+		match($0, "\"scenario\":\"[^\"]*\"");
+		name = substr($0, RSTART + 12, RLENGTH - 13);
+		if (which == "now" && !(name in seen)) {
+			seen[name] = 1;
+			order[++names] = name;
+		}
+		for (m = 1; m <= 5; m++) {
+			metric = metrics[m];
+			v = metric == "errors" ? value($0, "errors") + value($0, "unsent") : value($0, metric);
+			values[which, name, metric, ++count[which, name, metric]] = v;
+			if (which == "now" && metric == "errors" && v > 0)
+				failed_runs[name]++;
+		}
+	}
+	END {
+		failed = 0;
+		printf "%-18s %-14s %12s %12s %8s %8s  %s\n", "scenario", "metric", "baseline", "now", "change", "allowed", "";
+		for (k = 1; k <= names; k++) {
+			name = order[k];
+			for (m = 1; m <= 5; m++) {
+				metric = metrics[m];
+				if (!count["base", name, metric]) {
+					printf "%-18s %-14s %12s\n", name, metric, "new";
+					continue;
+				}
+				stats("base", name, metric); base = median; base_spread = spread;
+				stats("now", name, metric); now = median;
+				allowed = tolerance[metric];
+				if (2 * base_spread > allowed) allowed = 2 * base_spread;
+				if (2 * spread > allowed) allowed = 2 * spread;
+				change = base > 0 ? (now - base) / base : (now > 0 ? 1 : 0);
+				if (better[metric] == "higher")
+					bad = now < base * (1 - allowed) - slack[metric];
+				else
+					bad = now > base * (1 + allowed) + slack[metric];
+				failed += bad;
+				printf "%-18s %-14s %12.1f %12.1f %7.1f%% %7.1f%%  %s\n", name, metric, base, now,
+						change * 100, allowed * 100, bad ? "REGRESSION" : "ok";
+			}
+			if (failed_runs[name]) {
+				failed++;
+				printf "%-18s %-14s %d of %d runs had errors  REGRESSION\n", name, "errors",
+						failed_runs[name], count["now", name, "errors"];
+			}
+		}
+		exit failed ? 1 : 0;
+	}' "$baseline" "$results"
+}
+
+if [ $mode = report ]; then
+	compare
+	exit
+fi
+
+tmp=$(mktemp -d /tmp/jperf.XXXXXX) || exit 1
+pid=
+# SIGQUIT lets the server exit normally, an instrumented build writes its
+# profile then
+cleanup() {
+	if [ -n "$pid" ] && kill -QUIT "$pid" 2>/dev/null; then
+		waited=0
+		while kill -0 "$pid" 2>/dev/null && [ $waited -lt 20 ]; do
+			sleep 0.5
+			waited=$((waited + 1))
+		done
+		kill -KILL "$pid" 2>/dev/null
+		wait "$pid" 2>/dev/null
+	fi
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+${CC:-cc} -O2 -o "$tmp/stress_test" "$testdir/stress_test.c" -lpthread || exit 1
+
+# 生成网站根目录和请求列表
+mkdir "$tmp/root"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$tmp/root/small.html"
+cp "$tmp/root/small.html" "$tmp/root/index.html"
+head -c 1048576 /dev/urandom > "$tmp/root/large.bin"
+echo "/small.html" > "$tmp/small.mix"
+echo "/large.bin" > "$tmp/large.mix"
+printf '1 /missing.html\n1 /nothing/here\n' > "$tmp/missing.mix"
+
+cat > "$tmp/perf.conf" <<EOF
+error_log $tmp/error.log info;
+worker_processes 1;
+events {
+    worker_connections 8192;
+}
+http {
+    keepalive_timeout 60;
+    server {
+        listen 127.0.0.1:$port backlog=1024;
+        root $tmp/root;
+        location / { index index.html; }
+    }
+}
+EOF
+
+ulimit -n 16384 2>/dev/null || ulimit -n 4096 2>/dev/null
+hz=$(getconf CLK_TCK)
+
+# user and system time of the server in clock ticks
+server_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null || echo 0
+}
+
+"$server" -c "$tmp/perf.conf" > "$tmp/server.out" 2>&1 &
+pid=$!
+tries=0
+until "$tmp/stress_test" -r 10 -c 1 -d 1 -T 1 -f "$tmp/small.mix" 127.0.0.1 "$port" > /dev/null 2>&1; do
+	tries=$((tries + 1))
+	if [ $tries -ge 10 ] || ! kill -0 "$pid" 2>/dev/null; then
+		echo "JHttpServer did not start:" >&2
+		cat "$tmp/server.out" "$tmp/error.log" >&2 2>/dev/null
+		exit 1
+	fi
+	sleep 1
+done
+
+# name and stress_test options of every scenario
+scenarios="
+small_keepalive		-r 5000 -c 32 -t 2 -f $tmp/small.mix
+large_file			-r 400 -c 8 -f $tmp/large.mix
+not_found_storm		-r 10000 -c 32 -t 2 -f $tmp/missing.mix
+idle_connections	-r 2000 -c 16 -i 2000 -f $tmp/small.mix
+slow_readers		-r 2000 -c 16 -i 64 -s /large.bin -f $tmp/small.mix
+pipelined_bursts	-r 20000 -c 8 -p 16 -f $tmp/small.mix
+silent_flood		-r 2000 -c 16 -i 9000 -f $tmp/small.mix
+"
+
+: > "$results"
+echo "$scenarios" | while read -r name options; do
+	[ -z "$name" ] && continue
+	run=1
+	while [ $run -le "$runs" ]; do
+		before=$(server_ticks)
+		# shellcheck disable=SC2086
+		json=$("$tmp/stress_test" -d "$duration" $options 127.0.0.1 "$port")
+		cpu=$(( ($(server_ticks) - before) * 1000 / hz ))
+		if [ -z "$json" ]; then
+			echo "$name: stress_test failed" >&2
+			json='{"completed":0,"errors":1}'
+		fi
+		echo "{\"scenario\":\"$name\",\"run\":$run,\"server_cpu_ms\":$cpu,${json#\{}" >> "$results"
+		echo "$name run $run: $json" >&2
+		run=$((run + 1))
+	done
+done
+
+if ! kill -0 "$pid" 2>/dev/null; then
+	echo "JHttpServer exited during the scenarios" >&2
+	exit 1
+fi
+
+case $mode in
+update)
+	if grep -E '"(errors|unsent)":[1-9]' "$results" > /dev/null; then
+		echo "runs with errors, baseline $baseline not updated" >&2
+		exit 1
+	fi
+	cp "$results" "$baseline"
+	echo "baseline $baseline updated"
+	exit 0
+	;;
+run)
+	exit 0
+	;;
+esac
+if [ ! -f "$baseline" ]; then
+	echo "no baseline $baseline, results are in $results"
+	exit 0
+fi
+compare
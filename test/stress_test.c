@@ -3,31 +3,154 @@
  *
  *  Created on: 2013-11-6
  *      Author: brucewoo
+ *
+ * Open loop load generator: requests are started at a fixed rate whether or
+ * not the server keeps up, and each latency is measured from the time the
+ * request was due, not from when a connection was free to send it, so a
+ * stalled server shows up in the percentiles (coordinated omission).
+ * With -R it replays the connections of a capture file written by the
+ * server's "capture" directive instead, at the recorded pace or faster.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+
+#include "../src/capture.h"
+
+typedef enum BOOL bool;
+
+#define MAX_PIPELINE 64
+#define MAX_THREADS 256
+#define MAX_MIX 256
+#define OUT_BUFFER_SIZE 8192
+#define IN_BUFFER_SIZE 16384
+
+/* log-linear histogram of microseconds, 16 buckets per power of two */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+/* one line of the request mix */
+typedef struct mix_s mix_t;
+struct mix_s {
+	char* request;
+	int length;
+	int weight;
+};
+
+typedef struct client_s client_t;
+struct client_s {
+	int fd;							//-1: 未连接
+	bool connected;
+	bool writing;					//是否在等待EPOLLOUT
+	unsigned long due[MAX_PIPELINE];//已发送请求的计划开始时间， 环形
+	int head;
+	int outstanding;
+	unsigned long last_activity;
+
+	char out[OUT_BUFFER_SIZE];		//还没写出去的请求
+	int out_len;
+	int out_off;
+
+	char in[IN_BUFFER_SIZE];
+	int in_len;
+	long body_left;					//-1: 正在读响应头
+	int status;
+	bool close_after;
+	struct session_s* session;		//回放时正在这个连接上回放的会话
+};
+
+/* bytes the server read in one recv() of a captured connection */
+typedef struct chunk_s chunk_t;
+struct chunk_s {
+	unsigned long at;				//距连接建立的微秒数
+	const char* data;
+	int length;
+};
+
+/* one captured connection */
+typedef struct session_s session_t;
+struct session_s {
+	unsigned long open;				//距capture中第一个连接的微秒数
+	chunk_t* chunks;
+	int chunk_number;
+	int chunk_cap;
+	int next;						//下一个要发送的chunk
+	int match;						//已发送数据的末尾匹配了"\r\n\r\n"的字节数
+	unsigned long started;			//回放时计划的开始时间
+};
+
+typedef struct worker_s worker_t;
+struct worker_s {
+	int id;
+	pthread_t thread;
+	int epollfd;
+	client_t* clients;
+	int client_number;
+	double rate;					//本线程每秒开始的请求数
+	unsigned int seed;
 
-typedef enum BOOL {
-	FALSE = 0,
-	false = 0,
-	TRUE = 1,
-	true = 1
-}bool;
+	unsigned long* backlog;			//到期但还没有连接可以发送的请求
+	int backlog_head;
+	int backlog_len;
+	int backlog_cap;
 
-/* 每个客户连接不停的向服务器发送这个请求 */
-static const char* request = "GET http://localhost/index.html HTTP/1.1\r\nConnection: keep-alive\r\n\r\nxxxxxxxxxxxx";
+	unsigned long histogram[BUCKETS];
+	unsigned long max_latency;
+	unsigned long completed;
+	unsigned long errors;
+	unsigned long unsent;
+	unsigned long status[6];		//0: 无法解析, 1..5: 1xx..5xx
+	unsigned long bytes;
+};
 
-int set_nonblocking(int fd)
+/* command line */
+static struct sockaddr_in server;
+static double rate = 1000;
+static int connections = 10;
+static int threads = 1;
+static int duration = 10;
+static int pipeline = 1;
+static bool keepalive = TRUE;
+static int timeout = 5;
+static const char* mix_file = NULL;
+static int idle = 0;
+static const char* stall_path = NULL;
+
+static const char* replay_file = NULL;
+static double speed = 1;				//0: 尽快回放
+static bool duration_set = FALSE;
+static session_t* sessions = NULL;
+static int session_number = 0;
+
+static mix_t mix[MAX_MIX];
+static int mix_number = 0;
+static int mix_total_weight = 0;
+
+static unsigned long now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int set_nonblocking(int fd)
 {
 	int old_option = fcntl(fd, F_GETFL);
 	int new_option = old_option | O_NONBLOCK;
@@ -35,135 +158,1053 @@ int set_nonblocking(int fd)
 	return old_option;
 }
 
-void add_fd(int epollfd, int fd, bool one_shot)
+static int bucket_of(unsigned long v)
 {
-	struct epoll_event event;
-	event.data.fd = fd;
-	event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+	if (v < SUB_BUCKETS)
+	{
+		return v;
+	}
+	int shift = 63 - __builtin_clzl(v) - SUB_BITS;
+	return (shift + 1) * SUB_BUCKETS + ((v >> shift) & (SUB_BUCKETS - 1));
+}
+
+static unsigned long value_of(int bucket)
+{
+	if (bucket < SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	int shift = bucket / SUB_BUCKETS - 1;
+	unsigned long sub = bucket % SUB_BUCKETS;
+	return ((SUB_BUCKETS + sub) << shift) + ((1UL << shift) >> 1);
+}
 
-	if (one_shot) {
-		event.events |= EPOLLONESHOT;
+static unsigned long quantile(const unsigned long* histogram, unsigned long total,
+		unsigned long max, double q)
+{
+	unsigned long rank = (unsigned long)(q * total);
+	unsigned long seen = 0;
+	int i = 0;
+	for (; i<BUCKETS; i++)
+	{
+		seen += histogram[i];
+		if (seen > rank)
+		{
+			return value_of(i) < max ? value_of(i) : max;
+		}
 	}
+	return 0;
+}
 
-	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-	set_nonblocking(fd);
+static int add_request(const char* path, int weight)
+{
+	char buf[2048];
+	char host[INET_ADDRSTRLEN];
+	if (mix_number == MAX_MIX)
+	{
+		return -1;
+	}
+	inet_ntop(AF_INET, &server.sin_addr, host, sizeof(host));
+	int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n",
+			path, host, ntohs(server.sin_port), keepalive ? "keep-alive" : "close");
+	if (len >= (int)sizeof(buf) || len > OUT_BUFFER_SIZE)
+	{
+		return -1;
+	}
+	mix[mix_number].request = strdup(buf);
+	mix[mix_number].length = len;
+	mix[mix_number].weight = weight;
+	mix_total_weight += weight;
+	mix_number++;
+	return 0;
 }
 
-/* 向服务器写入len字节的数据 */
-bool write_nbytes(int sockfd, const char* buffer, int len)
+/* every line is "[weight] path", '#' starts a comment */
+static int load_mix(const char* filename)
 {
-	int bytes_write = 0;
-	printf("write out %d bytes to socket %d\n", len, sockfd);
-	while (true)
+	FILE* fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		perror(filename);
+		return -1;
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp))
 	{
-		bytes_write = send(sockfd, buffer, len, 0);
-		if (bytes_write == -1)
+		char* p = line + strspn(line, " \t");
+		p[strcspn(p, "#\r\n")] = '\0';
+		if (*p == '\0')
 		{
-			return false;
+			continue;
+		}
+
+		int weight = 1;
+		char path[1024];
+		if (sscanf(p, "%d %1023s", &weight, path) != 2)
+		{
+			weight = 1;
+			if (sscanf(p, "%1023s", path) != 1)
+			{
+				continue;
+			}
 		}
-		else if (bytes_write == 0)
+		if (weight <= 0 || path[0] != '/' || add_request(path, weight) < 0)
 		{
-			return false;
+			fprintf(stderr, "%s: bad line \"%s\"\n", filename, p);
+			fclose(fp);
+			return -1;
 		}
+	}
+	fclose(fp);
+	return mix_number > 0 ? 0 : -1;
+}
 
-		len -= bytes_write;
-		buffer = buffer + bytes_write;
-		if (len <= 0)
+static const mix_t* pick_request(worker_t* w)
+{
+	int r = rand_r(&w->seed) % mix_total_weight;
+	int i = 0;
+	for (; i<mix_number - 1; i++)
+	{
+		r -= mix[i].weight;
+		if (r < 0)
 		{
-			return true;
+			break;
 		}
 	}
-	return true;
+	return &mix[i];
+}
+
+static void close_client(worker_t* w, client_t* c, bool failed)
+{
+	if (c->fd >= 0)
+	{
+		epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, 0);
+		close(c->fd);
+	}
+	if (failed)
+	{
+		w->errors += c->outstanding;
+	}
+	c->fd = -1;
+	c->connected = FALSE;
+	c->outstanding = 0;
+	c->head = 0;
+	c->out_len = c->out_off = 0;
+	c->in_len = 0;
+	c->body_left = -1;
 }
 
-/* 从服务器读取数据 */
-bool read_once(int sockfd, char* buffer, int len)
+static void open_client(worker_t* w, client_t* c)
 {
-	int bytes_read = 0;
-	memset(buffer, '\0', len);
-	bytes_read = recv(sockfd, buffer, len, 0);
-	if (bytes_read == -1)
+	c->fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (c->fd < 0)
 	{
-		return false;
+		return;
 	}
-	else if (bytes_read == 0)
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	set_nonblocking(c->fd);
+	if (connect(c->fd, (struct sockaddr*)&server, sizeof(server)) < 0 && errno != EINPROGRESS)
 	{
-		return false;
+		close(c->fd);
+		c->fd = -1;
+		w->errors++;
+		return;
+	}
+
+	struct epoll_event event;
+	event.data.ptr = c;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &event);
+	c->connected = FALSE;
+	c->writing = TRUE;
+	c->last_activity = now_usec();
+}
+
+/* EPOLLOUT only while connecting or while requests are left to write,
+ * else epoll_wait would return at once */
+static void watch_out(worker_t* w, client_t* c, bool on)
+{
+	if (c->writing != on)
+	{
+		struct epoll_event event;
+		event.data.ptr = c;
+		event.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+		epoll_ctl(w->epollfd, EPOLL_CTL_MOD, c->fd, &event);
+		c->writing = on;
 	}
-	printf("read in %d bytes from socket %d with content: %s\n", bytes_read, sockfd, buffer);
-	return true;
 }
 
-/* 向服务器发起num个TCP连接， 可以通过改变num来调整测试压力 */
-void start_conn(int epoll_fd, int num, const char* ip, int port)
+static void flush_client(worker_t* w, client_t* c)
 {
-	int ret = 0;
-	struct sockaddr_in address;
-	bzero(&address, sizeof(address));
-	address.sin_family = AF_INET;
-	inet_pton(AF_INET, ip, &address.sin_addr);
-	address.sin_port = htons(port);
+	while (c->connected && c->out_off < c->out_len)
+	{
+		int n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, 0);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				close_client(w, c, TRUE);
+			}
+			return;
+		}
+		c->out_off += n;
+	}
+	if (c->out_off == c->out_len)
+	{
+		c->out_off = c->out_len = 0;
+	}
+	if (c->connected)
+	{
+		watch_out(w, c, c->out_len > 0);
+	}
+}
 
+/* hand due requests to connections with a free pipeline slot */
+static void dispatch(worker_t* w)
+{
 	int i = 0;
-	for (; i<num; ++i)
+	for (; i<w->client_number && w->backlog_len > 0; i++)
 	{
-		sleep(1);
-		int sockfd = socket(PF_INET, SOCK_STREAM, 0);
-		printf("create 1 socket\n");
-		if (sockfd < 0)
+		client_t* c = &w->clients[i];
+		if (c->fd < 0)
 		{
+			open_client(w, c);
 			continue;
 		}
+		/* 不保持连接时一个连接上同时只有一个请求 */
+		int depth = keepalive ? pipeline : 1;
+		while (w->backlog_len > 0 && c->outstanding < depth)
+		{
+			const mix_t* m = pick_request(w);
+			if (c->out_len + m->length > OUT_BUFFER_SIZE)
+			{
+				break;
+			}
+			memcpy(c->out + c->out_len, m->request, m->length);
+			c->out_len += m->length;
+			c->due[(c->head + c->outstanding) % MAX_PIPELINE] = w->backlog[w->backlog_head];
+			c->outstanding++;
+			w->backlog_head = (w->backlog_head + 1) % w->backlog_cap;
+			w->backlog_len--;
+		}
+		flush_client(w, c);
+	}
+}
 
-		if (connect(sockfd, (struct sockaddr*)&address, sizeof(address)) == 0)
+static void push_backlog(worker_t* w, unsigned long due)
+{
+	if (w->backlog_len == w->backlog_cap)
+	{
+		int cap = w->backlog_cap ? w->backlog_cap * 2 : 1024;
+		unsigned long* bigger = (unsigned long*)malloc(sizeof(unsigned long) * cap);
+		assert(bigger);
+		int i = 0;
+		for (; i<w->backlog_len; i++)
 		{
-			printf("build connection %d\n", i);
-			add_fd(epoll_fd, sockfd, true);
+			bigger[i] = w->backlog[(w->backlog_head + i) % w->backlog_cap];
 		}
+		free(w->backlog);
+		w->backlog = bigger;
+		w->backlog_cap = cap;
+		w->backlog_head = 0;
 	}
+	w->backlog[(w->backlog_head + w->backlog_len) % w->backlog_cap] = due;
+	w->backlog_len++;
 }
 
-void close_conn(int epoll_fd, int sockfd)
+static void complete_response(worker_t* w, client_t* c)
 {
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sockfd, 0);
-	close(sockfd);
+	unsigned long now = now_usec();
+	unsigned long latency = now - c->due[c->head];
+	w->histogram[bucket_of(latency)]++;
+	w->max_latency = latency > w->max_latency ? latency : w->max_latency;
+	w->completed++;
+	w->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+	c->head = (c->head + 1) % MAX_PIPELINE;
+	c->outstanding--;
+	c->body_left = -1;
+	if (c->close_after || !keepalive)
+	{
+		close_client(w, c, TRUE);
+	}
 }
 
-int main(int argc, char* argv[])
+/* parse the response header at the start of in, -1 if it is malformed */
+static int parse_header(client_t* c, int header_length)
 {
-	if (argc < 4)
+	char* p = c->in;
+	c->in[header_length - 1] = '\0';
+	if (strncmp(p, "HTTP/1.", 7) != 0)
 	{
-		printf("Usage: %s ip port conn_number\n", argv[0]);
-		return 1;
+		return -1;
 	}
+	c->status = atoi(p + 9);
+	c->body_left = 0;
+	c->close_after = FALSE;
 
-	int epoll_fd = epoll_create(100);
-	start_conn(epoll_fd, atoi(argv[3]), argv[1], atoi(argv[2]));
-	struct epoll_event events[10000];
-	char buffer[2048];
+	while ((p = strstr(p, "\r\n")) != NULL)
+	{
+		p += 2;
+		if (strncasecmp(p, "Content-Length:", 15) == 0)
+		{
+			c->body_left = atol(p + 15);
+		}
+		else if (strncasecmp(p, "Connection:", 11) == 0)
+		{
+			c->close_after = strstr(p, "close") != NULL;
+		}
+	}
+	return 0;
+}
 
-	while (true)
+static void read_client(worker_t* w, client_t* c)
+{
+	while (c->fd >= 0)
 	{
-		int fds = epoll_wait(epoll_fd, events, 10000, 2000);
-		int i = 0;
-		for (; i<fds; i++)
+		int n = recv(c->fd, c->in + c->in_len, IN_BUFFER_SIZE - c->in_len, 0);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				close_client(w, c, TRUE);
+			}
+			return;
+		}
+		if (n == 0)
+		{
+			close_client(w, c, TRUE);
+			return;
+		}
+		c->in_len += n;
+		w->bytes += n;
+		c->last_activity = now_usec();
+
+		/* 一次读到的数据里可能有多个响应 */
+		while (c->fd >= 0 && c->in_len > 0)
 		{
-			int sockfd = events[i].data.fd;
-			if (events[i].events & EPOLLIN)
+			int used = 0;
+			if (c->body_left < 0)
 			{
-				if (!read_once(sockfd, buffer, 2048))
+				char* end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+				if (end == NULL)
+				{
+					if (c->in_len == IN_BUFFER_SIZE)
+					{
+						close_client(w, c, TRUE);
+					}
+					break;
+				}
+				used = end + 4 - c->in;
+				if (c->outstanding == 0 || parse_header(c, used) < 0)
 				{
-					close_conn(epoll_fd, sockfd);
+					close_client(w, c, TRUE);
+					return;
 				}
-				struct epoll_event event;
-				event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-				event.data.fd = sockfd;
-				epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sockfd, &event);
 			}
-			else if (events[i].events & EPOLLERR)
+			else
+			{
+				used = c->body_left < c->in_len ? c->body_left : c->in_len;
+				c->body_left -= used;
+			}
+
+			memmove(c->in, c->in + used, c->in_len - used);
+			c->in_len -= used;
+			if (c->body_left == 0)
+			{
+				complete_response(w, c);
+			}
+		}
+	}
+}
+
+static void handle_event(worker_t* w, client_t* c, unsigned int events)
+{
+	if (c->fd < 0)
+	{
+		return;
+	}
+	if (!c->connected && (events & EPOLLOUT))
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0)
+		{
+			close_client(w, c, TRUE);
+			w->errors++;
+			return;
+		}
+		c->connected = TRUE;
+	}
+	if (events & EPOLLIN)
+	{
+		read_client(w, c);
+	}
+	if (c->fd >= 0 && (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) && !(events & EPOLLIN))
+	{
+		close_client(w, c, TRUE);
+		return;
+	}
+	if (c->fd >= 0 && (events & EPOLLOUT))
+	{
+		flush_client(w, c);
+	}
+}
+
+/* close connections whose requests got no answer for timeout seconds */
+static void check_timeouts(worker_t* w, unsigned long now)
+{
+	int i = 0;
+	for (; i<w->client_number; i++)
+	{
+		client_t* c = &w->clients[i];
+		if (c->fd >= 0 && (c->outstanding > 0 || !c->connected)
+				&& now - c->last_activity > (unsigned long)timeout * 1000000)
+		{
+			close_client(w, c, TRUE);
+		}
+	}
+}
+
+static int outstanding(worker_t* w)
+{
+	int n = 0;
+	int i = 0;
+	for (; i<w->client_number; i++)
+	{
+		n += w->clients[i].fd >= 0 ? w->clients[i].outstanding : 0;
+	}
+	return n;
+}
+
+static void* run_worker(void* arg)
+{
+	worker_t* w = (worker_t*)arg;
+	struct epoll_event events[1024];
+	w->epollfd = epoll_create(100);
+
+	int i = 0;
+	for (; i<w->client_number; i++)
+	{
+		w->clients[i].fd = -1;
+		close_client(w, &w->clients[i], FALSE);
+		open_client(w, &w->clients[i]);
+	}
+
+	/* 第i个请求在start + i / rate时开始， 不管上一个请求是否已经完成 */
+	unsigned long start = now_usec();
+	unsigned long end = start + (unsigned long)duration * 1000000;
+	unsigned long drain_end = end + (unsigned long)timeout * 1000000;
+	unsigned long sent = 0;
+	unsigned long last_check = start;
+
+	while (true)
+	{
+		unsigned long now = now_usec();
+		while (now < end)
+		{
+			unsigned long due = start + (unsigned long)(sent * 1000000.0 / w->rate);
+			if (due > now || due >= end)
+			{
+				break;
+			}
+			push_backlog(w, due);
+			sent++;
+		}
+		if (now >= end && ((w->backlog_len == 0 && outstanding(w) == 0) || now >= drain_end))
+		{
+			break;
+		}
+		dispatch(w);
+
+		if (now - last_check > 100000)
+		{
+			check_timeouts(w, now);
+			last_check = now;
+		}
+
+		unsigned long next = start + (unsigned long)(sent * 1000000.0 / w->rate);
+		int wait = 0;
+		if (w->backlog_len == 0)
+		{
+			wait = now >= end ? 10 : (int)((next > now ? next - now : 0) / 1000);
+		}
+		int number = epoll_wait(w->epollfd, events, 1024, wait);
+		for (i=0; i<number; i++)
+		{
+			handle_event(w, (client_t*)events[i].data.ptr, events[i].events);
+		}
+	}
+
+	w->unsent = w->backlog_len;
+	w->errors += outstanding(w);
+	for (i=0; i<w->client_number; i++)
+	{
+		close_client(w, &w->clients[i], FALSE);
+	}
+	close(w->epollfd);
+	return NULL;
+}
+
+/* the capture file is read as a whole, chunks point into it */
+static char* capture = NULL;
+
+/* session of every connection id, the last one opened wins */
+typedef struct id_slot_s id_slot_t;
+struct id_slot_s {
+	unsigned int conn;
+	int session;					//-1: 空
+};
+
+static id_slot_t* ids = NULL;
+static unsigned int id_cap = 0;
+static unsigned int id_number = 0;
+
+static id_slot_t* find_id(unsigned int conn)
+{
+	unsigned int i = (conn * 2654435761U) & (id_cap - 1);
+	while (ids[i].session >= 0 && ids[i].conn != conn)
+	{
+		i = (i + 1) & (id_cap - 1);
+	}
+	return &ids[i];
+}
+
+static void add_id(unsigned int conn, int session)
+{
+	if (id_number * 2 >= id_cap)
+	{
+		id_slot_t* old = ids;
+		unsigned int old_cap = id_cap;
+		id_cap = id_cap ? id_cap * 2 : 1024;
+		ids = (id_slot_t*)malloc(sizeof(id_slot_t) * id_cap);
+		assert(ids);
+		unsigned int i = 0;
+		for (; i<id_cap; i++)
+		{
+			ids[i].session = -1;
+		}
+		for (i=0; i<old_cap; i++)
+		{
+			if (old[i].session >= 0)
 			{
-				close_conn(epoll_fd, sockfd);
+				*find_id(old[i].conn) = old[i];
 			}
 		}
+		free(old);
 	}
+	id_slot_t* slot = find_id(conn);
+	if (slot->session < 0)
+	{
+		id_number++;
+	}
+	slot->conn = conn;
+	slot->session = session;
+}
+
+static int compare_sessions(const void* a, const void* b)
+{
+	const session_t* x = (const session_t*)a;
+	const session_t* y = (const session_t*)b;
+	return x->open < y->open ? -1 : x->open > y->open;
+}
+
+static int load_capture(const char* filename)
+{
+	FILE* fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		perror(filename);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	capture = (char*)malloc(size > 0 ? size : 1);
+	assert(capture);
+	if (size < 8 || fread(capture, 1, size, fp) != (size_t)size
+			|| memcmp(capture, CAPTURE_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s: not a capture file\n", filename);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	int cap = 0;
+	unsigned long first = ULONG_MAX;
+	const char* p = capture + 8;
+	const char* end = capture + size;
+	while (p + sizeof(capture_record_t) <= end)
+	{
+		capture_record_t record;
+		memcpy(&record, p, sizeof(record));
+		const char* data = p + sizeof(record);
+		if (data + record.length > end)
+		{
+			fprintf(stderr, "%s: truncated at offset %ld\n", filename, (long)(p - capture));
+			break;
+		}
+		p = data + record.length;
+
+		if (record.type == CAPTURE_OPEN && record.length == sizeof(unsigned long))
+		{
+			if (session_number == cap)
+			{
+				cap = cap ? cap * 2 : 1024;
+				sessions = (session_t*)realloc(sessions, sizeof(session_t) * cap);
+				assert(sessions);
+			}
+			session_t* s = &sessions[session_number];
+			memset(s, 0, sizeof(*s));
+			memcpy(&s->open, data, sizeof(s->open));
+			first = s->open < first ? s->open : first;
+			add_id(record.conn, session_number++);
+		}
+		else if (record.type == CAPTURE_DATA && record.length > 0)
+		{
+			/* 打开记录之前的数据属于capture开始前就存在的连接， 忽略 */
+			id_slot_t* slot = id_cap ? find_id(record.conn) : NULL;
+			if (slot == NULL || slot->session < 0)
+			{
+				continue;
+			}
+			session_t* s = &sessions[slot->session];
+			if (s->chunk_number == s->chunk_cap)
+			{
+				s->chunk_cap = s->chunk_cap ? s->chunk_cap * 2 : 8;
+				s->chunks = (chunk_t*)realloc(s->chunks, sizeof(chunk_t) * s->chunk_cap);
+				assert(s->chunks);
+			}
+			chunk_t* k = &s->chunks[s->chunk_number++];
+			k->at = record.at;
+			k->data = data;
+			k->length = record.length;
+		}
+	}
+	free(ids);
+
+	/* 没有发送过数据的连接不回放 */
+	int i = 0, n = 0;
+	for (; i<session_number; i++)
+	{
+		if (sessions[i].chunk_number > 0)
+		{
+			sessions[i].open -= first;
+			sessions[n++] = sessions[i];
+		}
+	}
+	session_number = n;
+	qsort(sessions, session_number, sizeof(session_t), compare_sessions);
+	if (session_number == 0)
+	{
+		fprintf(stderr, "%s: no connection sent data\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned long scaled(unsigned long usec)
+{
+	return speed > 0 ? (unsigned long)(usec / speed) : 0;
+}
+
+/* complete requests in data, a "\r\n\r\n" may span chunks */
+static int count_requests(const char* data, int length, int* match)
+{
+	static const char end[] = "\r\n\r\n";
+	int n = 0;
+	int i = 0;
+	for (; i<length; i++)
+	{
+		if (data[i] == end[*match])
+		{
+			if (++*match == 4)
+			{
+				n++;
+				*match = 0;
+			}
+		}
+		else
+		{
+			*match = data[i] == '\r' ? 1 : 0;
+		}
+	}
+	return n;
+}
+
+static int requests_left(const session_t* s)
+{
+	int match = s->match;
+	int n = 0;
+	int i = s->next;
+	for (; i<s->chunk_number; i++)
+	{
+		n += count_requests(s->chunks[i].data, s->chunks[i].length, &match);
+	}
+	return n;
+}
+
+/* send the chunks of s that are due; at full speed a chunk waits until the
+ * requests before it are answered */
+static unsigned long send_chunks(worker_t* w, client_t* c, session_t* s, unsigned long now)
+{
+	unsigned long next = ULONG_MAX;
+	while (c->connected && s->next < s->chunk_number)
+	{
+		const chunk_t* k = &s->chunks[s->next];
+		unsigned long due = s->started + scaled(k->at);
+		if (speed > 0 && due > now)
+		{
+			next = due;
+			break;
+		}
+		if (speed == 0)
+		{
+			if (c->outstanding > 0)
+			{
+				break;
+			}
+			due = now;
+		}
+
+		int match = s->match;
+		int n = count_requests(k->data, k->length, &match);
+		if (c->out_len + k->length > OUT_BUFFER_SIZE || c->outstanding + n > MAX_PIPELINE)
+		{
+			break;
+		}
+		memcpy(c->out + c->out_len, k->data, k->length);
+		c->out_len += k->length;
+		s->match = match;
+		int i = 0;
+		for (; i<n; i++)
+		{
+			c->due[(c->head + c->outstanding) % MAX_PIPELINE] = due;
+			c->outstanding++;
+		}
+		s->next++;
+	}
+	flush_client(w, c);
+	return next;
+}
+
+static client_t* free_client(worker_t* w)
+{
+	int i = 0;
+	for (; i<w->client_number; i++)
+	{
+		if (w->clients[i].session == NULL)
+		{
+			return &w->clients[i];
+		}
+	}
+	return NULL;
+}
+
+/* sessions id, id + threads, ... in the order they were opened, at most
+ * client_number at a time; latencies count from the recorded time */
+static void* run_replay(void* arg)
+{
+	worker_t* w = (worker_t*)arg;
+	struct epoll_event events[1024];
+	w->epollfd = epoll_create(100);
+
+	int i = 0;
+	for (; i<w->client_number; i++)
+	{
+		w->clients[i].fd = -1;
+		close_client(w, &w->clients[i], FALSE);
+	}
+
+	unsigned long start = now_usec();
+	unsigned long end = duration_set ? start + (unsigned long)duration * 1000000 : ULONG_MAX;
+	unsigned long last_check = start;
+	int next_session = w->id;
+
+	while (true)
+	{
+		unsigned long now = now_usec();
+		unsigned long wake = now + 10000;
+
+		while (next_session < session_number && now < end)
+		{
+			session_t* s = &sessions[next_session];
+			unsigned long due = start + scaled(s->open);
+			if (speed > 0 && due > now)
+			{
+				wake = due < wake ? due : wake;
+				break;
+			}
+			client_t* c = free_client(w);
+			if (c == NULL)
+			{
+				break;
+			}
+			s->started = speed > 0 ? due : now;
+			open_client(w, c);
+			if (c->fd >= 0)
+			{
+				c->session = s;
+			}
+			else
+			{
+				w->unsent += requests_left(s);
+			}
+			next_session += threads;
+		}
+
+		int active = 0;
+		for (i=0; i<w->client_number; i++)
+		{
+			client_t* c = &w->clients[i];
+			session_t* s = c->session;
+			if (s == NULL)
+			{
+				continue;
+			}
+			/* 服务器关闭了连接或者超时 */
+			if (c->fd < 0)
+			{
+				w->unsent += requests_left(s);
+				c->session = NULL;
+				continue;
+			}
+			unsigned long due = send_chunks(w, c, s, now);
+			if (c->fd >= 0 && s->next == s->chunk_number && c->outstanding == 0 && c->out_len == 0)
+			{
+				close_client(w, c, FALSE);
+				c->session = NULL;
+				continue;
+			}
+			wake = due < wake ? due : wake;
+			active++;
+		}
+
+		if (active == 0 && (next_session >= session_number || now >= end))
+		{
+			break;
+		}
+		if (duration_set && now >= end + (unsigned long)timeout * 1000000)
+		{
+			break;
+		}
+
+		if (now - last_check > 100000)
+		{
+			check_timeouts(w, now);
+			last_check = now;
+		}
+
+		int number = epoll_wait(w->epollfd, events, 1024, wake > now ? (int)((wake - now) / 1000) : 0);
+		for (i=0; i<number; i++)
+		{
+			handle_event(w, (client_t*)events[i].data.ptr, events[i].events);
+		}
+	}
+
+	for (i=0; i<w->client_number; i++)
+	{
+		client_t* c = &w->clients[i];
+		if (c->session)
+		{
+			w->unsent += requests_left(c->session);
+			c->session = NULL;
+		}
+		close_client(w, c, TRUE);
+	}
+	for (; next_session < session_number; next_session += threads)
+	{
+		w->unsent += requests_left(&sessions[next_session]);
+	}
+	close(w->epollfd);
+	return NULL;
+}
+
+/* connections that stay open for the whole run without sending a request,
+ * or with stall_path that request it and never read the response */
+static int open_idle(int* fds)
+{
+	char request[2048];
+	int len = 0;
+	if (stall_path)
+	{
+		len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: stall\r\n"
+				"Connection: keep-alive\r\n\r\n", stall_path);
+	}
+
+	int opened = 0;
+	int i = 0;
+	for (; i<idle; i++)
+	{
+		fds[i] = socket(PF_INET, SOCK_STREAM, 0);
+		if (fds[i] < 0)
+		{
+			continue;
+		}
+		/* 小的接收缓冲区， 让服务器很快写满 */
+		int size = 4096;
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		if (connect(fds[i], (struct sockaddr*)&server, sizeof(server)) < 0
+				|| (len > 0 && send(fds[i], request, len, 0) != len))
+		{
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+		opened++;
+	}
+	return opened;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [options] ip port\n"
+			"  -r rate         requests per second over all connections (1000)\n"
+			"  -c connections  connections kept open (10)\n"
+			"  -t threads      threads, each with its share of rate and connections (1)\n"
+			"  -d seconds      how long to send requests (10)\n"
+			"  -p depth        requests pipelined on a keep-alive connection (1)\n"
+			"  -k on|off       keep connections alive (on)\n"
+			"  -f file         request mix, lines of \"[weight] path\" (GET /index.html)\n"
+			"  -T seconds      give up on a request without answer after this (5)\n"
+			"  -i number       extra connections kept idle during the run (0)\n"
+			"  -s path         the idle connections request path and never read\n"
+			"  -R file         replay the connections of a capture file instead, at\n"
+			"                  most -c at a time; -d then limits the replay\n"
+			"  -x speed        replay speed, 2 for twice as fast, max for no pauses (1)\n"
+			"The result is printed as one JSON object on stdout.\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "r:c:t:d:p:k:f:T:i:s:R:x:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r': rate = atof(optarg); break;
+		case 'c': connections = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); duration_set = TRUE; break;
+		case 'p': pipeline = atoi(optarg); break;
+		case 'k': keepalive = strcmp(optarg, "off") != 0; break;
+		case 'f': mix_file = optarg; break;
+		case 'T': timeout = atoi(optarg); break;
+		case 'i': idle = atoi(optarg); break;
+		case 's': stall_path = optarg; break;
+		case 'R': replay_file = optarg; break;
+		case 'x': speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2 || rate <= 0 || connections <= 0 || threads <= 0
+			|| threads > MAX_THREADS || threads > connections || duration <= 0
+			|| pipeline <= 0 || pipeline > MAX_PIPELINE || timeout <= 0 || idle < 0 || speed < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	bzero(&server, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(atoi(argv[optind + 1]));
+	if (inet_pton(AF_INET, argv[optind], &server.sin_addr) != 1)
+	{
+		fprintf(stderr, "invalid address %s\n", argv[optind]);
+		return 1;
+	}
+	if (replay_file)
+	{
+		/* 是否保持连接由回放的请求和服务器决定 */
+		keepalive = TRUE;
+		if (load_capture(replay_file) < 0)
+		{
+			return 1;
+		}
+	}
+	else if (mix_file ? load_mix(mix_file) < 0 : add_request("/index.html", 1) < 0)
+	{
+		return 1;
+	}
+
+	worker_t* workers = (worker_t*)calloc(threads, sizeof(worker_t));
+	client_t* clients = (client_t*)calloc(connections, sizeof(client_t));
+	int* idle_fds = (int*)calloc(idle + 1, sizeof(int));
+	assert(workers && clients && idle_fds);
+	int idle_opened = open_idle(idle_fds);
+
+	unsigned long start = now_usec();
+	int i = 0;
+	int first = 0;
+	for (; i<threads; i++)
+	{
+		worker_t* w = &workers[i];
+		w->id = i;
+		w->seed = i + 1;
+		w->rate = rate / threads;
+		w->client_number = connections / threads + (i < connections % threads ? 1 : 0);
+		w->clients = &clients[first];
+		first += w->client_number;
+		assert(pthread_create(&w->thread, NULL, replay_file ? run_replay : run_worker, w) == 0);
+	}
+
+	unsigned long* histogram = (unsigned long*)calloc(BUCKETS, sizeof(unsigned long));
+	unsigned long completed = 0, errors = 0, unsent = 0, bytes = 0, max = 0;
+	unsigned long status[6] = { 0 };
+	for (i=0; i<threads; i++)
+	{
+		worker_t* w = &workers[i];
+		pthread_join(w->thread, NULL);
+		int j = 0;
+		for (; j<BUCKETS; j++)
+		{
+			histogram[j] += w->histogram[j];
+		}
+		for (j=0; j<6; j++)
+		{
+			status[j] += w->status[j];
+		}
+		completed += w->completed;
+		errors += w->errors;
+		unsent += w->unsent;
+		bytes += w->bytes;
+		max = w->max_latency > max ? w->max_latency : max;
+	}
+	for (i=0; i<idle; i++)
+	{
+		if (idle_fds[i] >= 0)
+		{
+			close(idle_fds[i]);
+		}
+	}
+	/* 回放的时间由capture决定 */
+	double seconds = replay_file ? (now_usec() - start) / 1000000.0 : duration;
+
+	if (replay_file)
+	{
+		printf("{\"replay\":\"%s\",\"speed\":%.1f,\"sessions\":%d,", replay_file, speed,
+				session_number);
+	}
+	else
+	{
+		printf("{\"target_rate\":%.1f,", rate);
+	}
+
+	printf("\"connections\":%d,\"threads\":%d,\"duration\":%.1f,"
+			"\"pipeline\":%d,\"keepalive\":%s,\"idle\":%d,\"completed\":%lu,\"errors\":%lu,\"unsent\":%lu,"
+			"\"throughput\":%.1f,\"bytes\":%lu,"
+			"\"latency_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu},"
+			"\"status\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,"
+			"\"other\":%lu}}\n",
+			connections, threads, seconds, pipeline, keepalive ? "true" : "false", idle_opened,
+			completed, errors, unsent, (double)completed / seconds, bytes,
+			quantile(histogram, completed, max, 0.5), quantile(histogram, completed, max, 0.9),
+			quantile(histogram, completed, max, 0.99), quantile(histogram, completed, max, 0.999),
+			max, status[1], status[2], status[3], status[4], status[5], status[0]);
+	return errors || unsent ? 2 : 0;
 }